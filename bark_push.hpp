@@ -2,6 +2,7 @@
 #define BARK_PUSH_HPP
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <map>
 #include <vector>
@@ -10,6 +11,53 @@
 #include <iomanip>
 #include <stdexcept>
 #include <regex>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <random>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef BARK_PUSH_USE_OPENSSL
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#endif
 
 const std::string DEFAULT_BARK_SERVER = "https://api.day.app/";
 
@@ -21,7 +69,10 @@ enum class BarkError
     HTTP_ERROR,
     NETWORK_ERROR,
     EMPTY_RESPONSE,
-    NO_DEVICES_SPECIFIED
+    NO_DEVICES_SPECIFIED,
+    RATE_LIMITED,
+    DUPLICATE_SUPPRESSED,
+    EXPIRED
 };
 
 inline std::string barkErrorToString(BarkError err)
@@ -35,391 +86,6498 @@ inline std::string barkErrorToString(BarkError err)
         case BarkError::NETWORK_ERROR: return "Network communication error";
         case BarkError::EMPTY_RESPONSE: return "Server returned empty response";
         case BarkError::NO_DEVICES_SPECIFIED: return "No device keys specified";
+        case BarkError::RATE_LIMITED: return "Rate limit exceeded";
+        case BarkError::DUPLICATE_SUPPRESSED: return "Duplicate notification suppressed";
+        case BarkError::EXPIRED: return "Notification expired";
         default: return "Unknown error";
     }
 }
 
-class BarkPush
+inline bool barkInitCurlGlobal()
 {
-private:
-    std::vector<std::string> device_keys_;
-    std::string server_;
-    CURL *curl_handle_;
-    std::string last_error_;
-    long http_status_code_;
-
-    BarkPush(const BarkPush&) = delete;
-    BarkPush& operator=(const BarkPush&) = delete;
-
-    static bool initCurlGlobal()
+    static const bool initialized = []()
     {
-        static bool initialized = false;
-        if (!initialized)
+        CURLcode res = curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (res != CURLE_OK)
         {
-            CURLcode res = curl_global_init(CURL_GLOBAL_DEFAULT);
-            if (res != CURLE_OK)
-            {
-                std::cerr << "Global cURL initialization failed: " << curl_easy_strerror(res) << std::endl;
-                return false;
-            }
-            initialized = true;
-            std::atexit([]() { curl_global_cleanup(); });
+            std::cerr << "Global cURL initialization failed: " << curl_easy_strerror(res) << std::endl;
+            return false;
         }
+        std::atexit([]() { curl_global_cleanup(); });
         return true;
+    }();
+    return initialized;
+}
+
+struct BarkSharedEngineTag
+{
+    explicit BarkSharedEngineTag() = default;
+};
+
+inline constexpr BarkSharedEngineTag BARK_SHARED_ENGINE{};
+
+struct BarkPoolOptions
+{
+    size_t max_connections_per_host = 0;
+    std::chrono::seconds idle_timeout{0};
+    std::chrono::seconds max_connection_age{0};
+    double age_jitter = 0.2;
+    std::chrono::seconds keepalive_interval{0};
+};
+
+struct BarkPoolStats
+{
+    uint64_t requests = 0;
+    uint64_t reused = 0;
+    uint64_t connections_opened = 0;
+    uint64_t connections_closed = 0;
+    uint64_t host_waits = 0;
+};
+
+class BarkEngine
+{
+private:
+    CURLSH *share_handle_;
+    std::mutex mutex_;
+    std::condition_variable host_cv_;
+    // With a per-host cap each pooled handle keeps at most one connection,
+    // so a host's connection count is the handles leased to it plus the idle
+    // handles whose connection still points at it.
+    struct IdleHandle
+    {
+        CURL *handle;
+        std::string host;
+    };
+
+    struct HostSlots
+    {
+        size_t connections = 0;
+        size_t waiters = 0;
+    };
+
+    std::vector<IdleHandle> idle_handles_;
+    std::mutex share_locks_[CURL_LOCK_DATA_LAST];
+    BarkPoolOptions pool_options_;
+    std::unordered_map<std::string, HostSlots> hosts_;
+    std::atomic<uint64_t> requests_;
+    std::atomic<uint64_t> reused_;
+    std::atomic<uint64_t> connections_opened_;
+    std::atomic<uint64_t> connections_closed_;
+    std::atomic<uint64_t> host_waits_;
+
+    BarkEngine(const BarkEngine&) = delete;
+    BarkEngine& operator=(const BarkEngine&) = delete;
+
+    BarkEngine()
+        : share_handle_(nullptr), requests_(0), reused_(0), connections_opened_(0),
+          connections_closed_(0), host_waits_(0)
+    {
+        if (!barkInitCurlGlobal())
+            return;
+
+        share_handle_ = curl_share_init();
+        if (!share_handle_)
+            return;
+
+        curl_share_setopt(share_handle_, CURLSHOPT_LOCKFUNC, lockCallback);
+        curl_share_setopt(share_handle_, CURLSHOPT_UNLOCKFUNC, unlockCallback);
+        curl_share_setopt(share_handle_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        // Connections stay with the handle that opened them; libcurl does not
+        // support sharing a connection cache between handles used concurrently.
+        curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
     }
 
-    static std::string normalizeUrl(const std::string &url)
+    static void lockCallback(CURL *, curl_lock_data data, curl_lock_access, void *userptr)
     {
-        if (url.empty())
-            return url;
-        
-        const std::string http_prefix = "http://";
-        const std::string https_prefix = "https://";
-        
-        if (url.size() >= http_prefix.size() && url.substr(0, http_prefix.size()) == http_prefix)
-            return url;
-        if (url.size() >= https_prefix.size() && url.substr(0, https_prefix.size()) == https_prefix)
-            return url;
-            
-        return https_prefix + url;
+        static_cast<BarkEngine *>(userptr)->share_locks_[data].lock();
     }
 
-    static std::string escapeJson(const std::string &input)
+    static void unlockCallback(CURL *, curl_lock_data data, void *userptr)
     {
-        std::ostringstream output;
-        for (char c : input)
-        {
-            switch (c)
-            {
-            case '"':  output << "\\\""; break;
-            case '\\': output << "\\\\"; break;
-            case '\b': output << "\\b"; break;
-            case '\f': output << "\\f"; break;
-            case '\n': output << "\\n"; break;
-            case '\r': output << "\\r"; break;
-            case '\t': output << "\\t"; break;
-            default:
-                if (static_cast<unsigned char>(c) <= 0x1F)
-                {
-                    output << "\\u" << std::setw(4) << std::setfill('0')
-                           << std::hex << static_cast<int>(c);
-                }
-                else
-                {
-                    output << c;
-                }
-            }
-        }
-        return output.str();
+        static_cast<BarkEngine *>(userptr)->share_locks_[data].unlock();
     }
 
-    static size_t writeCallback(void *contents, size_t size, size_t nmemb, std::string *s)
+    static int closeSocketCallback(void *clientp, curl_socket_t socket)
     {
-        size_t newLength = size * nmemb;
-        try
+        static_cast<BarkEngine *>(clientp)->connections_closed_.fetch_add(1, std::memory_order_relaxed);
+#ifdef _WIN32
+        return closesocket(socket);
+#else
+        return close(socket);
+#endif
+    }
+
+    static std::string hostKey(const std::string &url)
+    {
+        size_t start = url.find("://");
+        start = start == std::string::npos ? 0 : start + 3;
+        size_t end = url.find_first_of("/?#", start);
+        return url.substr(0, end);
+    }
+
+    static void applyPoolOptions(CURL *handle, const BarkPoolOptions &options)
+    {
+        static thread_local std::minstd_rand random(std::random_device{}());
+        long idle_timeout = static_cast<long>(options.idle_timeout.count());
+        curl_easy_setopt(handle, CURLOPT_MAXAGE_CONN, idle_timeout > 0 ? idle_timeout : 118L);
+        curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, options.max_connections_per_host > 0 ? 1L : 5L);
+#if LIBCURL_VERSION_NUM >= 0x075000
+        long max_age = 0;
+        if (options.max_connection_age.count() > 0)
         {
-            s->append(static_cast<char *>(contents), newLength);
-            return newLength;
+            double jitter = std::min(std::max(options.age_jitter, 0.0), 1.0);
+            double scale = 1.0 - jitter * std::uniform_real_distribution<double>(0.0, 1.0)(random);
+            max_age = std::max(1L, static_cast<long>(options.max_connection_age.count() * scale));
         }
-        catch (...)
+        curl_easy_setopt(handle, CURLOPT_MAXLIFETIME_CONN, max_age);
+#endif
+        long keepalive = static_cast<long>(options.keepalive_interval.count());
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, keepalive > 0 ? 1L : 0L);
+        if (keepalive > 0)
         {
-            return 0;
+            curl_easy_setopt(handle, CURLOPT_TCP_KEEPIDLE, keepalive);
+            curl_easy_setopt(handle, CURLOPT_TCP_KEEPINTVL, keepalive);
         }
     }
 
-    bool setCurlOption(CURLoption option, const char* value)
+    using HostMap = std::unordered_map<std::string, HostSlots>;
+
+    void eraseUnusedHostLocked(HostMap::iterator it)
     {
-        CURLcode res = curl_easy_setopt(curl_handle_, option, value);
-        if (res != CURLE_OK)
-        {
-            last_error_ = "Failed to set cURL option: " + std::string(curl_easy_strerror(res));
-            return false;
-        }
-        return true;
+        if (it->second.connections == 0 && it->second.waiters == 0)
+            hosts_.erase(it);
     }
 
-    bool setCurlOption(CURLoption option, long value)
+    // Takes an idle handle out of the pool. A handle still holding a
+    // connection to another host gives up that host's slot.
+    CURL *popIdleLocked(size_t index)
     {
-        CURLcode res = curl_easy_setopt(curl_handle_, option, value);
-        if (res != CURLE_OK)
+        IdleHandle idle = std::move(idle_handles_[index]);
+        idle_handles_.erase(idle_handles_.begin() + static_cast<std::ptrdiff_t>(index));
+        if (!idle.host.empty())
         {
-            last_error_ = "Failed to set cURL option: " + std::string(curl_easy_strerror(res));
-            return false;
+            auto it = hosts_.find(idle.host);
+            if (it != hosts_.end() && it->second.connections > 0)
+            {
+                --it->second.connections;
+                eraseUnusedHostLocked(it);
+                host_cv_.notify_all();
+            }
         }
-        return true;
+        return idle.handle;
     }
 
-    bool setCurlOption(CURLoption option, size_t (*callback)(void*, size_t, size_t, std::string*))
+    // Prefers an idle handle already connected to the host; otherwise takes
+    // a new slot if the host is under its cap. Leaves `handle` null when a
+    // fresh one has to be created.
+    bool takeHostHandleLocked(HostMap::iterator it, CURL *&handle)
     {
-        CURLcode res = curl_easy_setopt(curl_handle_, option, callback);
-        if (res != CURLE_OK)
+        for (size_t i = idle_handles_.size(); i-- > 0;)
         {
-            last_error_ = "Failed to set cURL callback: " + std::string(curl_easy_strerror(res));
+            if (idle_handles_[i].host == it->first)
+            {
+                handle = idle_handles_[i].handle;
+                idle_handles_.erase(idle_handles_.begin() + static_cast<std::ptrdiff_t>(i));
+                return true;
+            }
+        }
+        size_t cap = pool_options_.max_connections_per_host;
+        if (cap != 0 && it->second.connections >= cap)
             return false;
+        ++it->second.connections;
+        for (size_t i = idle_handles_.size(); i-- > 0;)
+        {
+            if (idle_handles_[i].host.empty())
+            {
+                handle = popIdleLocked(i);
+                return true;
+            }
         }
+        if (!idle_handles_.empty())
+            handle = popIdleLocked(0);
         return true;
     }
 
 public:
-    BarkPush(const std::string &single_key, const std::string &server = DEFAULT_BARK_SERVER)
-        : server_(server), curl_handle_(nullptr), http_status_code_(0)
+    class Lease
     {
-        if (!single_key.empty())
+    private:
+        BarkEngine *engine_;
+        CURL *handle_;
+        const std::string *host_;
+        bool timed_out_;
+
+    public:
+        Lease() noexcept : engine_(nullptr), handle_(nullptr), host_(nullptr), timed_out_(false) {}
+        Lease(BarkEngine *engine, CURL *handle, const std::string *host = nullptr) noexcept
+            : engine_(engine), handle_(handle), host_(host), timed_out_(false)
         {
-            device_keys_.push_back(single_key);
         }
-        init();
-    }
 
-    BarkPush(const std::vector<std::string> &multi_keys, const std::string &server = DEFAULT_BARK_SERVER)
-        : device_keys_(multi_keys), server_(server), curl_handle_(nullptr), http_status_code_(0)
-    {
-        init();
-    }
+        Lease(Lease &&other) noexcept
+            : engine_(other.engine_), handle_(other.handle_), host_(other.host_), timed_out_(other.timed_out_)
+        {
+            other.handle_ = nullptr;
+            other.host_ = nullptr;
+        }
 
-    ~BarkPush()
-    {
-        if (curl_handle_)
+        Lease& operator=(Lease &&other) noexcept
         {
-            curl_easy_cleanup(curl_handle_);
-            curl_handle_ = nullptr;
+            if (this != &other)
+            {
+                reset();
+                engine_ = other.engine_;
+                handle_ = other.handle_;
+                host_ = other.host_;
+                timed_out_ = other.timed_out_;
+                other.handle_ = nullptr;
+                other.host_ = nullptr;
+            }
+            return *this;
         }
-    }
 
-    void addDeviceKey(const std::string &key)
-    {
-        if (!key.empty())
+        ~Lease()
         {
-            device_keys_.push_back(key);
+            reset();
         }
-    }
 
-    void clearDeviceKeys()
-    {
-        device_keys_.clear();
-    }
+        static Lease expired() noexcept
+        {
+            Lease lease;
+            lease.timed_out_ = true;
+            return lease;
+        }
 
-    std::vector<std::string> getDeviceKeys() const
-    {
-        return device_keys_;
-    }
+        CURL *get() const
+        {
+            return handle_;
+        }
 
-    void setDefaultOptions()
-    {
-        if (!curl_handle_)
-            return;
-            
-        setCurlOption(CURLOPT_CONNECTTIMEOUT, 5L);
-        setCurlOption(CURLOPT_TIMEOUT, 10L);
-        setCurlOption(CURLOPT_SSL_VERIFYPEER, 1L);
-        setCurlOption(CURLOPT_SSL_VERIFYHOST, 2L);
-        setCurlOption(CURLOPT_USERAGENT, "BarkPush-C++/1.0");
-    }
+        // True when acquire() gave up waiting for a connection to the host.
+        bool timedOut() const
+        {
+            return timed_out_;
+        }
 
-    void disableSslVerification()
+        void reset()
+        {
+            if (handle_)
+            {
+                engine_->release(handle_, host_);
+                handle_ = nullptr;
+                host_ = nullptr;
+            }
+        }
+    };
+
+    ~BarkEngine()
     {
-        if (curl_handle_)
+        for (IdleHandle &idle : idle_handles_)
+        {
+            curl_easy_cleanup(idle.handle);
+        }
+        idle_handles_.clear();
+        if (share_handle_)
         {
-            setCurlOption(CURLOPT_SSL_VERIFYPEER, 0L);
-            setCurlOption(CURLOPT_SSL_VERIFYHOST, 0L);
+            curl_share_cleanup(share_handle_);
+            share_handle_ = nullptr;
         }
     }
 
-    std::string getLastError() const
+    static BarkEngine &instance()
     {
-        return last_error_;
+        static BarkEngine engine;
+        return engine;
     }
 
-    long getLastHttpStatusCode() const
+    void configurePool(const BarkPoolOptions &options)
     {
-        return http_status_code_;
+        std::lock_guard<std::mutex> lock(mutex_);
+        pool_options_ = options;
+        host_cv_.notify_all();
     }
 
-    BarkError send(const std::string &title,
-                   const std::string &message,
-                   const std::map<std::string, std::string> &params = {})
+    BarkPoolOptions poolOptions()
     {
-        last_error_.clear();
-        http_status_code_ = 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pool_options_;
+    }
 
-        if (device_keys_.empty())
+    // Waits at most `timeout` for a connection slot when the host is at its
+    // cap; the default matches the request timeout of pooled handles.
+    Lease acquire(const std::string &url = std::string(), const std::string &proxy = std::string(),
+                  std::chrono::milliseconds timeout = std::chrono::seconds(10))
+    {
+        CURL *handle = nullptr;
+        const std::string *host = nullptr;
+        BarkPoolOptions options;
         {
-            last_error_ = "No device keys specified";
-            return BarkError::NO_DEVICES_SPECIFIED;
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!url.empty() && pool_options_.max_connections_per_host > 0)
+            {
+                std::string key = hostKey(url);
+                if (!proxy.empty())
+                    key += " via " + hostKey(proxy);
+                auto it = hosts_.emplace(std::move(key), HostSlots()).first;
+                ++it->second.waiters;
+                bool taken = takeHostHandleLocked(it, handle);
+                if (!taken)
+                {
+                    host_waits_.fetch_add(1, std::memory_order_relaxed);
+                    taken = host_cv_.wait_for(lock, timeout, [&]() { return takeHostHandleLocked(it, handle); });
+                }
+                --it->second.waiters;
+                if (!taken)
+                {
+                    eraseUnusedHostLocked(it);
+                    return Lease::expired();
+                }
+                host = &it->first;
+            }
+            else if (!idle_handles_.empty())
+            {
+                handle = popIdleLocked(idle_handles_.size() - 1);
+            }
+            options = pool_options_;
         }
 
-        if (!curl_handle_)
+        if (!handle && share_handle_)
         {
-            last_error_ = "cURL handle not initialized";
-            return BarkError::CURL_INIT_FAILED;
+            handle = curl_easy_init();
+            if (handle)
+            {
+                curl_easy_setopt(handle, CURLOPT_SHARE, share_handle_);
+                curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 5L);
+                curl_easy_setopt(handle, CURLOPT_TIMEOUT, 10L);
+                curl_easy_setopt(handle, CURLOPT_USERAGENT, "BarkPush-C++/1.0");
+                curl_easy_setopt(handle, CURLOPT_CLOSESOCKETFUNCTION, closeSocketCallback);
+                curl_easy_setopt(handle, CURLOPT_CLOSESOCKETDATA, this);
+            }
         }
 
-        std::string url = server_;
-        if (url.back() != '/')
-            url += '/';
-        url += "push";
-
-        std::map<std::string, std::string> processed_params = params;
-        auto url_it = processed_params.find("url");
-        if (url_it != processed_params.end())
+        if (!handle)
         {
-            url_it->second = normalizeUrl(url_it->second);
+            if (host)
+                release(nullptr, host);
+            return Lease();
         }
 
-        std::ostringstream json_stream;
-        json_stream << "{";
-        json_stream << "\"device_keys\":[";
-        for (size_t i = 0; i < device_keys_.size(); ++i)
+        applyPoolOptions(handle, options);
+        return Lease(this, handle, host);
+    }
+
+    void release(CURL *handle, const std::string *host = nullptr)
+    {
+        if (handle)
         {
-            if (i > 0)
-                json_stream << ",";
-            json_stream << "\"" << escapeJson(device_keys_[i]) << "\"";
+            // Idle handles must not point into the previous caller's buffers.
+            curl_easy_setopt(handle, CURLOPT_HTTPHEADER, static_cast<curl_slist *>(nullptr));
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDS, static_cast<char *>(nullptr));
+            curl_easy_setopt(handle, CURLOPT_READDATA, static_cast<void *>(nullptr));
+            curl_easy_setopt(handle, CURLOPT_SEEKDATA, static_cast<void *>(nullptr));
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, static_cast<void *>(nullptr));
+            curl_easy_setopt(handle, CURLOPT_PRIVATE, static_cast<void *>(nullptr));
         }
-        json_stream << "],";
-        json_stream << "\"title\":\"" << escapeJson(title) << "\",";
-        json_stream << "\"body\":\"" << escapeJson(message) << "\"";
-
-        static const std::regex number_regex("^[-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?$");
-        
-        for (const auto &[key, value] : processed_params)
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (handle)
+            idle_handles_.push_back({handle, host ? *host : std::string()});
+        if (host)
         {
-            json_stream << ",";
-            json_stream << "\"" << key << "\":";
-            
-            if (value == "true" || value == "false")
-            {
-                json_stream << value;
-            }
-            else if (std::regex_match(value, number_regex))
+            // A returned handle keeps its connection to the host, so the
+            // host's count only drops when no handle came back.
+            auto it = hosts_.find(*host);
+            if (!handle && it != hosts_.end() && it->second.connections > 0)
             {
-                json_stream << value;
-            }
-            else
-            {
-                json_stream << "\"" << escapeJson(value) << "\"";
+                --it->second.connections;
+                eraseUnusedHostLocked(it);
             }
+            host_cv_.notify_all();
         }
-        json_stream << "}";
+    }
 
-        std::string json_data = json_stream.str();
+    void recordTransfer(CURL *handle, CURLcode result)
+    {
+        long connects = 0;
+        curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+        requests_.fetch_add(1, std::memory_order_relaxed);
+        connections_opened_.fetch_add(static_cast<uint64_t>(connects), std::memory_order_relaxed);
+        if (connects == 0 && result == CURLE_OK)
+            reused_.fetch_add(1, std::memory_order_relaxed);
+    }
 
-        struct curl_slist *headers = nullptr;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        setCurlOption(CURLOPT_URL, url.c_str());
-        setCurlOption(CURLOPT_POST, 1L);
-        setCurlOption(CURLOPT_POSTFIELDS, json_data.c_str());
-        curl_easy_setopt(curl_handle_, CURLOPT_HTTPHEADER, headers);
-        setCurlOption(CURLOPT_WRITEFUNCTION, writeCallback);
+    BarkPoolStats poolStats() const
+    {
+        BarkPoolStats stats;
+        stats.requests = requests_.load(std::memory_order_relaxed);
+        stats.reused = reused_.load(std::memory_order_relaxed);
+        stats.connections_opened = connections_opened_.load(std::memory_order_relaxed);
+        stats.connections_closed = connections_closed_.load(std::memory_order_relaxed);
+        stats.host_waits = host_waits_.load(std::memory_order_relaxed);
+        return stats;
+    }
 
-        std::string response_string;
-        curl_easy_setopt(curl_handle_, CURLOPT_WRITEDATA, &response_string);
+    size_t idleHandleCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return idle_handles_.size();
+    }
 
-        CURLcode res = curl_easy_perform(curl_handle_);
-        curl_slist_free_all(headers);
+    size_t trackedHostCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hosts_.size();
+    }
+};
 
-        if (res != CURLE_OK)
-        {
-            last_error_ = "cURL error: " + std::string(curl_easy_strerror(res));
-            return BarkError::NETWORK_ERROR;
-        }
+// curl_multi_poll() and curl_multi_wakeup() arrived in libcurl 7.68. Defining
+// BARK_PUSH_NO_MULTI_POLL selects the fallback for older libraries.
+#if LIBCURL_VERSION_NUM >= 0x074400 && !defined(BARK_PUSH_NO_MULTI_POLL)
+#define BARK_PUSH_MULTI_POLL 1
+#endif
 
-        curl_easy_getinfo(curl_handle_, CURLINFO_RESPONSE_CODE, &http_status_code_);
-        if (http_status_code_ != 200)
-        {
-            last_error_ = "HTTP error " + std::to_string(http_status_code_) +
-                          ", Response: " + response_string;
-            return BarkError::HTTP_ERROR;
-        }
+class BarkAsyncEngine
+{
+private:
+    struct Waiter
+    {
+        CURL *handle;
+        CURLcode result;
+        bool done;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
 
-        if (response_string.empty())
-        {
-            last_error_ = "Empty response from server";
-            return BarkError::EMPTY_RESPONSE;
-        }
+    CURLM *multi_handle_;
+    std::mutex mutex_;
+    std::vector<Waiter *> submissions_;
+    bool stopping_;
+    std::atomic<uint64_t> transfers_;
+#ifndef BARK_PUSH_MULTI_POLL
+    std::condition_variable work_cv_;
+#ifndef _WIN32
+    int wake_fds_[2];
+#endif
+#endif
+    std::thread worker_;
 
-        return BarkError::SUCCESS;
+    BarkAsyncEngine(const BarkAsyncEngine&) = delete;
+    BarkAsyncEngine& operator=(const BarkAsyncEngine&) = delete;
+
+    static std::atomic<bool> &routingFlag()
+    {
+        static std::atomic<bool> flag(false);
+        return flag;
     }
 
-    BarkError sendAdvanced(
-        const std::string &title,
-        const std::string &message,
-        const std::string &url = "",
-        const std::string &sound = "",
+    BarkAsyncEngine() : multi_handle_(nullptr), stopping_(false), transfers_(0)
+    {
+        BarkEngine::instance();
+#if !defined(BARK_PUSH_MULTI_POLL) && !defined(_WIN32)
+        wake_fds_[0] = wake_fds_[1] = -1;
+        if (pipe(wake_fds_) != 0)
+            return;
+        for (int fd : wake_fds_)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (!barkInitCurlGlobal() || !(multi_handle_ = curl_multi_init()))
+            return;
+        curl_multi_setopt(multi_handle_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        worker_ = std::thread(&BarkAsyncEngine::workerLoop, this);
+    }
+
+    void wake()
+    {
+#ifdef BARK_PUSH_MULTI_POLL
+        curl_multi_wakeup(multi_handle_);
+#else
+        work_cv_.notify_one();
+#ifndef _WIN32
+        char byte = 1;
+        if (write(wake_fds_[1], &byte, 1) < 0)
+            return;
+#endif
+#endif
+    }
+
+    // Blocks until a running transfer has socket activity or, where the
+    // library offers no wakeup call, until a submission writes to the pipe.
+    void waitForActivity()
+    {
+#ifdef BARK_PUSH_MULTI_POLL
+        curl_multi_poll(multi_handle_, nullptr, 0, 1000, nullptr);
+#elif !defined(_WIN32)
+        curl_waitfd wake = {wake_fds_[0], CURL_WAIT_POLLIN, 0};
+        curl_multi_wait(multi_handle_, &wake, 1, 1000, nullptr);
+        char drained[64];
+        while (read(wake_fds_[0], drained, sizeof(drained)) > 0)
+        {
+        }
+#else
+        curl_multi_wait(multi_handle_, nullptr, 0, 100, nullptr);
+#endif
+    }
+
+    static void complete(Waiter *waiter, CURLcode result)
+    {
+        std::lock_guard<std::mutex> lock(waiter->mutex);
+        waiter->result = result;
+        waiter->done = true;
+        waiter->cv.notify_one();
+    }
+
+    void workerLoop()
+    {
+        std::vector<Waiter *> submitted;
+        size_t active = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+#ifndef BARK_PUSH_MULTI_POLL
+                // Without curl_multi_wakeup an idle worker sleeps here instead
+                // of polling an empty multi handle.
+                if (active == 0)
+                    work_cv_.wait(lock, [this]() { return stopping_ || !submissions_.empty(); });
+#endif
+                if (stopping_)
+                    break;
+                submitted.swap(submissions_);
+            }
+
+            if (!submitted.empty())
+            {
+                size_t host_limit = BarkEngine::instance().poolOptions().max_connections_per_host;
+                curl_multi_setopt(multi_handle_, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(host_limit));
+                for (Waiter *waiter : submitted)
+                {
+                    // Wait for a multiplexed HTTP/2 connection rather than
+                    // opening a parallel one per concurrent send.
+                    curl_easy_setopt(waiter->handle, CURLOPT_PIPEWAIT, 1L);
+                    curl_easy_setopt(waiter->handle, CURLOPT_PRIVATE, waiter);
+                    if (curl_multi_add_handle(multi_handle_, waiter->handle) == CURLM_OK)
+                        ++active;
+                    else
+                        complete(waiter, CURLE_FAILED_INIT);
+                }
+                submitted.clear();
+            }
+
+            int still_running = 0;
+            curl_multi_perform(multi_handle_, &still_running);
+
+            int queued = 0;
+            CURLMsg *message = nullptr;
+            while ((message = curl_multi_info_read(multi_handle_, &queued)))
+            {
+                if (message->msg != CURLMSG_DONE)
+                    continue;
+                CURL *handle = message->easy_handle;
+                CURLcode result = message->data.result;
+                void *waiter = nullptr;
+                curl_easy_getinfo(handle, CURLINFO_PRIVATE, &waiter);
+                curl_multi_remove_handle(multi_handle_, handle);
+                --active;
+                transfers_.fetch_add(1, std::memory_order_relaxed);
+                complete(static_cast<Waiter *>(waiter), result);
+            }
+
+#ifndef BARK_PUSH_MULTI_POLL
+            if (active == 0)
+                continue;
+#endif
+            waitForActivity();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        submitted.insert(submitted.end(), submissions_.begin(), submissions_.end());
+        submissions_.clear();
+        for (Waiter *waiter : submitted)
+            complete(waiter, CURLE_ABORTED_BY_CALLBACK);
+    }
+
+public:
+    ~BarkAsyncEngine()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        if (multi_handle_)
+        {
+            wake();
+            if (worker_.joinable())
+                worker_.join();
+            curl_multi_cleanup(multi_handle_);
+        }
+#if !defined(BARK_PUSH_MULTI_POLL) && !defined(_WIN32)
+        for (int fd : wake_fds_)
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+#endif
+    }
+
+    static BarkAsyncEngine &instance()
+    {
+        static BarkAsyncEngine engine;
+        return engine;
+    }
+
+    static void routeBlockingSends(bool enable = true)
+    {
+        routingFlag().store(enable, std::memory_order_relaxed);
+    }
+
+    static bool routesBlockingSends()
+    {
+        return routingFlag().load(std::memory_order_relaxed);
+    }
+
+    CURLcode perform(CURL *handle)
+    {
+        if (!multi_handle_)
+            return CURLE_FAILED_INIT;
+
+        Waiter waiter;
+        waiter.handle = handle;
+        waiter.result = CURLE_OK;
+        waiter.done = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_)
+                return CURLE_FAILED_INIT;
+            submissions_.push_back(&waiter);
+        }
+        wake();
+
+        std::unique_lock<std::mutex> lock(waiter.mutex);
+        waiter.cv.wait(lock, [&waiter]() { return waiter.done; });
+        return waiter.result;
+    }
+
+    uint64_t transfers() const
+    {
+        return transfers_.load(std::memory_order_relaxed);
+    }
+};
+
+// Threads that stay alive between calls for splitting CPU-bound work such as
+// payload serialization. A caller that finds the pool busy runs inline.
+class BarkWorkPool
+{
+private:
+    using Task = std::function<void(size_t, size_t)>;
+
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::vector<std::thread> workers_;
+    const Task *task_;
+    size_t count_;
+    size_t chunk_;
+    std::atomic<size_t> next_;
+    size_t busy_;
+    uint64_t generation_;
+    bool stopping_;
+
+    BarkWorkPool(const BarkWorkPool&) = delete;
+    BarkWorkPool& operator=(const BarkWorkPool&) = delete;
+
+    void drain(const Task &task, size_t count, size_t chunk)
+    {
+        size_t begin = 0;
+        while ((begin = next_.fetch_add(chunk, std::memory_order_relaxed)) < count)
+            task(begin, std::min(begin + chunk, count));
+    }
+
+    void workerLoop()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            work_cv_.wait(lock, [this, &seen]() { return stopping_ || generation_ != seen; });
+            if (stopping_)
+                return;
+            seen = generation_;
+            if (!task_)
+                continue;
+            const Task *task = task_;
+            size_t count = count_;
+            size_t chunk = chunk_;
+            ++busy_;
+            lock.unlock();
+            drain(*task, count, chunk);
+            lock.lock();
+            if (--busy_ == 0)
+                done_cv_.notify_all();
+        }
+    }
+
+public:
+    explicit BarkWorkPool(size_t threads = std::thread::hardware_concurrency())
+        : task_(nullptr), count_(0), chunk_(1), next_(0), busy_(0), generation_(0), stopping_(false)
+    {
+        for (size_t i = 1; i < threads; ++i)
+            workers_.emplace_back(&BarkWorkPool::workerLoop, this);
+    }
+
+    ~BarkWorkPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_all();
+        for (std::thread &worker : workers_)
+            worker.join();
+    }
+
+    static BarkWorkPool &instance()
+    {
+        static BarkWorkPool pool;
+        return pool;
+    }
+
+    size_t threads() const
+    {
+        return workers_.size() + 1;
+    }
+
+    void parallelFor(size_t count, size_t chunk, const Task &task)
+    {
+        chunk = std::max<size_t>(chunk, 1);
+        std::unique_lock<std::mutex> run_lock(run_mutex_, std::try_to_lock);
+        if (workers_.empty() || count <= chunk || !run_lock.owns_lock())
+        {
+            task(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            count_ = count;
+            chunk_ = chunk;
+            next_.store(0, std::memory_order_relaxed);
+            ++generation_;
+        }
+        work_cv_.notify_all();
+        drain(task, count, chunk);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return busy_ == 0; });
+        task_ = nullptr;
+    }
+};
+
+inline uint64_t barkHash(const char *data, size_t size, uint64_t seed = 1469598103934665603ULL)
+{
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline uint64_t barkHash(const std::string &data, uint64_t seed = 1469598103934665603ULL)
+{
+    return barkHash(data.data(), data.size(), seed);
+}
+
+// Dedup hash of a request from the hashes of its keys fragment and payload
+// tail, so a prepared tail is hashed once however many keys it goes to.
+inline uint64_t barkPayloadHash(uint64_t keys_hash, uint64_t tail_hash)
+{
+    return keys_hash ^ (tail_hash + 0x9e3779b97f4a7c15ULL + (keys_hash << 6) + (keys_hash >> 2));
+}
+
+class BarkClock
+{
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    virtual ~BarkClock() = default;
+
+    virtual time_point now() = 0;
+    virtual void sleepFor(std::chrono::nanoseconds duration) = 0;
+};
+
+class BarkSteadyClock : public BarkClock
+{
+public:
+    static std::shared_ptr<BarkClock> instance()
+    {
+        static std::shared_ptr<BarkClock> clock = std::make_shared<BarkSteadyClock>();
+        return clock;
+    }
+
+    time_point now() override
+    {
+        return std::chrono::steady_clock::now();
+    }
+
+    void sleepFor(std::chrono::nanoseconds duration) override
+    {
+        std::this_thread::sleep_for(duration);
+    }
+};
+
+class BarkVirtualClock : public BarkClock
+{
+private:
+    std::atomic<int64_t> now_ns_;
+
+public:
+    BarkVirtualClock() : now_ns_(0) {}
+
+    time_point now() override
+    {
+        return time_point(std::chrono::nanoseconds(now_ns_.load(std::memory_order_acquire)));
+    }
+
+    void sleepFor(std::chrono::nanoseconds duration) override
+    {
+        if (duration.count() > 0)
+            now_ns_.fetch_add(duration.count(), std::memory_order_acq_rel);
+    }
+
+    void advanceTo(time_point target)
+    {
+        int64_t target_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            target.time_since_epoch()).count();
+        int64_t current = now_ns_.load(std::memory_order_acquire);
+        while (current < target_ns &&
+               !now_ns_.compare_exchange_weak(current, target_ns, std::memory_order_acq_rel))
+        {
+        }
+    }
+};
+
+class BarkLimitBackend
+{
+public:
+    virtual ~BarkLimitBackend() = default;
+
+    virtual size_t leaseTokens(size_t requested) = 0;
+    // Gives back tokens that were leased but not spent on a request.
+    virtual void returnTokens(size_t count) = 0;
+    virtual void checkAndMarkMany(const uint64_t *hashes, size_t count, bool *fresh) = 0;
+    virtual void forgetMany(const uint64_t *hashes, size_t count) = 0;
+};
+
+struct BarkLocalLimitOptions
+{
+    double requests_per_second = 0.0;
+    double burst = 10.0;
+    std::chrono::seconds dedup_window{0};
+    std::chrono::microseconds simulated_latency{0};
+    std::shared_ptr<BarkClock> clock;
+};
+
+class BarkLocalLimitBackend : public BarkLimitBackend
+{
+private:
+    BarkLocalLimitOptions options_;
+    std::shared_ptr<BarkClock> clock_;
+    std::mutex mutex_;
+    double tokens_;
+    BarkClock::time_point last_refill_;
+    std::unordered_map<uint64_t, BarkClock::time_point> marks_;
+    std::atomic<uint64_t> round_trips_;
+
+    void roundTrip()
+    {
+        round_trips_.fetch_add(1, std::memory_order_relaxed);
+        if (options_.simulated_latency.count() > 0)
+            clock_->sleepFor(options_.simulated_latency);
+    }
+
+public:
+    explicit BarkLocalLimitBackend(const BarkLocalLimitOptions &options = BarkLocalLimitOptions())
+        : options_(options), clock_(options.clock ? options.clock : BarkSteadyClock::instance()),
+          tokens_(options.burst), last_refill_(clock_->now()), round_trips_(0)
+    {
+    }
+
+    size_t leaseTokens(size_t requested) override
+    {
+        roundTrip();
+        if (options_.requests_per_second <= 0.0)
+            return requested;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = clock_->now();
+        double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+        tokens_ = std::min(options_.burst, tokens_ + elapsed * options_.requests_per_second);
+        last_refill_ = now;
+        size_t granted = std::min(requested, static_cast<size_t>(tokens_));
+        tokens_ -= static_cast<double>(granted);
+        return granted;
+    }
+
+    void returnTokens(size_t count) override
+    {
+        if (options_.requests_per_second <= 0.0 || count == 0)
+            return;
+        roundTrip();
+        std::lock_guard<std::mutex> lock(mutex_);
+        tokens_ = std::min(options_.burst, tokens_ + static_cast<double>(count));
+    }
+
+    void checkAndMarkMany(const uint64_t *hashes, size_t count, bool *fresh) override
+    {
+        roundTrip();
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = clock_->now();
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (options_.dedup_window.count() <= 0)
+            {
+                fresh[i] = true;
+                continue;
+            }
+            auto [it, inserted] = marks_.emplace(hashes[i], now + options_.dedup_window);
+            fresh[i] = inserted || it->second <= now;
+            if (fresh[i])
+                it->second = now + options_.dedup_window;
+        }
+    }
+
+    void forgetMany(const uint64_t *hashes, size_t count) override
+    {
+        roundTrip();
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; ++i)
+        {
+            marks_.erase(hashes[i]);
+        }
+    }
+
+    uint64_t roundTrips() const
+    {
+        return round_trips_.load(std::memory_order_relaxed);
+    }
+};
+
+struct BarkLeasedLimiterOptions
+{
+    size_t lease_size = 64;
+    std::chrono::seconds dedup_window{0};
+    std::chrono::milliseconds flush_interval{50};
+};
+
+class BarkLeasedLimiter : public BarkLimitBackend
+{
+private:
+    std::shared_ptr<BarkLimitBackend> remote_;
+    BarkLeasedLimiterOptions options_;
+    std::atomic<size_t> local_tokens_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> seen_;
+    // Marks and forgets not yet written to the remote backend. A forget of a
+    // mark still pending cancels it instead.
+    std::unordered_set<uint64_t> pending_marks_;
+    std::unordered_set<uint64_t> pending_forgets_;
+    std::mutex flush_mutex_;
+    std::atomic<uint64_t> remote_duplicates_;
+    bool refill_requested_;
+    bool flush_requested_;
+    bool stopping_;
+    std::thread worker_;
+
+    BarkLeasedLimiter(const BarkLeasedLimiter&) = delete;
+    BarkLeasedLimiter& operator=(const BarkLeasedLimiter&) = delete;
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_)
+        {
+            cv_.wait_for(lock, options_.flush_interval, [this]()
+            {
+                return stopping_ || refill_requested_ || flush_requested_;
+            });
+
+            bool refill = refill_requested_ || local_tokens_.load(std::memory_order_relaxed) < options_.lease_size / 2;
+            refill_requested_ = false;
+            flush_requested_ = false;
+            lock.unlock();
+
+            if (refill)
+            {
+                size_t have = local_tokens_.load(std::memory_order_relaxed);
+                if (have < options_.lease_size)
+                    local_tokens_.fetch_add(remote_->leaseTokens(options_.lease_size - have),
+                                            std::memory_order_relaxed);
+            }
+            flush();
+
+            lock.lock();
+        }
+    }
+
+    void requestFlushLocked()
+    {
+        if (!flush_requested_ && pending_marks_.size() + pending_forgets_.size() >= options_.lease_size)
+        {
+            flush_requested_ = true;
+            cv_.notify_one();
+        }
+    }
+
+public:
+    BarkLeasedLimiter(std::shared_ptr<BarkLimitBackend> remote,
+                      const BarkLeasedLimiterOptions &options = BarkLeasedLimiterOptions())
+        : remote_(std::move(remote)), options_(options), local_tokens_(0), remote_duplicates_(0),
+          refill_requested_(true), flush_requested_(false), stopping_(false)
+    {
+        if (options_.lease_size == 0)
+            options_.lease_size = 1;
+        local_tokens_.store(remote_->leaseTokens(options_.lease_size), std::memory_order_relaxed);
+        refill_requested_ = false;
+        worker_ = std::thread(&BarkLeasedLimiter::workerLoop, this);
+    }
+
+    ~BarkLeasedLimiter() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+        flush();
+    }
+
+    size_t leaseTokens(size_t requested) override
+    {
+        size_t available = local_tokens_.load(std::memory_order_relaxed);
+        size_t granted = 0;
+        do
+        {
+            granted = std::min(requested, available);
+        } while (granted > 0 &&
+                 !local_tokens_.compare_exchange_weak(available, available - granted, std::memory_order_relaxed));
+
+        if (available - granted < options_.lease_size / 2)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!refill_requested_)
+            {
+                refill_requested_ = true;
+                cv_.notify_one();
+            }
+        }
+        return granted;
+    }
+
+    void returnTokens(size_t count) override
+    {
+        local_tokens_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // Answers from the hashes seen by this instance. Fresh hashes are marked
+    // on the remote backend by the next batched flush; a hash another
+    // instance marked first is only counted in remoteDuplicates().
+    void checkAndMarkMany(const uint64_t *hashes, size_t count, bool *fresh) override
+    {
+        if (options_.dedup_window.count() <= 0)
+        {
+            std::fill(fresh, fresh + count, true);
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto [it, inserted] = seen_.emplace(hashes[i], now + options_.dedup_window);
+            fresh[i] = inserted || it->second <= now;
+            if (fresh[i])
+            {
+                it->second = now + options_.dedup_window;
+                pending_marks_.insert(hashes[i]);
+            }
+        }
+
+        if (seen_.size() > 4 * options_.lease_size + 1024)
+        {
+            for (auto it = seen_.begin(); it != seen_.end();)
+                it = it->second <= now ? seen_.erase(it) : std::next(it);
+        }
+        requestFlushLocked();
+    }
+
+    void forgetMany(const uint64_t *hashes, size_t count) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; ++i)
+        {
+            seen_.erase(hashes[i]);
+            if (pending_marks_.erase(hashes[i]) == 0)
+                pending_forgets_.insert(hashes[i]);
+        }
+        requestFlushLocked();
+    }
+
+    // Writes pending forgets, then pending marks, to the remote backend. The
+    // worker calls this every flush_interval and once the batch reaches
+    // lease_size.
+    void flush()
+    {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        std::vector<uint64_t> forgets;
+        std::vector<uint64_t> marks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            forgets.assign(pending_forgets_.begin(), pending_forgets_.end());
+            marks.assign(pending_marks_.begin(), pending_marks_.end());
+            pending_forgets_.clear();
+            pending_marks_.clear();
+        }
+        if (!forgets.empty())
+            remote_->forgetMany(forgets.data(), forgets.size());
+        if (marks.empty())
+            return;
+
+        std::unique_ptr<bool[]> remote_fresh(new bool[marks.size()]);
+        remote_->checkAndMarkMany(marks.data(), marks.size(), remote_fresh.get());
+        for (size_t i = 0; i < marks.size(); ++i)
+        {
+            if (!remote_fresh[i])
+                remote_duplicates_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Hashes this instance let through that another instance had already
+    // marked on the remote backend.
+    uint64_t remoteDuplicates() const
+    {
+        return remote_duplicates_.load(std::memory_order_relaxed);
+    }
+
+    size_t localTokens() const
+    {
+        return local_tokens_.load(std::memory_order_relaxed);
+    }
+};
+
+#ifndef _WIN32
+
+struct BarkSharedLimiterOptions
+{
+    double requests_per_second = 0.0;
+    double burst = 10.0;
+    std::chrono::seconds dedup_window{0};
+    size_t dedup_slots = 4096;
+};
+
+class BarkSharedLimiter : public BarkLimitBackend
+{
+private:
+    static constexpr uint32_t SEGMENT_READY = 0x4241524bu;
+    static constexpr size_t MAX_PROBES = 8;
+
+    // state is 0 until a process claims the segment, then that process's
+    // pid until it has initialized the rest, then SEGMENT_READY.
+    struct Segment
+    {
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> lock_ready;
+        pthread_mutex_t init_lock;
+        int64_t emission_interval_ns;
+        int64_t burst_tolerance_ns;
+        int64_t dedup_window_s;
+        int64_t epoch_ns;
+        uint64_t dedup_slots;
+        std::atomic<int64_t> theoretical_arrival_ns;
+        std::atomic<uint64_t> dedup[1];
+    };
+
+    std::string name_;
+    Segment *segment_;
+    size_t mapped_size_;
+
+    BarkSharedLimiter(const BarkSharedLimiter&) = delete;
+    BarkSharedLimiter& operator=(const BarkSharedLimiter&) = delete;
+
+    static int64_t monotonicNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static size_t segmentSize(size_t dedup_slots)
+    {
+        return sizeof(Segment) + (dedup_slots - 1) * sizeof(std::atomic<uint64_t>);
+    }
+
+    static int64_t emissionInterval(const BarkSharedLimiterOptions &options)
+    {
+        return options.requests_per_second > 0.0 ? static_cast<int64_t>(1e9 / options.requests_per_second) : 0;
+    }
+
+    static int64_t burstTolerance(const BarkSharedLimiterOptions &options)
+    {
+        return static_cast<int64_t>(emissionInterval(options) * std::max(0.0, options.burst - 1.0));
+    }
+
+    void initialize(const BarkSharedLimiterOptions &options, size_t dedup_slots)
+    {
+        segment_->emission_interval_ns = emissionInterval(options);
+        segment_->burst_tolerance_ns = burstTolerance(options);
+        segment_->dedup_window_s = options.dedup_window.count();
+        segment_->epoch_ns = monotonicNanos();
+        segment_->dedup_slots = dedup_slots;
+        segment_->theoretical_arrival_ns.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < dedup_slots; ++i)
+        {
+            segment_->dedup[i].store(0, std::memory_order_relaxed);
+        }
+        segment_->state.store(SEGMENT_READY, std::memory_order_release);
+    }
+
+    // Called after claiming the segment. Initializes while holding the
+    // robust init_lock, so waiters notice if this process dies part way.
+    void claimAndInitialize(const BarkSharedLimiterOptions &options, size_t dedup_slots)
+    {
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&segment_->init_lock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        pthread_mutex_lock(&segment_->init_lock);
+        segment_->lock_ready.store(1, std::memory_order_release);
+        initialize(options, dedup_slots);
+        pthread_mutex_unlock(&segment_->init_lock);
+    }
+
+    // Waits for the process that claimed the segment for as long as it is
+    // alive. Once it holds init_lock, waiters block on the lock and take
+    // over when it reports the owner died; before that they poll the pid.
+    void waitForInitialization(const BarkSharedLimiterOptions &options, size_t dedup_slots)
+    {
+        uint32_t self = static_cast<uint32_t>(::getpid());
+        while (true)
+        {
+            uint32_t state = segment_->state.load(std::memory_order_acquire);
+            if (state == SEGMENT_READY)
+                return;
+            if (state == 0)
+            {
+                if (segment_->state.compare_exchange_strong(state, self, std::memory_order_acq_rel))
+                {
+                    claimAndInitialize(options, dedup_slots);
+                    return;
+                }
+                continue;
+            }
+            if (segment_->lock_ready.load(std::memory_order_acquire))
+            {
+                int rc = pthread_mutex_lock(&segment_->init_lock);
+                if (rc == EOWNERDEAD)
+                {
+                    pthread_mutex_consistent(&segment_->init_lock);
+                    if (segment_->state.load(std::memory_order_acquire) != SEGMENT_READY)
+                    {
+                        segment_->state.store(self, std::memory_order_release);
+                        initialize(options, dedup_slots);
+                    }
+                }
+                if (rc == 0 || rc == EOWNERDEAD)
+                    pthread_mutex_unlock(&segment_->init_lock);
+                else
+                    throw std::runtime_error("Failed to lock shared limiter segment " + name_ + ": " +
+                                             std::strerror(rc));
+                continue;
+            }
+            bool owner_dead = ::kill(static_cast<pid_t>(state), 0) != 0 && errno == ESRCH;
+            if (owner_dead && segment_->state.compare_exchange_strong(state, self, std::memory_order_acq_rel))
+            {
+                claimAndInitialize(options, dedup_slots);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    // Names the options that differ from the ones the segment was
+    // initialized with.
+    std::string configurationMismatch(const BarkSharedLimiterOptions &options, size_t dedup_slots) const
+    {
+        std::string mismatch;
+        auto add = [&mismatch](const char *field)
+        {
+            mismatch += mismatch.empty() ? field : std::string(", ") + field;
+        };
+        if (segment_->emission_interval_ns != emissionInterval(options))
+            add("requests_per_second");
+        else if (segment_->burst_tolerance_ns != burstTolerance(options))
+            add("burst");
+        if (segment_->dedup_window_s != options.dedup_window.count())
+            add("dedup_window");
+        if (segment_->dedup_slots != dedup_slots)
+            add("dedup_slots");
+        return mismatch;
+    }
+
+    uint64_t dedupSlotValue(uint64_t hash, int64_t expires_s) const
+    {
+        uint64_t fingerprint = hash >> 32;
+        if (fingerprint == 0)
+            fingerprint = 1;
+        return (fingerprint << 32) | static_cast<uint32_t>(expires_s);
+    }
+
+public:
+    BarkSharedLimiter(const std::string &name, const BarkSharedLimiterOptions &options = BarkSharedLimiterOptions())
+        : name_(name.empty() || name[0] != '/' ? "/" + name : name), segment_(nullptr), mapped_size_(0)
+    {
+        size_t dedup_slots = std::max<size_t>(options.dedup_slots, 1);
+        int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Failed to open shared limiter segment " + name_ + ": " + std::strerror(errno));
+        }
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat shared limiter segment " + name_);
+        }
+
+        size_t size = static_cast<size_t>(info.st_size);
+        if (size == 0)
+        {
+            size = segmentSize(dedup_slots);
+            if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Failed to size shared limiter segment " + name_);
+            }
+        }
+        else if (size < sizeof(Segment))
+        {
+            ::close(fd);
+            throw std::runtime_error("Shared limiter segment " + name_ + " is truncated");
+        }
+
+        void *mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map shared limiter segment " + name_);
+        }
+
+        segment_ = static_cast<Segment *>(mapping);
+        mapped_size_ = size;
+        size_t capacity = (size - sizeof(Segment)) / sizeof(std::atomic<uint64_t>) + 1;
+        std::string mismatch;
+        try
+        {
+            waitForInitialization(options, std::min(dedup_slots, capacity));
+            mismatch = configurationMismatch(options, dedup_slots);
+        }
+        catch (...)
+        {
+            ::munmap(segment_, mapped_size_);
+            segment_ = nullptr;
+            throw;
+        }
+        if (!mismatch.empty())
+        {
+            ::munmap(segment_, mapped_size_);
+            segment_ = nullptr;
+            throw std::runtime_error("Shared limiter segment " + name_ + " was created with different " +
+                                     mismatch);
+        }
+    }
+
+    ~BarkSharedLimiter() override
+    {
+        if (segment_)
+        {
+            ::munmap(segment_, mapped_size_);
+            segment_ = nullptr;
+        }
+    }
+
+    static bool unlink(const std::string &name)
+    {
+        std::string path = name.empty() || name[0] != '/' ? "/" + name : name;
+        return ::shm_unlink(path.c_str()) == 0;
+    }
+
+    bool tryAcquire()
+    {
+        int64_t interval = segment_->emission_interval_ns;
+        if (interval <= 0)
+            return true;
+
+        int64_t now = monotonicNanos();
+        int64_t tat = segment_->theoretical_arrival_ns.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int64_t next = std::max(tat, now) + interval;
+            if (next - now > segment_->burst_tolerance_ns + interval)
+                return false;
+            if (segment_->theoretical_arrival_ns.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    bool checkAndMark(uint64_t hash)
+    {
+        if (segment_->dedup_window_s <= 0)
+            return true;
+
+        int64_t now_s = (monotonicNanos() - segment_->epoch_ns) / 1000000000;
+        uint64_t claimed = dedupSlotValue(hash, now_s + segment_->dedup_window_s);
+        uint64_t fingerprint = claimed >> 32;
+        size_t slots = static_cast<size_t>(segment_->dedup_slots);
+        size_t start = static_cast<size_t>(hash % slots);
+
+        for (size_t probe = 0; probe < MAX_PROBES && probe < slots; ++probe)
+        {
+            std::atomic<uint64_t> &slot = segment_->dedup[(start + probe) % slots];
+            uint64_t current = slot.load(std::memory_order_acquire);
+            while (true)
+            {
+                bool expired = static_cast<int64_t>(static_cast<uint32_t>(current)) <= now_s;
+                if ((current >> 32) == fingerprint && !expired)
+                    return false;
+                if (current != 0 && !expired)
+                    break;
+                if (slot.compare_exchange_weak(current, claimed, std::memory_order_acq_rel))
+                    return true;
+            }
+        }
+        return true;
+    }
+
+    void forget(uint64_t hash)
+    {
+        if (segment_->dedup_window_s <= 0)
+            return;
+
+        uint64_t fingerprint = dedupSlotValue(hash, 0) >> 32;
+        size_t slots = static_cast<size_t>(segment_->dedup_slots);
+        size_t start = static_cast<size_t>(hash % slots);
+        for (size_t probe = 0; probe < MAX_PROBES && probe < slots; ++probe)
+        {
+            std::atomic<uint64_t> &slot = segment_->dedup[(start + probe) % slots];
+            uint64_t current = slot.load(std::memory_order_acquire);
+            if ((current >> 32) == fingerprint)
+            {
+                slot.compare_exchange_strong(current, 0, std::memory_order_acq_rel);
+                return;
+            }
+        }
+    }
+
+    // Moves the theoretical arrival time back by one emission interval per
+    // token, never past the present.
+    void release(size_t count)
+    {
+        int64_t interval = segment_->emission_interval_ns;
+        if (interval <= 0 || count == 0)
+            return;
+
+        int64_t now = monotonicNanos();
+        int64_t refund = interval * static_cast<int64_t>(count);
+        int64_t tat = segment_->theoretical_arrival_ns.load(std::memory_order_relaxed);
+        while (tat > now &&
+               !segment_->theoretical_arrival_ns.compare_exchange_weak(tat, std::max(now, tat - refund),
+                                                                        std::memory_order_relaxed))
+        {
+        }
+    }
+
+    size_t leaseTokens(size_t requested) override
+    {
+        size_t granted = 0;
+        while (granted < requested && tryAcquire())
+            ++granted;
+        return granted;
+    }
+
+    void returnTokens(size_t count) override
+    {
+        release(count);
+    }
+
+    void checkAndMarkMany(const uint64_t *hashes, size_t count, bool *fresh) override
+    {
+        for (size_t i = 0; i < count; ++i)
+            fresh[i] = checkAndMark(hashes[i]);
+    }
+
+    void forgetMany(const uint64_t *hashes, size_t count) override
+    {
+        for (size_t i = 0; i < count; ++i)
+            forget(hashes[i]);
+    }
+};
+
+#endif
+
+inline uint8_t barkLevelIndex(const std::map<std::string, std::string> &params)
+{
+    auto it = params.find("level");
+    if (it == params.end())
+        return 0;
+    if (it->second == "timeSensitive")
+        return 1;
+    if (it->second == "passive")
+        return 2;
+    if (it->second == "critical")
+        return 3;
+    return 0;
+}
+
+class BarkMetrics
+{
+public:
+    enum Counter : uint32_t
+    {
+        SENDS,
+        FAILURES,
+        REQUEST_BYTES,
+        RATE_LIMITED,
+        SUPPRESSED,
+        ENQUEUED,
+        REJECTED,
+        COALESCED,
+        EXPIRED_ACTIVE,
+        EXPIRED_TIME_SENSITIVE,
+        EXPIRED_PASSIVE,
+        EXPIRED_CRITICAL,
+        COUNTER_COUNT
+    };
+
+    enum Histogram : uint32_t
+    {
+        SEND_LATENCY_US,
+        HISTOGRAM_COUNT
+    };
+
+    static constexpr size_t kBuckets = 20;
+
+    struct HistogramSnapshot
+    {
+        uint64_t buckets[kBuckets + 1] = {};
+        uint64_t sum = 0;
+        uint64_t count = 0;
+    };
+
+    struct Snapshot
+    {
+        uint64_t counters[COUNTER_COUNT] = {};
+        HistogramSnapshot histograms[HISTOGRAM_COUNT];
+    };
+
+private:
+    struct Shard
+    {
+        std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+        std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][kBuckets + 1] = {};
+        std::atomic<uint64_t> sums[HISTOGRAM_COUNT] = {};
+        std::atomic<uint64_t> counts[HISTOGRAM_COUNT] = {};
+    };
+
+    struct ShardHandle
+    {
+        Shard *shard = nullptr;
+
+        ~ShardHandle()
+        {
+            if (shard)
+                BarkMetrics::instance().releaseShard(shard);
+        }
+    };
+
+    std::atomic<bool> enabled_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<Shard *> free_shards_;
+
+    BarkMetrics() : enabled_(false) {}
+
+    BarkMetrics(const BarkMetrics&) = delete;
+    BarkMetrics& operator=(const BarkMetrics&) = delete;
+
+    Shard &localShard()
+    {
+        static thread_local ShardHandle handle;
+        if (!handle.shard)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_shards_.empty())
+            {
+                handle.shard = free_shards_.back();
+                free_shards_.pop_back();
+            }
+            else
+            {
+                shards_.emplace_back(new Shard());
+                handle.shard = shards_.back().get();
+            }
+        }
+        return *handle.shard;
+    }
+
+    void releaseShard(Shard *shard)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_shards_.push_back(shard);
+    }
+
+public:
+    static BarkMetrics &instance()
+    {
+        static BarkMetrics metrics;
+        return metrics;
+    }
+
+    static const char *counterName(Counter counter)
+    {
+        static const char *const names[COUNTER_COUNT] = {
+            "sends", "failures", "request_bytes", "rate_limited",
+            "suppressed", "enqueued", "rejected", "coalesced", "expired.active",
+            "expired.time_sensitive", "expired.passive", "expired.critical"
+        };
+        return names[counter];
+    }
+
+    static const char *histogramName(Histogram histogram)
+    {
+        static const char *const names[HISTOGRAM_COUNT] = {"send_latency_us"};
+        return names[histogram];
+    }
+
+    static Counter expiredCounter(uint8_t level)
+    {
+        return static_cast<Counter>(EXPIRED_ACTIVE + std::min<uint8_t>(level, 3));
+    }
+
+    static uint64_t bucketBound(size_t bucket)
+    {
+        return 100ULL << bucket;
+    }
+
+    void enable(bool enabled = true)
+    {
+        enabled_.store(enabled, std::memory_order_relaxed);
+    }
+
+    bool enabled() const
+    {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void add(Counter counter, uint64_t value = 1)
+    {
+        if (!enabled())
+            return;
+        localShard().counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void record(Histogram histogram, uint64_t value)
+    {
+        if (!enabled())
+            return;
+        size_t bucket = 0;
+        while (bucket < kBuckets && value > bucketBound(bucket))
+            ++bucket;
+        Shard &shard = localShard();
+        shard.buckets[histogram][bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.sums[histogram].fetch_add(value, std::memory_order_relaxed);
+        shard.counts[histogram].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Snapshot collect()
+    {
+        Snapshot snapshot;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const std::unique_ptr<Shard> &shard : shards_)
+        {
+            for (size_t i = 0; i < COUNTER_COUNT; ++i)
+                snapshot.counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+            for (size_t h = 0; h < HISTOGRAM_COUNT; ++h)
+            {
+                HistogramSnapshot &histogram = snapshot.histograms[h];
+                for (size_t b = 0; b <= kBuckets; ++b)
+                    histogram.buckets[b] += shard->buckets[h][b].load(std::memory_order_relaxed);
+                histogram.sum += shard->sums[h].load(std::memory_order_relaxed);
+                histogram.count += shard->counts[h].load(std::memory_order_relaxed);
+            }
+        }
+        return snapshot;
+    }
+};
+
+class BarkMetricsSink
+{
+public:
+    virtual ~BarkMetricsSink() = default;
+
+    virtual bool publish(const BarkMetrics::Snapshot &delta, int64_t start_unix_nanos,
+                         int64_t end_unix_nanos) = 0;
+};
+
+inline uint64_t barkHistogramQuantile(const BarkMetrics::HistogramSnapshot &histogram, double quantile)
+{
+    if (histogram.count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(histogram.count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BarkMetrics::kBuckets; ++bucket)
+    {
+        seen += histogram.buckets[bucket];
+        if (seen >= rank)
+            return BarkMetrics::bucketBound(bucket);
+    }
+    return BarkMetrics::bucketBound(BarkMetrics::kBuckets - 1) * 2;
+}
+
+#ifndef _WIN32
+class BarkStatsdSink : public BarkMetricsSink
+{
+private:
+    int socket_;
+    sockaddr_storage address_;
+    socklen_t address_size_;
+    std::string prefix_;
+    size_t max_datagram_;
+    std::string datagram_;
+
+    BarkStatsdSink(const BarkStatsdSink&) = delete;
+    BarkStatsdSink& operator=(const BarkStatsdSink&) = delete;
+
+    bool flushDatagram()
+    {
+        if (datagram_.empty())
+            return true;
+        ssize_t sent = sendto(socket_, datagram_.data(), datagram_.size(), 0,
+                              reinterpret_cast<const sockaddr *>(&address_), address_size_);
+        datagram_.clear();
+        return sent >= 0;
+    }
+
+    bool appendLine(const std::string &name, uint64_t value, const char *type, bool &ok)
+    {
+        std::string line = prefix_ + name + ':' + std::to_string(value) + '|' + type;
+        if (!datagram_.empty() && datagram_.size() + 1 + line.size() > max_datagram_)
+            ok = flushDatagram() && ok;
+        if (!datagram_.empty())
+            datagram_ += '\n';
+        datagram_ += line;
+        return ok;
+    }
+
+public:
+    BarkStatsdSink(const std::string &host, uint16_t port, const std::string &prefix = "bark.",
+                   size_t max_datagram = 1432)
+        : socket_(-1), address_{}, address_size_(0), prefix_(prefix), max_datagram_(max_datagram)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *result = nullptr;
+        std::string service = std::to_string(port);
+        if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0 || !result)
+            throw std::runtime_error("Failed to resolve StatsD host " + host);
+
+        socket_ = ::socket(result->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        std::memcpy(&address_, result->ai_addr, result->ai_addrlen);
+        address_size_ = static_cast<socklen_t>(result->ai_addrlen);
+        freeaddrinfo(result);
+        if (socket_ < 0)
+            throw std::runtime_error("Failed to create StatsD socket");
+        datagram_.reserve(max_datagram_);
+    }
+
+    ~BarkStatsdSink() override
+    {
+        if (socket_ >= 0)
+            close(socket_);
+    }
+
+    bool publish(const BarkMetrics::Snapshot &delta, int64_t, int64_t) override
+    {
+        bool ok = true;
+        for (uint32_t i = 0; i < BarkMetrics::COUNTER_COUNT; ++i)
+        {
+            if (delta.counters[i] > 0)
+                appendLine(BarkMetrics::counterName(static_cast<BarkMetrics::Counter>(i)), delta.counters[i], "c", ok);
+        }
+        for (uint32_t h = 0; h < BarkMetrics::HISTOGRAM_COUNT; ++h)
+        {
+            const BarkMetrics::HistogramSnapshot &histogram = delta.histograms[h];
+            if (histogram.count == 0)
+                continue;
+            std::string name = BarkMetrics::histogramName(static_cast<BarkMetrics::Histogram>(h));
+            appendLine(name + ".count", histogram.count, "c", ok);
+            appendLine(name + ".sum", histogram.sum, "c", ok);
+            appendLine(name + ".p50", barkHistogramQuantile(histogram, 0.50), "g", ok);
+            appendLine(name + ".p99", barkHistogramQuantile(histogram, 0.99), "g", ok);
+        }
+        return flushDatagram() && ok;
+    }
+};
+#endif
+
+class BarkOtlpSink : public BarkMetricsSink
+{
+private:
+    std::string url_;
+    std::string service_name_;
+    std::string prefix_;
+    CURL *handle_;
+    struct curl_slist *headers_;
+
+    BarkOtlpSink(const BarkOtlpSink&) = delete;
+    BarkOtlpSink& operator=(const BarkOtlpSink&) = delete;
+
+    static size_t discardCallback(void *, size_t size, size_t nmemb, void *)
+    {
+        return size * nmemb;
+    }
+
+public:
+    BarkOtlpSink(const std::string &url, const std::string &service_name = "bark_push",
+                 const std::string &prefix = "bark.")
+        : url_(url), service_name_(service_name), prefix_(prefix), handle_(nullptr), headers_(nullptr)
+    {
+        if (!barkInitCurlGlobal() || !(handle_ = curl_easy_init()))
+            throw std::runtime_error("cURL initialization failed");
+        headers_ = curl_slist_append(headers_, "Content-Type: application/json");
+        curl_easy_setopt(handle_, CURLOPT_URL, url_.c_str());
+        curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, headers_);
+        curl_easy_setopt(handle_, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(handle_, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(handle_, CURLOPT_WRITEFUNCTION, discardCallback);
+    }
+
+    ~BarkOtlpSink() override
+    {
+        curl_easy_cleanup(handle_);
+        curl_slist_free_all(headers_);
+    }
+
+    bool publish(const BarkMetrics::Snapshot &delta, int64_t start_unix_nanos,
+                 int64_t end_unix_nanos) override
+    {
+        std::string times = "\"startTimeUnixNano\":\"" + std::to_string(start_unix_nanos) +
+                            "\",\"timeUnixNano\":\"" + std::to_string(end_unix_nanos) + "\"";
+        std::ostringstream json;
+        json << "{\"resourceMetrics\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+             << "\"value\":{\"stringValue\":\"" << service_name_ << "\"}}]},"
+             << "\"scopeMetrics\":[{\"scope\":{\"name\":\"bark_push\"},\"metrics\":[";
+        for (uint32_t i = 0; i < BarkMetrics::COUNTER_COUNT; ++i)
+        {
+            json << (i > 0 ? "," : "") << "{\"name\":\"" << prefix_
+                 << BarkMetrics::counterName(static_cast<BarkMetrics::Counter>(i))
+                 << "\",\"sum\":{\"aggregationTemporality\":1,\"isMonotonic\":true,\"dataPoints\":[{"
+                 << times << ",\"asInt\":\"" << delta.counters[i] << "\"}]}}";
+        }
+        for (uint32_t h = 0; h < BarkMetrics::HISTOGRAM_COUNT; ++h)
+        {
+            const BarkMetrics::HistogramSnapshot &histogram = delta.histograms[h];
+            json << ",{\"name\":\"" << prefix_ << BarkMetrics::histogramName(static_cast<BarkMetrics::Histogram>(h))
+                 << "\",\"histogram\":{\"aggregationTemporality\":1,\"dataPoints\":[{" << times
+                 << ",\"count\":\"" << histogram.count << "\",\"sum\":" << histogram.sum << ",\"bucketCounts\":[";
+            for (size_t b = 0; b <= BarkMetrics::kBuckets; ++b)
+                json << (b > 0 ? "," : "") << '"' << histogram.buckets[b] << '"';
+            json << "],\"explicitBounds\":[";
+            for (size_t b = 0; b < BarkMetrics::kBuckets; ++b)
+                json << (b > 0 ? "," : "") << BarkMetrics::bucketBound(b);
+            json << "]}]}}";
+        }
+        json << "]}]}]}";
+
+        std::string body = json.str();
+        curl_easy_setopt(handle_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.size()));
+        curl_easy_setopt(handle_, CURLOPT_POSTFIELDS, body.c_str());
+        long status = 0;
+        CURLcode res = curl_easy_perform(handle_);
+        curl_easy_getinfo(handle_, CURLINFO_RESPONSE_CODE, &status);
+        return res == CURLE_OK && status >= 200 && status < 300;
+    }
+};
+
+class BarkMetricsExporter
+{
+private:
+    std::shared_ptr<BarkMetricsSink> sink_;
+    std::chrono::milliseconds interval_;
+    std::mutex mutex_;
+    std::mutex flush_mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+    BarkMetrics::Snapshot previous_;
+    int64_t previous_unix_nanos_;
+    std::atomic<uint64_t> failed_publishes_;
+    std::thread worker_;
+
+    BarkMetricsExporter(const BarkMetricsExporter&) = delete;
+    BarkMetricsExporter& operator=(const BarkMetricsExporter&) = delete;
+
+    static int64_t unixNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_)
+        {
+            cv_.wait_for(lock, interval_, [this]() { return stopping_; });
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    }
+
+public:
+    BarkMetricsExporter(std::shared_ptr<BarkMetricsSink> sink,
+                        std::chrono::milliseconds interval = std::chrono::milliseconds(10000))
+        : sink_(std::move(sink)), interval_(interval), stopping_(false),
+          previous_(BarkMetrics::instance().collect()), previous_unix_nanos_(unixNanos()),
+          failed_publishes_(0)
+    {
+        BarkMetrics::instance().enable();
+        worker_ = std::thread(&BarkMetricsExporter::workerLoop, this);
+    }
+
+    ~BarkMetricsExporter()
+    {
+        stop();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(flush_mutex_);
+        BarkMetrics::Snapshot current = BarkMetrics::instance().collect();
+        BarkMetrics::Snapshot delta;
+        for (size_t i = 0; i < BarkMetrics::COUNTER_COUNT; ++i)
+            delta.counters[i] = current.counters[i] - previous_.counters[i];
+        for (size_t h = 0; h < BarkMetrics::HISTOGRAM_COUNT; ++h)
+        {
+            for (size_t b = 0; b <= BarkMetrics::kBuckets; ++b)
+                delta.histograms[h].buckets[b] = current.histograms[h].buckets[b] - previous_.histograms[h].buckets[b];
+            delta.histograms[h].sum = current.histograms[h].sum - previous_.histograms[h].sum;
+            delta.histograms[h].count = current.histograms[h].count - previous_.histograms[h].count;
+        }
+
+        int64_t now = unixNanos();
+        if (!sink_->publish(delta, previous_unix_nanos_, now))
+            failed_publishes_.fetch_add(1, std::memory_order_relaxed);
+        previous_ = current;
+        previous_unix_nanos_ = now;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_)
+                return;
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    uint64_t failedPublishes() const
+    {
+        return failed_publishes_.load(std::memory_order_relaxed);
+    }
+};
+
+enum class BarkHttpVersion
+{
+    DEFAULT,
+    HTTP1_1,
+    HTTP2,
+    HTTP3
+};
+
+struct BarkProxyOptions
+{
+    std::string url;
+    std::string username;
+    std::string password;
+    std::string no_proxy;
+    bool tunnel = true;
+    bool verify_ssl = true;
+};
+
+struct BarkSpanContext
+{
+    uint8_t trace_id[16] = {};
+    uint8_t span_id[8] = {};
+    uint8_t flags = 0;
+
+    bool valid() const
+    {
+        uint8_t trace_bits = 0;
+        uint8_t span_bits = 0;
+        for (uint8_t byte : trace_id)
+            trace_bits |= byte;
+        for (uint8_t byte : span_id)
+            span_bits |= byte;
+        return trace_bits != 0 && span_bits != 0;
+    }
+
+    bool sampled() const
+    {
+        return (flags & 0x01) != 0;
+    }
+
+    std::string traceparent() const
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string header = "00-";
+        header.reserve(55);
+        for (uint8_t byte : trace_id)
+        {
+            header += digits[byte >> 4];
+            header += digits[byte & 0x0F];
+        }
+        header += '-';
+        for (uint8_t byte : span_id)
+        {
+            header += digits[byte >> 4];
+            header += digits[byte & 0x0F];
+        }
+        header += '-';
+        header += digits[flags >> 4];
+        header += digits[flags & 0x0F];
+        return header;
+    }
+
+    static bool fromTraceparent(const std::string &header, BarkSpanContext &context)
+    {
+        auto nibble = [](char c) -> int
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            return -1;
+        };
+        auto parseHex = [&](size_t offset, uint8_t *out, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                int high = nibble(header[offset + i * 2]);
+                int low = nibble(header[offset + i * 2 + 1]);
+                if (high < 0 || low < 0)
+                    return false;
+                out[i] = static_cast<uint8_t>((high << 4) | low);
+            }
+            return true;
+        };
+
+        BarkSpanContext parsed;
+        if (header.size() < 55 || header.compare(0, 3, "00-") != 0 || header[35] != '-' ||
+            header[52] != '-' || !parseHex(3, parsed.trace_id, 16) || !parseHex(36, parsed.span_id, 8) ||
+            !parseHex(53, &parsed.flags, 1) || !parsed.valid())
+            return false;
+        context = parsed;
+        return true;
+    }
+};
+
+struct BarkSpan
+{
+    BarkSpanContext context;
+    BarkSpanContext parent;
+    int64_t start_unix_nanos = 0;
+    int64_t end_unix_nanos = 0;
+    std::string endpoint;
+    long http_status = 0;
+    BarkError status = BarkError::SUCCESS;
+    uint32_t retries = 0;
+    uint32_t device_count = 0;
+    uint64_t request_bytes = 0;
+    uint64_t response_bytes = 0;
+    // Traces of other notifications that were merged into this request.
+    std::vector<BarkSpanContext> links;
+};
+
+class BarkSpanExporter
+{
+public:
+    virtual ~BarkSpanExporter() = default;
+
+    virtual void exportSpans(const std::vector<BarkSpan> &spans) = 0;
+};
+
+struct BarkTracerOptions
+{
+    double sample_ratio = 1.0;
+    size_t batch_size = 64;
+};
+
+class BarkTracer
+{
+private:
+    std::shared_ptr<BarkSpanExporter> exporter_;
+    BarkTracerOptions options_;
+    uint64_t threshold_;
+    std::mutex mutex_;
+    std::vector<BarkSpan> pending_;
+
+    BarkTracer(const BarkTracer&) = delete;
+    BarkTracer& operator=(const BarkTracer&) = delete;
+
+    static void randomBytes(uint8_t *out, size_t count)
+    {
+        static thread_local std::mt19937_64 random(std::random_device{}() ^
+            static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+        while (count > 0)
+        {
+            uint64_t value = random();
+            size_t chunk = std::min<size_t>(count, sizeof(value));
+            std::memcpy(out, &value, chunk);
+            out += chunk;
+            count -= chunk;
+        }
+    }
+
+    static int64_t unixNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    explicit BarkTracer(std::shared_ptr<BarkSpanExporter> exporter,
+                        const BarkTracerOptions &options = BarkTracerOptions())
+        : exporter_(std::move(exporter)), options_(options), threshold_(0)
+    {
+        if (options_.sample_ratio >= 1.0)
+            threshold_ = UINT64_MAX;
+        else if (options_.sample_ratio > 0.0)
+            threshold_ = static_cast<uint64_t>(options_.sample_ratio * 18446744073709551615.0);
+        if (options_.batch_size == 0)
+            options_.batch_size = 1;
+    }
+
+    ~BarkTracer()
+    {
+        flush();
+    }
+
+    bool shouldSample(const BarkSpanContext &parent) const
+    {
+        if (parent.valid())
+            return parent.sampled();
+        return threshold_ != 0;
+    }
+
+    bool startSpan(const BarkSpanContext &parent, BarkSpan &span)
+    {
+        if (parent.valid())
+        {
+            if (!parent.sampled())
+                return false;
+            std::memcpy(span.context.trace_id, parent.trace_id, sizeof(parent.trace_id));
+        }
+        else
+        {
+            if (threshold_ == 0)
+                return false;
+            randomBytes(span.context.trace_id, sizeof(span.context.trace_id));
+            uint64_t low = 0;
+            for (size_t i = 8; i < 16; ++i)
+                low = (low << 8) | span.context.trace_id[i];
+            if (threshold_ != UINT64_MAX && low >= threshold_)
+                return false;
+        }
+
+        randomBytes(span.context.span_id, sizeof(span.context.span_id));
+        span.context.flags = 0x01;
+        span.parent = parent;
+        span.start_unix_nanos = unixNanos();
+        return true;
+    }
+
+    void endSpan(BarkSpan &&span)
+    {
+        span.end_unix_nanos = unixNanos();
+        std::vector<BarkSpan> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(std::move(span));
+            if (pending_.size() < options_.batch_size)
+                return;
+            ready.swap(pending_);
+        }
+        if (exporter_)
+            exporter_->exportSpans(ready);
+    }
+
+    void flush()
+    {
+        std::vector<BarkSpan> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ready.swap(pending_);
+        }
+        if (exporter_ && !ready.empty())
+            exporter_->exportSpans(ready);
+    }
+};
+
+// Per-request metrics shared by BarkPush and BasicBarkPush. Latency comes
+// from the transfer's handle; without one only the counters are recorded.
+inline void barkRecordSendMetrics(CURL *handle, bool ok, size_t request_bytes)
+{
+    BarkMetrics &metrics = BarkMetrics::instance();
+    if (!metrics.enabled())
+        return;
+    metrics.add(BarkMetrics::SENDS);
+    metrics.add(BarkMetrics::REQUEST_BYTES, request_bytes);
+    if (!ok)
+        metrics.add(BarkMetrics::FAILURES);
+    if (!handle)
+        return;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    curl_off_t total_us = 0;
+    if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total_us) == CURLE_OK && total_us >= 0)
+        metrics.record(BarkMetrics::SEND_LATENCY_US, static_cast<uint64_t>(total_us));
+#else
+    double total_seconds = 0;
+    if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &total_seconds) == CURLE_OK)
+        metrics.record(BarkMetrics::SEND_LATENCY_US, static_cast<uint64_t>(total_seconds * 1e6));
+#endif
+}
+
+// Starts a span under parent when the tracer samples the request. Returns
+// the traceparent header to send: the new span's when sampled, otherwise the
+// parent's, or an empty string when there is nothing to propagate.
+inline std::string barkStartSendSpan(BarkTracer *tracer, const BarkSpanContext &parent, BarkSpan &span,
+                                     bool &sampled)
+{
+    sampled = tracer && tracer->startSpan(parent, span);
+    const BarkSpanContext &propagated = sampled ? span.context : parent;
+    return propagated.valid() ? "traceparent: " + propagated.traceparent() : std::string();
+}
+
+inline void barkEndSendSpan(BarkTracer &tracer, BarkSpan &span, const std::string &endpoint, long http_status,
+                            BarkError status, size_t device_count, uint64_t request_bytes,
+                            uint64_t response_bytes)
+{
+    span.endpoint = endpoint;
+    span.http_status = http_status;
+    span.status = status;
+    span.device_count = static_cast<uint32_t>(device_count);
+    span.request_bytes = request_bytes;
+    span.response_bytes = response_bytes;
+    tracer.endSpan(std::move(span));
+}
+
+struct BarkNotification
+{
+    std::vector<std::string> device_keys;
+    std::string title;
+    std::string body;
+    std::map<std::string, std::string> params;
+    BarkSpanContext trace;
+    BarkClock::time_point expires_at{};
+};
+
+struct BarkTrafficRecord
+{
+    std::chrono::microseconds offset{0};
+    uint32_t key_count = 0;
+    uint32_t title_bytes = 0;
+    uint32_t body_bytes = 0;
+    uint32_t param_count = 0;
+    uint8_t level = 0;
+    bool idempotent = false;
+
+    BarkNotification synthesize(uint64_t sequence) const
+    {
+        static const char *const levels[] = {"active", "timeSensitive", "passive", "critical"};
+        BarkNotification notification;
+        notification.device_keys.reserve(key_count);
+        for (uint32_t i = 0; i < key_count; ++i)
+            notification.device_keys.push_back("replay-" + std::to_string(i));
+        notification.title.assign(title_bytes, 't');
+        notification.body = std::to_string(sequence);
+        if (notification.body.size() < body_bytes)
+            notification.body.append(body_bytes - notification.body.size(), 'b');
+        if (level != 0)
+            notification.params["level"] = levels[std::min<uint8_t>(level, 3)];
+        if (idempotent)
+            notification.params["id"] = "replay-" + std::to_string(sequence);
+        for (uint32_t i = 0; notification.params.size() < param_count; ++i)
+            notification.params["p" + std::to_string(i)] = "v";
+        return notification;
+    }
+};
+
+class BarkTrafficRecorder
+{
+private:
+    static constexpr char kMagic[8] = {'B', 'A', 'R', 'K', 'T', 'R', 'C', '1'};
+
+    std::mutex mutex_;
+    std::FILE *file_;
+    std::chrono::steady_clock::time_point last_;
+    std::string buffer_;
+    uint64_t records_;
+
+    BarkTrafficRecorder(const BarkTrafficRecorder&) = delete;
+    BarkTrafficRecorder& operator=(const BarkTrafficRecorder&) = delete;
+
+    static void writeVarint(std::string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    static bool readVarint(const std::string &in, size_t &offset, uint64_t &value)
+    {
+        value = 0;
+        for (unsigned shift = 0; offset < in.size() && shift < 64; shift += 7)
+        {
+            uint8_t byte = static_cast<uint8_t>(in[offset++]);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    void flushLocked()
+    {
+        if (!buffer_.empty())
+        {
+            std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+            buffer_.clear();
+        }
+        std::fflush(file_);
+    }
+
+public:
+    explicit BarkTrafficRecorder(const std::string &path)
+        : file_(std::fopen(path.c_str(), "wb")), last_(std::chrono::steady_clock::now()), records_(0)
+    {
+        if (!file_)
+            throw std::runtime_error("Failed to open traffic recording " + path);
+        buffer_.assign(kMagic, sizeof(kMagic));
+    }
+
+    ~BarkTrafficRecorder()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushLocked();
+        std::fclose(file_);
+    }
+
+    void record(const BarkNotification &notification)
+    {
+        record(notification.device_keys.size(), notification.title.size(), notification.body.size(),
+               notification.params);
+    }
+
+    void record(size_t key_count, size_t title_bytes, size_t body_bytes,
+                const std::map<std::string, std::string> &params)
+    {
+        auto id = params.find("id");
+        record(key_count, title_bytes, body_bytes, params.size(), barkLevelIndex(params),
+               id != params.end() && !id->second.empty());
+    }
+
+    void record(size_t key_count, size_t title_bytes, size_t body_bytes, size_t param_count,
+                uint8_t level, bool idempotent)
+    {
+        uint8_t flags = static_cast<uint8_t>((level & 3) | (idempotent ? 4 : 0));
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        writeVarint(buffer_, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count()));
+        last_ = now;
+        writeVarint(buffer_, key_count);
+        writeVarint(buffer_, title_bytes);
+        writeVarint(buffer_, body_bytes);
+        writeVarint(buffer_, param_count);
+        buffer_ += static_cast<char>(flags);
+        ++records_;
+        if (buffer_.size() >= 64 * 1024)
+            flushLocked();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushLocked();
+    }
+
+    uint64_t records()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return records_;
+    }
+
+    static bool load(const std::string &path, std::vector<BarkTrafficRecord> &records)
+    {
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+        std::string data;
+        char chunk[65536];
+        size_t read = 0;
+        while ((read = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+            data.append(chunk, read);
+        std::fclose(file);
+
+        if (data.size() < sizeof(kMagic) || data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0)
+            return false;
+
+        size_t offset = sizeof(kMagic);
+        std::chrono::microseconds elapsed(0);
+        while (offset < data.size())
+        {
+            uint64_t fields[5] = {};
+            for (uint64_t &field : fields)
+            {
+                if (!readVarint(data, offset, field))
+                    return false;
+            }
+            if (offset >= data.size())
+                return false;
+            uint8_t flags = static_cast<uint8_t>(data[offset++]);
+
+            BarkTrafficRecord record;
+            elapsed += std::chrono::microseconds(static_cast<int64_t>(fields[0]));
+            record.offset = elapsed;
+            record.key_count = static_cast<uint32_t>(fields[1]);
+            record.title_bytes = static_cast<uint32_t>(fields[2]);
+            record.body_bytes = static_cast<uint32_t>(fields[3]);
+            record.param_count = static_cast<uint32_t>(fields[4]);
+            record.level = flags & 3;
+            record.idempotent = (flags & 4) != 0;
+            records.push_back(record);
+        }
+        return true;
+    }
+};
+
+class BarkPreparedNotification
+{
+    friend class BarkPush;
+
+private:
+    std::shared_ptr<const std::string> payload_tail_;
+    uint64_t payload_hash_;
+    bool idempotent_;
+    uint8_t level_;
+    uint32_t param_count_;
+
+    BarkPreparedNotification(std::shared_ptr<const std::string> payload_tail, bool idempotent,
+                             const std::map<std::string, std::string> &params)
+        : payload_tail_(std::move(payload_tail)), payload_hash_(barkHash(*payload_tail_)),
+          idempotent_(idempotent), level_(barkLevelIndex(params)),
+          param_count_(static_cast<uint32_t>(params.size()))
+    {
+    }
+
+public:
+    size_t payloadSize() const
+    {
+        return payload_tail_->size();
+    }
+
+    long useCount() const
+    {
+        return payload_tail_.use_count();
+    }
+};
+
+class BarkPush
+{
+    friend class BarkApnsPush;
+    friend class BarkCurlTransport;
+
+private:
+    std::vector<std::string> device_keys_;
+    std::string server_;
+    CURL *curl_handle_;
+    CURLM *multi_handle_;
+    std::string last_error_;
+    long http_status_code_;
+    bool verify_ssl_;
+    bool use_shared_engine_;
+    bool early_data_;
+    long ssl_options_;
+    BarkHttpVersion http_version_;
+    BarkProxyOptions proxy_;
+    std::vector<uint8_t> key_failures_;
+    uint8_t prune_threshold_;
+    std::function<void(const std::string &, unsigned)> prune_callback_;
+    std::shared_ptr<BarkLimitBackend> limiter_;
+    std::shared_ptr<BarkTracer> tracer_;
+    BarkSpanContext trace_parent_;
+    std::vector<BarkSpanContext> trace_links_;
+    std::shared_ptr<BarkTrafficRecorder> recorder_;
+    std::vector<std::string> payload_buffers_;
+
+    static constexpr size_t kPooledPayloads = 1024;
+
+    BarkPush(const BarkPush&) = delete;
+    BarkPush& operator=(const BarkPush&) = delete;
+
+    static std::string normalizeUrl(const std::string &url)
+    {
+        if (url.empty())
+            return url;
+        
+        const std::string http_prefix = "http://";
+        const std::string https_prefix = "https://";
+        
+        if (url.size() >= http_prefix.size() && url.substr(0, http_prefix.size()) == http_prefix)
+            return url;
+        if (url.size() >= https_prefix.size() && url.substr(0, https_prefix.size()) == https_prefix)
+            return url;
+            
+        return https_prefix + url;
+    }
+
+    static size_t writeCallback(void *contents, size_t size, size_t nmemb, std::string *s)
+    {
+        size_t newLength = size * nmemb;
+        try
+        {
+            s->append(static_cast<char *>(contents), newLength);
+            return newLength;
+        }
+        catch (...)
+        {
+            return 0;
+        }
+    }
+
+    struct KeyResult
+    {
+        std::string key;
+        long code = 0;
+        std::string message;
+    };
+
+    // Reads just enough JSON to walk a Bark response: strings with escapes,
+    // integers, and objects and arrays that are skipped when not needed.
+    struct JsonCursor
+    {
+        const std::string &text;
+        size_t pos;
+
+        void skipSpace()
+        {
+            while (pos < text.size() &&
+                   (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n'))
+                ++pos;
+        }
+
+        bool consume(char c)
+        {
+            skipSpace();
+            if (pos >= text.size() || text[pos] != c)
+                return false;
+            ++pos;
+            return true;
+        }
+
+        bool peek(char c)
+        {
+            skipSpace();
+            return pos < text.size() && text[pos] == c;
+        }
+
+        static void appendUtf8(std::string &out, unsigned code)
+        {
+            if (code < 0x80)
+                out += static_cast<char>(code);
+            else if (code < 0x800)
+            {
+                out += static_cast<char>(0xC0 | (code >> 6));
+                out += static_cast<char>(0x80 | (code & 0x3F));
+            }
+            else if (code < 0x10000)
+            {
+                out += static_cast<char>(0xE0 | (code >> 12));
+                out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (code & 0x3F));
+            }
+            else
+            {
+                out += static_cast<char>(0xF0 | (code >> 18));
+                out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (code & 0x3F));
+            }
+        }
+
+        bool readHex4(unsigned &code)
+        {
+            if (text.size() - pos < 4)
+                return false;
+            code = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                char c = text[pos++];
+                code <<= 4;
+                if (c >= '0' && c <= '9')
+                    code |= static_cast<unsigned>(c - '0');
+                else if (c >= 'a' && c <= 'f')
+                    code |= static_cast<unsigned>(c - 'a' + 10);
+                else if (c >= 'A' && c <= 'F')
+                    code |= static_cast<unsigned>(c - 'A' + 10);
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        bool readString(std::string &out)
+        {
+            if (!consume('"'))
+                return false;
+            out.clear();
+            while (pos < text.size())
+            {
+                char c = text[pos++];
+                if (c == '"')
+                    return true;
+                if (c != '\\')
+                {
+                    out += c;
+                    continue;
+                }
+                if (pos >= text.size())
+                    return false;
+                char escape = text[pos++];
+                switch (escape)
+                {
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u':
+                {
+                    unsigned code = 0;
+                    if (!readHex4(code))
+                        return false;
+                    unsigned low = 0;
+                    if (code >= 0xD800 && code < 0xDC00 && text.compare(pos, 2, "\\u") == 0)
+                    {
+                        pos += 2;
+                        if (!readHex4(low) || low < 0xDC00 || low >= 0xE000)
+                            return false;
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    appendUtf8(out, code);
+                    break;
+                }
+                default: out += escape; break;
+                }
+            }
+            return false;
+        }
+
+        bool readNumber(long &out)
+        {
+            skipSpace();
+            const char *begin = text.c_str() + pos;
+            char *end = nullptr;
+            out = std::strtol(begin, &end, 10);
+            if (end == begin)
+                return false;
+            pos += static_cast<size_t>(end - begin);
+            while (pos < text.size() && std::strchr("0123456789.eE+-", text[pos]))
+                ++pos;
+            return true;
+        }
+
+        bool skipValue(int depth = 0)
+        {
+            if (depth > 32)
+                return false;
+            std::string ignored;
+            if (peek('"'))
+                return readString(ignored);
+            if (consume('{'))
+            {
+                if (consume('}'))
+                    return true;
+                do
+                {
+                    if (!readString(ignored) || !consume(':') || !skipValue(depth + 1))
+                        return false;
+                } while (consume(','));
+                return consume('}');
+            }
+            if (consume('['))
+            {
+                if (consume(']'))
+                    return true;
+                do
+                {
+                    if (!skipValue(depth + 1))
+                        return false;
+                } while (consume(','));
+                return consume(']');
+            }
+            size_t start = pos;
+            while (pos < text.size() && !std::strchr(",}] \t\r\n", text[pos]))
+                ++pos;
+            return pos > start;
+        }
+
+        // Calls field(name) for each member of an object; field() consumes
+        // the value and returns false on malformed input.
+        template <typename Field>
+        bool readObject(Field &&field)
+        {
+            if (!consume('{'))
+                return false;
+            if (consume('}'))
+                return true;
+            std::string name;
+            do
+            {
+                if (!readString(name) || !consume(':') || !field(name))
+                    return false;
+            } while (consume(','));
+            return consume('}');
+        }
+    };
+
+    // Parses {"code":..,"message":..,"data":[{"device_key":..,"code":..,"message":..},..]}.
+    // Other members are skipped; a malformed body yields no per-key results.
+    static bool parsePushResponse(const std::string &response, long &code, std::string &message,
+                                  std::vector<KeyResult> &results)
+    {
+        JsonCursor cursor{response, 0};
+        results.clear();
+        auto keyResult = [&cursor, &results]()
+        {
+            KeyResult result;
+            bool ok = cursor.readObject([&](const std::string &name)
+            {
+                if (name == "device_key")
+                    return cursor.readString(result.key);
+                if (name == "code")
+                    return cursor.readNumber(result.code);
+                if (name == "message")
+                    return cursor.readString(result.message);
+                return cursor.skipValue();
+            });
+            if (ok && !result.key.empty())
+                results.push_back(std::move(result));
+            return ok;
+        };
+        bool ok = cursor.readObject([&](const std::string &name)
+        {
+            if (name == "code")
+                return cursor.readNumber(code);
+            if (name == "message")
+                return cursor.readString(message);
+            if (name != "data" || !cursor.peek('['))
+                return cursor.skipValue();
+            cursor.consume('[');
+            if (cursor.consume(']'))
+                return true;
+            do
+            {
+                if (cursor.peek('{') ? !keyResult() : !cursor.skipValue())
+                    return false;
+            } while (cursor.consume(','));
+            return cursor.consume(']');
+        });
+        if (!ok)
+            results.clear();
+        return ok;
+    }
+
+    // Bark answers 400 for a malformed key and 404 for an unknown one. Other
+    // statuses such as 408 and 429 say nothing about the key itself.
+    static bool keyRejected(long code)
+    {
+        return code == 400 || code == 404;
+    }
+
+    // A request-level 400 can also reject the payload; only a message about
+    // the device token or key blames the key.
+    static bool deviceError(long code, const std::string &message)
+    {
+        if (!keyRejected(code))
+            return false;
+        std::string lower(message);
+        for (char &c : lower)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return lower.find("device") != std::string::npos;
+    }
+
+    static void countKeyResult(uint8_t &failures, bool ok, bool rejected)
+    {
+        if (ok)
+            failures = 0;
+        else if (rejected)
+            failures = static_cast<uint8_t>(std::min(failures + 1, 255));
+    }
+
+    // Only keys registered with addDeviceKey() are tracked, including when
+    // they appear in sendMany() notifications.
+    void updateKeyHealth(const std::string &response, long status, const std::vector<std::string> &request_keys)
+    {
+        key_failures_.resize(device_keys_.size(), 0);
+
+        long code = status;
+        std::string message;
+        std::vector<KeyResult> results;
+        parsePushResponse(response, code, message, results);
+
+        std::unordered_map<std::string, size_t> index;
+        index.reserve(device_keys_.size());
+        for (size_t i = 0; i < device_keys_.size(); ++i)
+            index.emplace(device_keys_[i], i);
+
+        if (results.empty())
+        {
+            bool ok = status >= 200 && status < 300;
+            bool rejected = request_keys.size() == 1 && deviceError(status, message);
+            if (!ok && !rejected)
+                return;
+            for (const std::string &key : request_keys)
+            {
+                auto it = index.find(key);
+                if (it != index.end())
+                    countKeyResult(key_failures_[it->second], ok, rejected);
+            }
+        }
+        else
+        {
+            for (const KeyResult &result : results)
+            {
+                auto it = index.find(result.key);
+                if (it != index.end())
+                    countKeyResult(key_failures_[it->second], result.code >= 200 && result.code < 300,
+                                   keyRejected(result.code));
+            }
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < device_keys_.size(); ++i)
+        {
+            if (key_failures_[i] < prune_threshold_)
+            {
+                if (kept != i)
+                {
+                    device_keys_[kept] = std::move(device_keys_[i]);
+                    key_failures_[kept] = key_failures_[i];
+                }
+                ++kept;
+                continue;
+            }
+            if (prune_callback_)
+                prune_callback_(device_keys_[i], key_failures_[i]);
+        }
+        device_keys_.resize(kept);
+        key_failures_.resize(kept);
+    }
+
+    void applyLeaseOptions(CURL *handle)
+    {
+        setCurlOption(handle, CURLOPT_SSL_VERIFYPEER, verify_ssl_ ? 1L : 0L);
+        setCurlOption(handle, CURLOPT_SSL_VERIFYHOST, verify_ssl_ ? 2L : 0L);
+        applyProxy(handle);
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, curlHttpVersion(http_version_));
+        applyEarlyData(handle, false);
+    }
+
+    // Toggles only the early-data bit on top of the options from
+    // setSslOptions().
+    void applyEarlyData(CURL *handle, bool enable)
+    {
+        long options = ssl_options_;
+#ifdef CURLSSLOPT_EARLYDATA
+        const long early_data = static_cast<long>(CURLSSLOPT_EARLYDATA);
+        options = enable ? (options | early_data) : (options & ~early_data);
+#else
+        (void)enable;
+#endif
+        curl_easy_setopt(handle, CURLOPT_SSL_OPTIONS, options);
+    }
+
+    static bool isIdempotent(const std::map<std::string, std::string> &params)
+    {
+        auto id = params.find("id");
+        return id != params.end() && !id->second.empty();
+    }
+
+    static long curlHttpVersion(BarkHttpVersion version)
+    {
+        switch (version)
+        {
+            case BarkHttpVersion::HTTP1_1: return CURL_HTTP_VERSION_1_1;
+            case BarkHttpVersion::HTTP2: return CURL_HTTP_VERSION_2TLS;
+            case BarkHttpVersion::HTTP3:
+#if LIBCURL_VERSION_NUM >= 0x074200
+                if (http3Available())
+                    return CURL_HTTP_VERSION_3;
+#endif
+                return CURL_HTTP_VERSION_2TLS;
+            default: return CURL_HTTP_VERSION_NONE;
+        }
+    }
+
+    static bool quicFailed(CURLcode result)
+    {
+#if LIBCURL_VERSION_NUM >= 0x074500
+        return result == CURLE_HTTP3 || result == CURLE_QUIC_CONNECT_ERROR;
+#elif LIBCURL_VERSION_NUM >= 0x074200
+        return result == CURLE_HTTP3;
+#else
+        (void)result;
+        return false;
+#endif
+    }
+
+    void applyProxy(CURL *handle)
+    {
+        bool enabled = !proxy_.url.empty();
+        auto optional = [enabled](const std::string &value) -> const char *
+        {
+            return enabled && !value.empty() ? value.c_str() : nullptr;
+        };
+        curl_easy_setopt(handle, CURLOPT_PROXY, optional(proxy_.url));
+        curl_easy_setopt(handle, CURLOPT_NOPROXY, optional(proxy_.no_proxy));
+        curl_easy_setopt(handle, CURLOPT_PROXYUSERNAME, optional(proxy_.username));
+        curl_easy_setopt(handle, CURLOPT_PROXYPASSWORD, optional(proxy_.password));
+        setCurlOption(handle, CURLOPT_HTTPPROXYTUNNEL, enabled && proxy_.tunnel ? 1L : 0L);
+#if LIBCURL_VERSION_NUM >= 0x073400
+        setCurlOption(handle, CURLOPT_PROXY_SSL_VERIFYPEER, !enabled || proxy_.verify_ssl ? 1L : 0L);
+        setCurlOption(handle, CURLOPT_PROXY_SSL_VERIFYHOST, !enabled || proxy_.verify_ssl ? 2L : 0L);
+#endif
+    }
+
+    std::string pushUrl() const
+    {
+        std::string url = server_;
+        if (url.empty() || url.back() != '/')
+            url += '/';
+        url += "push";
+        return url;
+    }
+
+    // Payload strings are cleared rather than replaced, so buffers passed in
+    // again keep their capacity. payloads never shrinks below its old size.
+    static void serializeAll(const std::vector<BarkNotification> &notifications,
+                             std::vector<std::string> &payloads, std::vector<uint64_t> *hashes = nullptr)
+    {
+        if (payloads.size() < notifications.size())
+            payloads.resize(notifications.size());
+        if (hashes)
+            hashes->assign(notifications.size(), 0);
+        auto serializeRange = [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const BarkNotification &notification = notifications[i];
+                std::string &payload = payloads[i];
+                payload.clear();
+                if (notification.device_keys.empty())
+                    continue;
+                appendKeysFragment(payload, notification.device_keys);
+                size_t split = payload.size();
+                appendPayloadTail(payload, notification.title, notification.body, notification.params);
+                if (hashes)
+                    (*hashes)[i] = barkPayloadHash(barkHash(payload.data(), split),
+                                                   barkHash(payload.data() + split, payload.size() - split));
+            }
+        };
+
+        BarkWorkPool::instance().parallelFor(notifications.size(), 64, serializeRange);
+    }
+
+    bool setCurlOption(CURL *handle, CURLoption option, const char* value)
+    {
+        CURLcode res = curl_easy_setopt(handle, option, value);
+        if (res != CURLE_OK)
+        {
+            last_error_ = "Failed to set cURL option: " + std::string(curl_easy_strerror(res));
+            return false;
+        }
+        return true;
+    }
+
+    bool setCurlOption(CURL *handle, CURLoption option, long value)
+    {
+        CURLcode res = curl_easy_setopt(handle, option, value);
+        if (res != CURLE_OK)
+        {
+            last_error_ = "Failed to set cURL option: " + std::string(curl_easy_strerror(res));
+            return false;
+        }
+        return true;
+    }
+
+    bool setCurlOption(CURL *handle, CURLoption option, size_t (*callback)(void*, size_t, size_t, std::string*))
+    {
+        CURLcode res = curl_easy_setopt(handle, option, callback);
+        if (res != CURLE_OK)
+        {
+            last_error_ = "Failed to set cURL callback: " + std::string(curl_easy_strerror(res));
+            return false;
+        }
+        return true;
+    }
+
+public:
+    BarkPush(const std::string &single_key, const std::string &server = DEFAULT_BARK_SERVER)
+        : server_(server), curl_handle_(nullptr), multi_handle_(nullptr), http_status_code_(0),
+          verify_ssl_(true), use_shared_engine_(false), early_data_(false), ssl_options_(0),
+          http_version_(BarkHttpVersion::DEFAULT), prune_threshold_(0)
+    {
+        if (!single_key.empty())
+        {
+            device_keys_.push_back(single_key);
+        }
+        init();
+    }
+
+    BarkPush(const std::vector<std::string> &multi_keys, const std::string &server = DEFAULT_BARK_SERVER)
+        : device_keys_(multi_keys), server_(server), curl_handle_(nullptr), multi_handle_(nullptr),
+          http_status_code_(0), verify_ssl_(true), use_shared_engine_(false), early_data_(false), ssl_options_(0),
+          http_version_(BarkHttpVersion::DEFAULT), prune_threshold_(0)
+    {
+        init();
+    }
+
+    BarkPush(BarkSharedEngineTag, std::vector<std::string> multi_keys,
+             std::string server = DEFAULT_BARK_SERVER) noexcept
+        : device_keys_(std::move(multi_keys)), server_(std::move(server)), curl_handle_(nullptr), multi_handle_(nullptr),
+          http_status_code_(0), verify_ssl_(true), use_shared_engine_(true), early_data_(false),
+          ssl_options_(0), http_version_(BarkHttpVersion::DEFAULT), prune_threshold_(0)
+    {
+    }
+
+    BarkPush(BarkPush &&other) noexcept
+        : device_keys_(std::move(other.device_keys_)), server_(std::move(other.server_)),
+          curl_handle_(other.curl_handle_), multi_handle_(other.multi_handle_),
+          last_error_(std::move(other.last_error_)),
+          http_status_code_(other.http_status_code_), verify_ssl_(other.verify_ssl_),
+          use_shared_engine_(other.use_shared_engine_), early_data_(other.early_data_),
+          ssl_options_(other.ssl_options_), http_version_(other.http_version_),
+          proxy_(std::move(other.proxy_)), key_failures_(std::move(other.key_failures_)),
+          prune_threshold_(other.prune_threshold_), prune_callback_(std::move(other.prune_callback_)),
+          limiter_(std::move(other.limiter_)), tracer_(std::move(other.tracer_)),
+          trace_parent_(other.trace_parent_), trace_links_(std::move(other.trace_links_)),
+          recorder_(std::move(other.recorder_)),
+          payload_buffers_(std::move(other.payload_buffers_))
+    {
+        other.curl_handle_ = nullptr;
+        other.multi_handle_ = nullptr;
+    }
+
+    BarkPush& operator=(BarkPush &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (curl_handle_)
+                curl_easy_cleanup(curl_handle_);
+            if (multi_handle_)
+                curl_multi_cleanup(multi_handle_);
+            device_keys_ = std::move(other.device_keys_);
+            server_ = std::move(other.server_);
+            curl_handle_ = other.curl_handle_;
+            multi_handle_ = other.multi_handle_;
+            last_error_ = std::move(other.last_error_);
+            http_status_code_ = other.http_status_code_;
+            verify_ssl_ = other.verify_ssl_;
+            use_shared_engine_ = other.use_shared_engine_;
+            early_data_ = other.early_data_;
+            ssl_options_ = other.ssl_options_;
+            http_version_ = other.http_version_;
+            proxy_ = std::move(other.proxy_);
+            key_failures_ = std::move(other.key_failures_);
+            prune_threshold_ = other.prune_threshold_;
+            prune_callback_ = std::move(other.prune_callback_);
+            limiter_ = std::move(other.limiter_);
+            tracer_ = std::move(other.tracer_);
+            trace_parent_ = other.trace_parent_;
+            trace_links_ = std::move(other.trace_links_);
+            recorder_ = std::move(other.recorder_);
+            payload_buffers_ = std::move(other.payload_buffers_);
+            other.curl_handle_ = nullptr;
+            other.multi_handle_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~BarkPush()
+    {
+        if (multi_handle_)
+        {
+            curl_multi_cleanup(multi_handle_);
+            multi_handle_ = nullptr;
+        }
+        if (curl_handle_)
+        {
+            curl_easy_cleanup(curl_handle_);
+            curl_handle_ = nullptr;
+        }
+    }
+
+    void addDeviceKey(const std::string &key)
+    {
+        if (!key.empty())
+        {
+            device_keys_.push_back(key);
+        }
+    }
+
+    void clearDeviceKeys()
+    {
+        device_keys_.clear();
+        key_failures_.clear();
+    }
+
+    void setKeyPruning(unsigned threshold,
+                       std::function<void(const std::string &key, unsigned failures)> on_prune = nullptr)
+    {
+        prune_threshold_ = static_cast<uint8_t>(std::min(threshold, 255u));
+        prune_callback_ = std::move(on_prune);
+        key_failures_.clear();
+    }
+
+    std::vector<std::string> getDeviceKeys() const
+    {
+        return device_keys_;
+    }
+
+    void setDefaultOptions()
+    {
+        verify_ssl_ = true;
+        if (!curl_handle_)
+            return;
+            
+        setCurlOption(curl_handle_, CURLOPT_CONNECTTIMEOUT, 5L);
+        setCurlOption(curl_handle_, CURLOPT_TIMEOUT, 10L);
+        setCurlOption(curl_handle_, CURLOPT_SSL_VERIFYPEER, 1L);
+        setCurlOption(curl_handle_, CURLOPT_SSL_VERIFYHOST, 2L);
+        setCurlOption(curl_handle_, CURLOPT_USERAGENT, "BarkPush-C++/1.0");
+    }
+
+    void disableSslVerification()
+    {
+        verify_ssl_ = false;
+        if (curl_handle_)
+        {
+            setCurlOption(curl_handle_, CURLOPT_SSL_VERIFYPEER, 0L);
+            setCurlOption(curl_handle_, CURLOPT_SSL_VERIFYHOST, 0L);
+        }
+    }
+
+    // CURLSSLOPT_* bits applied to every request, e.g. CURLSSLOPT_NATIVE_CA.
+    // Early data is controlled by enableEarlyData().
+    void setSslOptions(long options)
+    {
+        ssl_options_ = options;
+        if (curl_handle_)
+            applyEarlyData(curl_handle_, false);
+    }
+
+    bool enableEarlyData(bool enable = true)
+    {
+#ifdef CURLSSLOPT_EARLYDATA
+        if (enable && curl_version_info(CURLVERSION_NOW)->version_num < 0x080b00)
+        {
+            last_error_ = "TLS early data requires libcurl 8.11 or newer at runtime";
+            return false;
+        }
+        early_data_ = enable;
+        return true;
+#else
+        early_data_ = false;
+        if (enable)
+            last_error_ = "TLS early data requires building against libcurl 8.11 or newer";
+        return !enable;
+#endif
+    }
+
+    // Kernel TLS offload is not available through libcurl: its OpenSSL
+    // backend wraps the socket in its own BIO, so OpenSSL never hands the
+    // session keys to the kernel. Requesting it always fails.
+    bool enableKernelTls(bool enable = true)
+    {
+        if (!enable)
+            return true;
+        last_error_ = "Kernel TLS is not supported: libcurl's TLS backend keeps encryption in user space";
+        return false;
+    }
+
+    std::string getLastError() const
+    {
+        return last_error_;
+    }
+
+    long getLastHttpStatusCode() const
+    {
+        return http_status_code_;
+    }
+
+    static void appendEscapedJson(std::string &output, const std::string &input)
+    {
+        static const char hex[] = "0123456789abcdef";
+        for (char c : input)
+        {
+            switch (c)
+            {
+            case '"':  output += "\\\""; break;
+            case '\\': output += "\\\\"; break;
+            case '\b': output += "\\b"; break;
+            case '\f': output += "\\f"; break;
+            case '\n': output += "\\n"; break;
+            case '\r': output += "\\r"; break;
+            case '\t': output += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) <= 0x1F)
+                {
+                    output += "\\u00";
+                    output += hex[(c >> 4) & 0xF];
+                    output += hex[c & 0xF];
+                }
+                else
+                {
+                    output += c;
+                }
+            }
+        }
+    }
+
+    static std::string escapeJson(const std::string &input)
+    {
+        std::string output;
+        output.reserve(input.size());
+        appendEscapedJson(output, input);
+        return output;
+    }
+
+    static void appendKeysFragment(std::string &fragment, const std::vector<std::string> &device_keys)
+    {
+        fragment += "{\"device_keys\":[";
+        for (size_t i = 0; i < device_keys.size(); ++i)
+        {
+            if (i > 0)
+                fragment += ",";
+            fragment += "\"";
+            appendEscapedJson(fragment, device_keys[i]);
+            fragment += "\"";
+        }
+        fragment += "],";
+    }
+
+    static std::string buildKeysFragment(const std::vector<std::string> &device_keys)
+    {
+        std::string fragment;
+        appendKeysFragment(fragment, device_keys);
+        return fragment;
+    }
+
+    static void appendPayloadTail(std::string &json,
+                                  const std::string &title,
+                                  const std::string &message,
+                                  const std::map<std::string, std::string> &params = {})
+    {
+        json += "\"title\":\"";
+        appendEscapedJson(json, title);
+        json += "\",\"body\":\"";
+        appendEscapedJson(json, message);
+        json += "\"";
+
+        static const std::regex number_regex("^[-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?$");
+
+        for (const auto &[key, value] : params)
+        {
+            json += ",\"";
+            json += key;
+            json += "\":";
+
+            if (key != "url" && (value == "true" || value == "false" || std::regex_match(value, number_regex)))
+            {
+                json += value;
+            }
+            else
+            {
+                json += "\"";
+                appendEscapedJson(json, key == "url" ? normalizeUrl(value) : value);
+                json += "\"";
+            }
+        }
+        json += "}";
+    }
+
+    static std::string buildPayloadTail(const std::string &title,
+                                        const std::string &message,
+                                        const std::map<std::string, std::string> &params = {})
+    {
+        std::string json;
+        appendPayloadTail(json, title, message, params);
+        return json;
+    }
+
+    static std::string buildPayload(const std::vector<std::string> &device_keys,
+                                    const std::string &title,
+                                    const std::string &message,
+                                    const std::map<std::string, std::string> &params = {})
+    {
+        return buildKeysFragment(device_keys) + buildPayloadTail(title, message, params);
+    }
+
+    static BarkPreparedNotification prepare(const std::string &title,
+                                            const std::string &message,
+                                            const std::map<std::string, std::string> &params = {})
+    {
+        return BarkPreparedNotification(std::make_shared<const std::string>(
+            buildPayloadTail(title, message, params)), isIdempotent(params), params);
+    }
+
+    BarkError send(const std::string &title,
+                   const std::string &message,
+                   const std::map<std::string, std::string> &params = {})
+    {
+        last_error_.clear();
+        http_status_code_ = 0;
+
+        if (device_keys_.empty())
+        {
+            last_error_ = "No device keys specified";
+            return BarkError::NO_DEVICES_SPECIFIED;
+        }
+
+        if (recorder_)
+            recorder_->record(device_keys_.size(), title.size(), message.size(), params);
+
+        std::string json_head = buildKeysFragment(device_keys_);
+        std::string json_tail = buildPayloadTail(title, message, params);
+        uint64_t payload_hash = 0;
+        BarkError admission = admit(json_head, barkHash(json_tail), payload_hash);
+        if (admission != BarkError::SUCCESS)
+            return admission;
+
+        json_head += json_tail;
+        return finishAdmitted(performRequest(json_head, nullptr, isIdempotent(params)), payload_hash);
+    }
+
+    BarkError send(const BarkPreparedNotification &prepared)
+    {
+        last_error_.clear();
+        http_status_code_ = 0;
+
+        if (device_keys_.empty())
+        {
+            last_error_ = "No device keys specified";
+            return BarkError::NO_DEVICES_SPECIFIED;
+        }
+
+        if (recorder_)
+            recorder_->record(device_keys_.size(), 0, prepared.payloadSize(), prepared.param_count_,
+                              prepared.level_, prepared.idempotent_);
+
+        std::string json_head = buildKeysFragment(device_keys_);
+        uint64_t payload_hash = 0;
+        BarkError admission = admit(json_head, prepared.payload_hash_, payload_hash);
+        if (admission != BarkError::SUCCESS)
+            return admission;
+
+        return finishAdmitted(performRequest(json_head, prepared.payload_tail_.get(), prepared.idempotent_),
+                              payload_hash);
+    }
+
+    // Every send consults the limiter on the calling thread. Wrap a remote
+    // backend in BarkLeasedLimiter so sends answer from local state.
+    void setLimiter(std::shared_ptr<BarkLimitBackend> limiter)
+    {
+        limiter_ = std::move(limiter);
+    }
+
+    void setProxy(const BarkProxyOptions &proxy)
+    {
+        proxy_ = proxy;
+        if (curl_handle_)
+            applyProxy(curl_handle_);
+    }
+
+    void clearProxy()
+    {
+        setProxy(BarkProxyOptions());
+    }
+
+    const BarkProxyOptions &getProxy() const
+    {
+        return proxy_;
+    }
+
+    void setTracer(std::shared_ptr<BarkTracer> tracer)
+    {
+        tracer_ = std::move(tracer);
+    }
+
+    bool setHttpVersion(BarkHttpVersion version)
+    {
+        http_version_ = version;
+        if (curl_handle_)
+            curl_easy_setopt(curl_handle_, CURLOPT_HTTP_VERSION, curlHttpVersion(version));
+        return version != BarkHttpVersion::HTTP3 || http3Available();
+    }
+
+    BarkHttpVersion getHttpVersion() const
+    {
+        return http_version_;
+    }
+
+    static bool http3Available()
+    {
+#ifdef CURL_VERSION_HTTP3
+        return (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3) != 0;
+#else
+        return false;
+#endif
+    }
+
+    void setTraceParent(const BarkSpanContext &parent)
+    {
+        trace_parent_ = parent;
+    }
+
+    // Linked from the spans of following sends, for requests that carry
+    // several traced notifications.
+    void setTraceLinks(std::vector<BarkSpanContext> links)
+    {
+        trace_links_ = std::move(links);
+    }
+
+    void setRecorder(std::shared_ptr<BarkTrafficRecorder> recorder)
+    {
+        recorder_ = std::move(recorder);
+    }
+
+private:
+    BarkError admit(const std::string &keys_fragment, uint64_t tail_hash, uint64_t &payload_hash)
+    {
+        if (!limiter_)
+            return BarkError::SUCCESS;
+
+        payload_hash = barkPayloadHash(barkHash(keys_fragment), tail_hash);
+        bool fresh = true;
+        limiter_->checkAndMarkMany(&payload_hash, 1, &fresh);
+        if (!fresh)
+        {
+            last_error_ = "Duplicate notification suppressed";
+            BarkMetrics::instance().add(BarkMetrics::SUPPRESSED);
+            return BarkError::DUPLICATE_SUPPRESSED;
+        }
+        if (limiter_->leaseTokens(1) == 0)
+        {
+            limiter_->forgetMany(&payload_hash, 1);
+            last_error_ = "Rate limit exceeded";
+            BarkMetrics::instance().add(BarkMetrics::RATE_LIMITED);
+            return BarkError::RATE_LIMITED;
+        }
+        return BarkError::SUCCESS;
+    }
+
+    BarkError finishAdmitted(BarkError result, uint64_t payload_hash)
+    {
+        if (result != BarkError::SUCCESS && limiter_)
+            limiter_->forgetMany(&payload_hash, 1);
+        return result;
+    }
+
+    struct BodyReader
+    {
+        const std::string *parts[2];
+        size_t part;
+        size_t offset;
+    };
+
+    static size_t readCallback(char *buffer, size_t size, size_t nitems, void *userdata)
+    {
+        BodyReader *reader = static_cast<BodyReader *>(userdata);
+        size_t capacity = size * nitems;
+        size_t written = 0;
+        while (written < capacity && reader->part < 2)
+        {
+            const std::string &part = *reader->parts[reader->part];
+            size_t count = std::min(capacity - written, part.size() - reader->offset);
+            std::memcpy(buffer + written, part.data() + reader->offset, count);
+            written += count;
+            reader->offset += count;
+            if (reader->offset == part.size())
+            {
+                ++reader->part;
+                reader->offset = 0;
+            }
+        }
+        return written;
+    }
+
+    // libcurl rewinds the body when it retries on a fresh connection after a
+    // reused one turned out to be dead.
+    static int seekCallback(void *userdata, curl_off_t offset, int origin)
+    {
+        BodyReader *reader = static_cast<BodyReader *>(userdata);
+        if (origin != SEEK_SET || offset < 0)
+            return CURL_SEEKFUNC_CANTSEEK;
+        size_t position = static_cast<size_t>(offset);
+        for (reader->part = 0; reader->part < 2; ++reader->part)
+        {
+            size_t size = reader->parts[reader->part]->size();
+            if (position < size)
+                break;
+            position -= size;
+        }
+        if (position > 0 && reader->part == 2)
+            return CURL_SEEKFUNC_FAIL;
+        reader->offset = position;
+        return CURL_SEEKFUNC_OK;
+    }
+
+    BarkError performRequest(const std::string &json_head, const std::string *json_tail, bool idempotent)
+    {
+        if (!tracer_ && !trace_parent_.valid())
+            return performTransfer(json_head, json_tail, idempotent, nullptr, nullptr);
+
+        BarkSpan span;
+        bool sampled = false;
+        std::string trace_header = barkStartSendSpan(tracer_.get(), trace_parent_, span, sampled);
+        if (sampled)
+            span.links = trace_links_;
+        uint64_t response_bytes = 0;
+        BarkError result = performTransfer(json_head, json_tail, idempotent,
+                                           trace_header.empty() ? nullptr : &trace_header,
+                                           &response_bytes);
+        if (sampled)
+            barkEndSendSpan(*tracer_, span, pushUrl(), http_status_code_, result, device_keys_.size(),
+                            json_head.size() + (json_tail ? json_tail->size() : 0), response_bytes);
+        return result;
+    }
+
+    BarkError performTransfer(const std::string &json_head, const std::string *json_tail, bool idempotent,
+                              const std::string *trace_header, uint64_t *response_bytes)
+    {
+        std::string url = pushUrl();
+        CURL *handle = curl_handle_;
+        BarkEngine::Lease lease;
+        bool routed = BarkAsyncEngine::routesBlockingSends();
+        if (routed || (!handle && use_shared_engine_))
+        {
+            lease = BarkEngine::instance().acquire(routed ? std::string() : url, proxy_.url);
+            handle = lease.get();
+        }
+
+        if (lease.timedOut())
+        {
+            last_error_ = "Timed out waiting for a pooled connection to " + url;
+            return BarkError::NETWORK_ERROR;
+        }
+        if (!handle)
+        {
+            last_error_ = "cURL handle not initialized";
+            return BarkError::CURL_INIT_FAILED;
+        }
+
+        if (lease.get())
+            applyLeaseOptions(handle);
+        bool early_data = early_data_ && idempotent;
+        applyEarlyData(handle, early_data);
+
+        BodyReader reader = {{&json_head, json_tail}, 0, 0};
+        struct curl_slist *headers = nullptr;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+        setCurlOption(handle, CURLOPT_URL, url.c_str());
+        setCurlOption(handle, CURLOPT_POST, 1L);
+        if (json_tail)
+        {
+            headers = curl_slist_append(headers, "Expect:");
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDS, static_cast<char *>(nullptr));
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                             static_cast<curl_off_t>(json_head.size() + json_tail->size()));
+            curl_easy_setopt(handle, CURLOPT_READFUNCTION, readCallback);
+            curl_easy_setopt(handle, CURLOPT_READDATA, &reader);
+            curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION, seekCallback);
+            curl_easy_setopt(handle, CURLOPT_SEEKDATA, &reader);
+        }
+        else
+        {
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(json_head.size()));
+            setCurlOption(handle, CURLOPT_POSTFIELDS, json_head.c_str());
+        }
+        if (trace_header)
+            headers = curl_slist_append(headers, trace_header->c_str());
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+        setCurlOption(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+
+        std::string response_string;
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response_string);
+
+        auto perform = [&]()
+        {
+            reader = {{&json_head, json_tail}, 0, 0};
+            response_string.clear();
+            return routed ? BarkAsyncEngine::instance().perform(handle) : curl_easy_perform(handle);
+        };
+
+        CURLcode res = perform();
+        if (quicFailed(res) && http_version_ == BarkHttpVersion::HTTP3)
+        {
+            curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+            res = perform();
+            curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, curlHttpVersion(http_version_));
+        }
+        if (early_data && res == CURLE_OK)
+        {
+            long status = 0;
+            curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+            if (status == 425)
+            {
+                applyEarlyData(handle, false);
+                res = perform();
+            }
+        }
+        if (early_data)
+            applyEarlyData(handle, false);
+        curl_slist_free_all(headers);
+        if (lease.get())
+            BarkEngine::instance().recordTransfer(handle, res);
+        if (response_bytes)
+            *response_bytes = response_string.size();
+
+        if (res != CURLE_OK)
+        {
+            barkRecordSendMetrics(handle, false, json_head.size() + (json_tail ? json_tail->size() : 0));
+            last_error_ = "cURL error: " + std::string(curl_easy_strerror(res));
+            return BarkError::NETWORK_ERROR;
+        }
+
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_status_code_);
+        barkRecordSendMetrics(handle, http_status_code_ == 200 && !response_string.empty(),
+                          json_head.size() + (json_tail ? json_tail->size() : 0));
+        if (prune_threshold_ > 0)
+            updateKeyHealth(response_string, http_status_code_, device_keys_);
+
+        if (http_status_code_ != 200)
+        {
+            last_error_ = "HTTP error " + std::to_string(http_status_code_) +
+                          ", Response: " + response_string;
+            return BarkError::HTTP_ERROR;
+        }
+
+        if (response_string.empty())
+        {
+            last_error_ = "Empty response from server";
+            return BarkError::EMPTY_RESPONSE;
+        }
+
+        return BarkError::SUCCESS;
+    }
+
+public:
+    std::vector<BarkError> sendMany(const std::vector<BarkNotification> &notifications,
+                                    size_t max_in_flight = 64)
+    {
+        last_error_.clear();
+        http_status_code_ = 0;
+        std::vector<BarkError> results(notifications.size(), BarkError::NO_DEVICES_SPECIFIED);
+        if (notifications.empty())
+            return results;
+
+        std::vector<std::string> payloads;
+        payloads.swap(payload_buffers_);
+        std::vector<uint64_t> hashes;
+        serializeAll(notifications, payloads, limiter_ ? &hashes : nullptr);
+
+        std::vector<uint8_t> admitted(notifications.size(), 0);
+        std::vector<size_t> candidates;
+        candidates.reserve(notifications.size());
+        for (size_t index = 0; index < notifications.size(); ++index)
+        {
+            if (notifications[index].device_keys.empty())
+                continue;
+            if (recorder_)
+                recorder_->record(notifications[index]);
+            if (expireIfDue(notifications[index], results[index]))
+                continue;
+            candidates.push_back(index);
+        }
+        if (limiter_ && !candidates.empty())
+        {
+            std::vector<uint64_t> candidate_hashes(candidates.size());
+            for (size_t i = 0; i < candidates.size(); ++i)
+                candidate_hashes[i] = hashes[candidates[i]];
+            std::unique_ptr<bool[]> fresh(new bool[candidates.size()]);
+            limiter_->checkAndMarkMany(candidate_hashes.data(), candidate_hashes.size(), fresh.get());
+
+            size_t kept = 0;
+            for (size_t i = 0; i < candidates.size(); ++i)
+            {
+                if (fresh[i])
+                {
+                    candidates[kept++] = candidates[i];
+                    continue;
+                }
+                results[candidates[i]] = BarkError::DUPLICATE_SUPPRESSED;
+                last_error_ = "Duplicate notification suppressed";
+            }
+            BarkMetrics::instance().add(BarkMetrics::SUPPRESSED, candidates.size() - kept);
+            candidates.resize(kept);
+
+            size_t granted = kept > 0 ? std::min(limiter_->leaseTokens(kept), kept) : 0;
+            if (granted < kept)
+            {
+                std::vector<uint64_t> refused;
+                for (size_t i = granted; i < kept; ++i)
+                {
+                    results[candidates[i]] = BarkError::RATE_LIMITED;
+                    refused.push_back(hashes[candidates[i]]);
+                }
+                limiter_->forgetMany(refused.data(), refused.size());
+                last_error_ = "Rate limit exceeded";
+                BarkMetrics::instance().add(BarkMetrics::RATE_LIMITED, kept - granted);
+                candidates.resize(granted);
+            }
+        }
+        for (size_t index : candidates)
+            admitted[index] = 1;
+
+        // The multi handle lives as long as this instance so its connection
+        // cache carries over between calls.
+        if (!multi_handle_ && (multi_handle_ = curl_multi_init()))
+            curl_multi_setopt(multi_handle_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        CURLM *multi_handle = multi_handle_;
+        size_t unsent = 0;
+        if (!multi_handle)
+        {
+            last_error_ = "cURL multi initialization failed";
+            for (size_t index : candidates)
+                results[index] = BarkError::CURL_INIT_FAILED;
+            unsent = candidates.size();
+        }
+        else
+        {
+            sendAdmitted(notifications, payloads, admitted, results, max_in_flight, unsent);
+        }
+
+        payloads.resize(std::min(payloads.size(), kPooledPayloads));
+        payload_buffers_.swap(payloads);
+
+        if (limiter_)
+        {
+            if (unsent > 0)
+                limiter_->returnTokens(unsent);
+            std::vector<uint64_t> undelivered;
+            for (size_t index = 0; index < notifications.size(); ++index)
+            {
+                if (admitted[index] && results[index] != BarkError::SUCCESS)
+                    undelivered.push_back(hashes[index]);
+            }
+            if (!undelivered.empty())
+                limiter_->forgetMany(undelivered.data(), undelivered.size());
+        }
+        return results;
+    }
+
+private:
+    // Drives the admitted notifications through multi_handle_. `unsent`
+    // counts the ones that never reached the wire, whose limiter tokens can
+    // be returned.
+    void sendAdmitted(const std::vector<BarkNotification> &notifications, const std::vector<std::string> &payloads,
+                      const std::vector<uint8_t> &admitted, std::vector<BarkError> &results, size_t max_in_flight,
+                      size_t &unsent)
+    {
+        CURLM *multi_handle = multi_handle_;
+        size_t host_limit = BarkEngine::instance().poolOptions().max_connections_per_host;
+        curl_multi_setopt(multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(host_limit));
+
+        std::string url = pushUrl();
+        struct curl_slist *headers = nullptr;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+
+        std::vector<BarkEngine::Lease> leases(notifications.size());
+        std::vector<std::string> responses(notifications.size());
+
+        bool tracing = static_cast<bool>(tracer_);
+        for (size_t i = 0; i < notifications.size() && !tracing; ++i)
+            tracing = notifications[i].trace.valid();
+        std::vector<BarkSpan> spans(tracing ? notifications.size() : 0);
+        std::vector<uint8_t> sampled(tracing ? notifications.size() : 0);
+        std::vector<struct curl_slist *> trace_headers(tracing ? notifications.size() : 0, nullptr);
+        size_t next = 0;
+        size_t active = 0;
+        if (max_in_flight == 0)
+            max_in_flight = 1;
+
+        while (next < notifications.size() || active > 0)
+        {
+            while (next < notifications.size() && active < max_in_flight)
+            {
+                size_t index = next++;
+                if (!admitted[index])
+                    continue;
+                if (expireIfDue(notifications[index], results[index]))
+                {
+                    ++unsent;
+                    continue;
+                }
+
+                leases[index] = BarkEngine::instance().acquire();
+                CURL *handle = leases[index].get();
+                if (!handle)
+                {
+                    results[index] = BarkError::CURL_INIT_FAILED;
+                    last_error_ = "cURL handle not initialized";
+                    ++unsent;
+                    continue;
+                }
+
+                applyLeaseOptions(handle);
+                curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(handle, CURLOPT_POST, 1L);
+                curl_easy_setopt(handle, CURLOPT_POSTFIELDS, payloads[index].c_str());
+                curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, static_cast<long>(payloads[index].size()));
+
+                struct curl_slist *request_headers = headers;
+                if (tracing)
+                {
+                    bool span_sampled = false;
+                    std::string trace_header = barkStartSendSpan(tracer_.get(), notifications[index].trace,
+                                                                 spans[index], span_sampled);
+                    sampled[index] = span_sampled;
+                    if (!trace_header.empty())
+                    {
+                        trace_headers[index] = curl_slist_append(nullptr, "Content-Type: application/json");
+                        trace_headers[index] = curl_slist_append(trace_headers[index], trace_header.c_str());
+                        request_headers = trace_headers[index];
+                    }
+                }
+                curl_easy_setopt(handle, CURLOPT_HTTPHEADER, request_headers);
+                curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+                curl_easy_setopt(handle, CURLOPT_WRITEDATA, &responses[index]);
+                curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+                curl_easy_setopt(handle, CURLOPT_PRIVATE, reinterpret_cast<void *>(index));
+                CURLMcode added = curl_multi_add_handle(multi_handle, handle);
+                if (added != CURLM_OK)
+                {
+                    results[index] = BarkError::CURL_INIT_FAILED;
+                    last_error_ = "cURL multi error: " + std::string(curl_multi_strerror(added));
+                    leases[index].reset();
+                    if (tracing)
+                    {
+                        curl_slist_free_all(trace_headers[index]);
+                        trace_headers[index] = nullptr;
+                    }
+                    ++unsent;
+                    continue;
+                }
+                ++active;
+            }
+
+            int still_running = 0;
+            curl_multi_perform(multi_handle, &still_running);
+
+            int queued = 0;
+            CURLMsg *message = nullptr;
+            while ((message = curl_multi_info_read(multi_handle, &queued)))
+            {
+                if (message->msg != CURLMSG_DONE)
+                    continue;
+
+                CURL *handle = message->easy_handle;
+                void *index_ptr = nullptr;
+                curl_easy_getinfo(handle, CURLINFO_PRIVATE, &index_ptr);
+                size_t index = reinterpret_cast<size_t>(index_ptr);
+
+                long status = 0;
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+                if (message->data.result != CURLE_OK)
+                {
+                    results[index] = BarkError::NETWORK_ERROR;
+                    last_error_ = "cURL error: " + std::string(curl_easy_strerror(message->data.result));
+                }
+                else if (status != 200)
+                {
+                    results[index] = BarkError::HTTP_ERROR;
+                    last_error_ = "HTTP error " + std::to_string(status) + ", Response: " + responses[index];
+                }
+                else if (responses[index].empty())
+                {
+                    results[index] = BarkError::EMPTY_RESPONSE;
+                    last_error_ = "Empty response from server";
+                }
+                else
+                {
+                    results[index] = BarkError::SUCCESS;
+                }
+                http_status_code_ = status;
+                barkRecordSendMetrics(handle, results[index] == BarkError::SUCCESS, payloads[index].size());
+                if (prune_threshold_ > 0 && message->data.result == CURLE_OK)
+                    updateKeyHealth(responses[index], status, notifications[index].device_keys);
+
+                BarkEngine::instance().recordTransfer(handle, message->data.result);
+                curl_multi_remove_handle(multi_handle, handle);
+                leases[index].reset();
+                if (tracing)
+                {
+                    if (sampled[index])
+                        barkEndSendSpan(*tracer_, spans[index], url, status, results[index],
+                                        notifications[index].device_keys.size(), payloads[index].size(),
+                                        responses[index].size());
+                    curl_slist_free_all(trace_headers[index]);
+                    trace_headers[index] = nullptr;
+                }
+                std::string().swap(responses[index]);
+                --active;
+            }
+
+            if (active > 0)
+                curl_multi_wait(multi_handle, nullptr, 0, 1000, nullptr);
+        }
+
+        curl_slist_free_all(headers);
+    }
+
+    bool expireIfDue(const BarkNotification &notification, BarkError &result)
+    {
+        if (notification.expires_at == BarkClock::time_point() ||
+            std::chrono::steady_clock::now() < notification.expires_at)
+            return false;
+        result = BarkError::EXPIRED;
+        last_error_ = "Notification expired";
+        BarkMetrics::instance().add(BarkMetrics::expiredCounter(barkLevelIndex(notification.params)));
+        return true;
+    }
+
+public:
+
+    BarkError sendAdvanced(
+        const std::string &title,
+        const std::string &message,
+        const std::string &url = "",
+        const std::string &sound = "",
         const std::string &group = "",
         const std::string &level = "",
         const std::string &icon = "",
         const std::string &archive = "1",
         const std::string &autoCopy = "0") 
     {
-        std::map<std::string, std::string> params;
-        if (!url.empty())
-            params["url"] = normalizeUrl(url);
-        if (!sound.empty())
-            params["sound"] = sound;
-        if (!group.empty())
-            params["group"] = group;
-        if (!level.empty())
-            params["level"] = level;
-        if (!icon.empty())
-            params["icon"] = icon;
-        params["archive"] = archive;
-        params["autoCopy"] = autoCopy;
-        return send(title, message, params);
+        std::map<std::string, std::string> params;
+        if (!url.empty())
+            params["url"] = normalizeUrl(url);
+        if (!sound.empty())
+            params["sound"] = sound;
+        if (!group.empty())
+            params["group"] = group;
+        if (!level.empty())
+            params["level"] = level;
+        if (!icon.empty())
+            params["icon"] = icon;
+        params["archive"] = archive;
+        params["autoCopy"] = autoCopy;
+        return send(title, message, params);
+    }
+
+    BarkError sendCopy(const std::string &title, const std::string &message)
+    {
+        return sendAdvanced(title, message, "", "", "", "", "", "1", "1");
+    }
+
+    BarkError sendUrl(const std::string &url)
+    {
+        std::string normalizedUrl = normalizeUrl(url);
+        return sendAdvanced("跳转链接", normalizedUrl, normalizedUrl, 
+                           "", "", "", "", "1", "0");
+    }
+
+    BarkError sendUrl(const std::string &title, const std::string &message, const std::string &url)
+    {
+        return sendAdvanced(title, message, normalizeUrl(url), 
+                           "", "", "", "", "1", "0");
+    }
+
+    BarkError sendCritical(const std::string &title, const std::string &message)
+    {
+        return sendAdvanced(title, message, "", "", "", "critical", "", "1", "0");
+    }
+
+    BarkError sendCall(const std::string &title, const std::string &message)
+    {
+        std::map<std::string, std::string> params;
+        params["call"] = "1";
+        params["archive"] = "1";
+        return send(title, message, params);
+    }
+
+    BarkError sendSilence(const std::string &title, const std::string &message)
+    {
+        return sendAdvanced(title, message, "", "silence", "", "", "", "1", "0");
+    }
+
+private:
+    void init()
+    {
+        if (!barkInitCurlGlobal())
+        {
+            throw std::runtime_error("Failed to initialize cURL globally");
+        }
+        
+        CURL* temp_handle = curl_easy_init();
+        if (!temp_handle)
+        {
+            throw std::runtime_error("cURL initialization failed");
+        }
+        
+        curl_handle_ = temp_handle;
+        setDefaultOptions();
+    }
+};
+
+class BarkCurlTransport
+{
+private:
+    CURL *handle_;
+    struct curl_slist *headers_;
+
+    BarkCurlTransport(const BarkCurlTransport&) = delete;
+    BarkCurlTransport& operator=(const BarkCurlTransport&) = delete;
+
+public:
+    BarkCurlTransport() : handle_(nullptr), headers_(nullptr)
+    {
+        if (!barkInitCurlGlobal())
+            return;
+        handle_ = curl_easy_init();
+        if (!handle_)
+            return;
+        headers_ = curl_slist_append(headers_, "Content-Type: application/json");
+        curl_easy_setopt(handle_, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(handle_, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(handle_, CURLOPT_USERAGENT, "BarkPush-C++/1.0");
+        curl_easy_setopt(handle_, CURLOPT_POST, 1L);
+        curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, headers_);
+        curl_easy_setopt(handle_, CURLOPT_WRITEFUNCTION, BarkPush::writeCallback);
+    }
+
+    BarkCurlTransport(BarkCurlTransport &&other) noexcept
+        : handle_(other.handle_), headers_(other.headers_)
+    {
+        other.handle_ = nullptr;
+        other.headers_ = nullptr;
+    }
+
+    ~BarkCurlTransport()
+    {
+        if (handle_)
+            curl_easy_cleanup(handle_);
+        curl_slist_free_all(headers_);
+    }
+
+    CURL *handle() const
+    {
+        return handle_;
+    }
+
+    // trace_header, when given, is sent alongside the default headers.
+    BarkError post(const std::string &url, const std::string &body, long &http_status,
+                   std::string &response, std::string &error, const std::string *trace_header = nullptr)
+    {
+        if (!handle_)
+        {
+            error = "cURL handle not initialized";
+            return BarkError::CURL_INIT_FAILED;
+        }
+
+        response.clear();
+        curl_easy_setopt(handle_, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.size()));
+        curl_easy_setopt(handle_, CURLOPT_POSTFIELDS, body.c_str());
+        curl_easy_setopt(handle_, CURLOPT_WRITEDATA, &response);
+
+        struct curl_slist *traced = nullptr;
+        if (trace_header)
+        {
+            traced = curl_slist_append(traced, "Content-Type: application/json");
+            traced = curl_slist_append(traced, trace_header->c_str());
+            curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, traced);
+        }
+        CURLcode res = curl_easy_perform(handle_);
+        if (traced)
+        {
+            curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, headers_);
+            curl_slist_free_all(traced);
+        }
+        if (res != CURLE_OK)
+        {
+            error = "cURL error: " + std::string(curl_easy_strerror(res));
+            return BarkError::NETWORK_ERROR;
+        }
+
+        curl_easy_getinfo(handle_, CURLINFO_RESPONSE_CODE, &http_status);
+        if (http_status != 200)
+        {
+            error = "HTTP error " + std::to_string(http_status) + ", Response: " + response;
+            return BarkError::HTTP_ERROR;
+        }
+        if (response.empty())
+        {
+            error = "Empty response from server";
+            return BarkError::EMPTY_RESPONSE;
+        }
+        return BarkError::SUCCESS;
+    }
+};
+
+struct BarkNoRetry
+{
+    static constexpr unsigned max_attempts = 1;
+
+    static bool shouldRetry(BarkError, long)
+    {
+        return false;
+    }
+
+    static std::chrono::milliseconds backoff(unsigned)
+    {
+        return std::chrono::milliseconds(0);
+    }
+};
+
+template <unsigned Attempts = 3, unsigned BaseDelayMs = 100>
+struct BarkExponentialRetry
+{
+    static constexpr unsigned max_attempts = Attempts;
+
+    static bool shouldRetry(BarkError error, long http_status)
+    {
+        return error == BarkError::NETWORK_ERROR ||
+               (error == BarkError::HTTP_ERROR && (http_status == 429 || http_status >= 500));
+    }
+
+    static std::chrono::milliseconds backoff(unsigned retry)
+    {
+        return std::chrono::milliseconds(static_cast<int64_t>(BaseDelayMs) << std::min(retry, 16u));
+    }
+};
+
+struct BarkNoLimit
+{
+    static constexpr bool enabled = false;
+
+    BarkError admit(uint64_t, std::string &)
+    {
+        return BarkError::SUCCESS;
+    }
+
+    void forget(uint64_t) {}
+};
+
+class BarkBackendLimit
+{
+private:
+    std::shared_ptr<BarkLimitBackend> backend_;
+
+public:
+    static constexpr bool enabled = true;
+
+    explicit BarkBackendLimit(std::shared_ptr<BarkLimitBackend> backend = nullptr)
+        : backend_(std::move(backend))
+    {
+    }
+
+    void setBackend(std::shared_ptr<BarkLimitBackend> backend)
+    {
+        backend_ = std::move(backend);
+    }
+
+    BarkError admit(uint64_t hash, std::string &error)
+    {
+        if (!backend_)
+            return BarkError::SUCCESS;
+
+        bool fresh = true;
+        backend_->checkAndMarkMany(&hash, 1, &fresh);
+        if (!fresh)
+        {
+            error = "Duplicate notification suppressed";
+            return BarkError::DUPLICATE_SUPPRESSED;
+        }
+        if (backend_->leaseTokens(1) == 0)
+        {
+            backend_->forgetMany(&hash, 1);
+            error = "Rate limit exceeded";
+            return BarkError::RATE_LIMITED;
+        }
+        return BarkError::SUCCESS;
+    }
+
+    void forget(uint64_t hash)
+    {
+        if (backend_)
+            backend_->forgetMany(&hash, 1);
+    }
+};
+
+// A serializer writes the request body and returns the size of the leading
+// keys fragment; the dedup hash covers the fragment and the rest separately,
+// as BarkPush does.
+struct BarkJsonSerializer
+{
+    static size_t serialize(const std::vector<std::string> &device_keys, const std::string &title,
+                            const std::string &message, const std::map<std::string, std::string> &params,
+                            std::string &out)
+    {
+        out.clear();
+        BarkPush::appendKeysFragment(out, device_keys);
+        size_t keys_size = out.size();
+        BarkPush::appendPayloadTail(out, title, message, params);
+        return keys_size;
+    }
+};
+
+// Transports may take the traceparent header as a sixth argument to post()
+// and expose their CURL handle through handle() for latency metrics.
+template <typename Transport, typename = void>
+struct BarkTransportTakesTraceHeader : std::false_type
+{
+};
+
+template <typename Transport>
+struct BarkTransportTakesTraceHeader<Transport, std::void_t<decltype(std::declval<Transport &>().post(
+    std::declval<const std::string &>(), std::declval<const std::string &>(), std::declval<long &>(),
+    std::declval<std::string &>(), std::declval<std::string &>(), std::declval<const std::string *>()))>>
+    : std::true_type
+{
+};
+
+template <typename Transport, typename = void>
+struct BarkTransportHasHandle : std::false_type
+{
+};
+
+template <typename Transport>
+struct BarkTransportHasHandle<Transport, std::void_t<decltype(std::declval<const Transport &>().handle())>>
+    : std::true_type
+{
+};
+
+template <typename Transport = BarkCurlTransport, typename RetryPolicy = BarkNoRetry,
+          typename Limiter = BarkNoLimit, typename Serializer = BarkJsonSerializer>
+class BasicBarkPush : private Transport, private RetryPolicy, private Limiter, private Serializer
+{
+private:
+    std::vector<std::string> device_keys_;
+    std::string url_;
+    std::string payload_;
+    std::string response_;
+    std::string last_error_;
+    long http_status_code_;
+    std::chrono::milliseconds ttl_;
+    std::shared_ptr<BarkTracer> tracer_;
+    BarkSpanContext trace_parent_;
+
+    BarkError post(const std::string *trace_header)
+    {
+        BarkError result;
+        if constexpr (BarkTransportTakesTraceHeader<Transport>::value)
+            result = Transport::post(url_, payload_, http_status_code_, response_, last_error_, trace_header);
+        else
+            result = Transport::post(url_, payload_, http_status_code_, response_, last_error_);
+
+        CURL *handle = nullptr;
+        if constexpr (BarkTransportHasHandle<Transport>::value)
+            handle = Transport::handle();
+        barkRecordSendMetrics(handle, result == BarkError::SUCCESS, payload_.size());
+        return result;
+    }
+
+public:
+    explicit BasicBarkPush(const std::vector<std::string> &device_keys,
+                           const std::string &server = DEFAULT_BARK_SERVER,
+                           Transport transport = Transport(), Limiter limiter = Limiter())
+        : Transport(std::move(transport)), Limiter(std::move(limiter)), device_keys_(device_keys),
+          url_(server), http_status_code_(0), ttl_(0)
+    {
+        if (url_.empty() || url_.back() != '/')
+            url_ += '/';
+        url_ += "push";
+    }
+
+    Transport &transport()
+    {
+        return *this;
+    }
+
+    Limiter &limiter()
+    {
+        return *this;
+    }
+
+    void addDeviceKey(const std::string &device_key)
+    {
+        device_keys_.push_back(device_key);
+    }
+
+    void clearDeviceKeys()
+    {
+        device_keys_.clear();
+    }
+
+    const std::vector<std::string> &getDeviceKeys() const
+    {
+        return device_keys_;
+    }
+
+    std::string getLastError() const
+    {
+        return last_error_;
+    }
+
+    long getLastHttpStatusCode() const
+    {
+        return http_status_code_;
+    }
+
+    void setTtl(std::chrono::milliseconds ttl)
+    {
+        ttl_ = ttl;
+    }
+
+    void setTracer(std::shared_ptr<BarkTracer> tracer)
+    {
+        tracer_ = std::move(tracer);
+    }
+
+    void setTraceParent(const BarkSpanContext &parent)
+    {
+        trace_parent_ = parent;
+    }
+
+    BarkError send(const std::string &title, const std::string &message,
+                   const std::map<std::string, std::string> &params = {})
+    {
+        auto started = std::chrono::steady_clock::now();
+        last_error_.clear();
+        http_status_code_ = 0;
+
+        if (device_keys_.empty())
+        {
+            last_error_ = "No device keys specified";
+            return BarkError::NO_DEVICES_SPECIFIED;
+        }
+
+        size_t keys_size = Serializer::serialize(device_keys_, title, message, params, payload_);
+
+        uint64_t payload_hash = 0;
+        if constexpr (Limiter::enabled)
+        {
+            payload_hash = barkPayloadHash(barkHash(payload_.data(), keys_size),
+                                           barkHash(payload_.data() + keys_size, payload_.size() - keys_size));
+            BarkError admission = Limiter::admit(payload_hash, last_error_);
+            if (admission != BarkError::SUCCESS)
+                return admission;
+        }
+
+        BarkSpan span;
+        bool sampled = false;
+        std::string trace_header;
+        if (tracer_ || trace_parent_.valid())
+            trace_header = barkStartSendSpan(tracer_.get(), trace_parent_, span, sampled);
+        const std::string *header = trace_header.empty() ? nullptr : &trace_header;
+
+        BarkError result = post(header);
+        if constexpr (RetryPolicy::max_attempts > 1)
+        {
+            for (unsigned attempt = 1; attempt < RetryPolicy::max_attempts &&
+                 RetryPolicy::shouldRetry(result, http_status_code_); ++attempt)
+            {
+                std::chrono::milliseconds delay = RetryPolicy::backoff(attempt - 1);
+                if (ttl_.count() > 0 && std::chrono::steady_clock::now() + delay >= started + ttl_)
+                {
+                    BarkMetrics::instance().add(BarkMetrics::expiredCounter(barkLevelIndex(params)));
+                    last_error_ = "Notification expired before retry";
+                    result = BarkError::EXPIRED;
+                    break;
+                }
+                std::this_thread::sleep_for(delay);
+                http_status_code_ = 0;
+                result = post(header);
+                ++span.retries;
+            }
+        }
+        if (sampled)
+            barkEndSendSpan(*tracer_, span, url_, http_status_code_, result, device_keys_.size(), payload_.size(),
+                            response_.size());
+
+        if constexpr (Limiter::enabled)
+        {
+            if (result != BarkError::SUCCESS)
+                Limiter::forget(payload_hash);
+        }
+        if (result == BarkError::SUCCESS)
+            last_error_.clear();
+        return result;
+    }
+};
+
+// Entries are reference counted by the compact notifications that hold
+// them, so keys and param names from finished requests are freed and
+// their ids reused. Values live in chunks that never move, so lookup()
+// reads them without the lock while the caller holds a reference; intern
+// and release take the lock once per batch of ids.
+class BarkInternTable
+{
+private:
+    static constexpr size_t kFirstChunk = 64;
+    static constexpr size_t kChunks = 32;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string_view, uint32_t> ids_;
+    std::atomic<std::string *> chunks_[kChunks];
+    std::atomic<uint32_t> slots_;
+    std::vector<uint32_t> refs_;
+    std::vector<uint32_t> free_ids_;
+    size_t chunk_bytes_;
+    size_t string_bytes_;
+
+    // Chunk k holds kFirstChunk << k values.
+    static void locate(uint32_t id, size_t &chunk, size_t &offset)
+    {
+        uint64_t position = static_cast<uint64_t>(id) + kFirstChunk;
+        unsigned bit = 63 - static_cast<unsigned>(__builtin_clzll(position));
+        chunk = bit - 6;
+        offset = static_cast<size_t>(position - (uint64_t(1) << bit));
+    }
+
+    std::string &slot(uint32_t id) const
+    {
+        size_t chunk = 0;
+        size_t offset = 0;
+        locate(id, chunk, offset);
+        return chunks_[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+    static size_t heapBytes(const std::string &value)
+    {
+        const char *data = value.data();
+        const char *object = reinterpret_cast<const char *>(&value);
+        return data >= object && data < object + sizeof(value) ? 0 : value.capacity() + 1;
+    }
+
+    uint32_t internLocked(const std::string &value)
+    {
+        auto found = ids_.find(std::string_view(value));
+        if (found != ids_.end())
+        {
+            ++refs_[found->second];
+            return found->second;
+        }
+
+        uint32_t id;
+        if (!free_ids_.empty())
+        {
+            id = free_ids_.back();
+            free_ids_.pop_back();
+        }
+        else
+        {
+            id = slots_.load(std::memory_order_relaxed);
+            size_t chunk = 0;
+            size_t offset = 0;
+            locate(id, chunk, offset);
+            if (offset == 0)
+            {
+                chunks_[chunk].store(new std::string[kFirstChunk << chunk], std::memory_order_release);
+                chunk_bytes_ += (kFirstChunk << chunk) * sizeof(std::string);
+            }
+            refs_.push_back(0);
+            slots_.store(id + 1, std::memory_order_release);
+        }
+        std::string &stored = slot(id);
+        stored = value;
+        string_bytes_ += heapBytes(stored);
+        ids_.emplace(std::string_view(stored), id);
+        refs_[id] = 1;
+        return id;
+    }
+
+    void releaseLocked(uint32_t id)
+    {
+        if (id >= refs_.size() || refs_[id] == 0 || --refs_[id] > 0)
+            return;
+        std::string &stored = slot(id);
+        ids_.erase(std::string_view(stored));
+        string_bytes_ -= heapBytes(stored);
+        std::string().swap(stored);
+        free_ids_.push_back(id);
+    }
+
+public:
+    BarkInternTable() : slots_(0), chunk_bytes_(0), string_bytes_(0)
+    {
+        for (std::atomic<std::string *> &chunk : chunks_)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    BarkInternTable(const BarkInternTable &) = delete;
+    BarkInternTable& operator=(const BarkInternTable &) = delete;
+
+    ~BarkInternTable()
+    {
+        for (std::atomic<std::string *> &chunk : chunks_)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    static BarkInternTable &deviceKeys()
+    {
+        static BarkInternTable table;
+        return table;
+    }
+
+    static BarkInternTable &paramNames()
+    {
+        static BarkInternTable table;
+        return table;
+    }
+
+    uint32_t intern(const std::string &value)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return internLocked(value);
+    }
+
+    // Interns name(*it) for each element and writes the ids to ids.
+    template <typename Iterator, typename Name>
+    void internMany(Iterator first, Iterator last, uint32_t *ids, Name name)
+    {
+        if (first == last)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (; first != last; ++first)
+            *ids++ = internLocked(name(*first));
+    }
+
+    void release(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        releaseLocked(id);
+    }
+
+    void releaseMany(const uint32_t *ids, size_t count)
+    {
+        if (count == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; ++i)
+            releaseLocked(ids[i]);
+    }
+
+    void lookup(uint32_t id, std::string &out) const
+    {
+        if (id < slots_.load(std::memory_order_acquire))
+            out.assign(slot(id));
+        else
+            out.clear();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return ids_.size();
+    }
+
+    // Value chunks, string heap, the id map and the reference counts.
+    size_t residentBytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t node = sizeof(std::pair<const std::string_view, uint32_t>) + 2 * sizeof(void *);
+        return chunk_bytes_ + string_bytes_ + ids_.size() * node + ids_.bucket_count() * sizeof(void *) +
+               (refs_.capacity() + free_ids_.capacity()) * sizeof(uint32_t);
+    }
+};
+
+class BarkCompactNotification
+{
+private:
+    static constexpr size_t kTraceBytes = 16 + 8 + 1;
+
+    std::unique_ptr<uint8_t[]> data_;
+    uint32_t size_;
+    uint8_t level_;
+    int64_t expires_ns_;
+
+    static size_t varintSize(uint64_t value)
+    {
+        size_t size = 1;
+        while (value >= 0x80)
+        {
+            value >>= 7;
+            ++size;
+        }
+        return size;
+    }
+
+    static uint8_t *writeVarint(uint8_t *out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(value);
+        return out;
+    }
+
+    static uint8_t *writeString(uint8_t *out, const std::string &value)
+    {
+        out = writeVarint(out, value.size());
+        std::memcpy(out, value.data(), value.size());
+        return out + value.size();
+    }
+
+    static bool readVarint(const uint8_t *&in, const uint8_t *end, uint64_t &value)
+    {
+        value = 0;
+        for (unsigned shift = 0; in < end && shift < 64; shift += 7)
+        {
+            uint8_t byte = *in++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    static bool readString(const uint8_t *&in, const uint8_t *end, std::string &value)
+    {
+        uint64_t length = 0;
+        if (!readVarint(in, end, length) || length > static_cast<uint64_t>(end - in))
+            return false;
+        value.assign(reinterpret_cast<const char *>(in), static_cast<size_t>(length));
+        in += length;
+        return true;
+    }
+
+    static bool skipString(const uint8_t *&in, const uint8_t *end)
+    {
+        uint64_t length = 0;
+        if (!readVarint(in, end, length) || length > static_cast<uint64_t>(end - in))
+            return false;
+        in += length;
+        return true;
+    }
+
+    // Releases the ids in chunks so each table's lock is taken about once
+    // per notification.
+    void release()
+    {
+        if (!data_)
+            return;
+        const uint8_t *in = data_.get();
+        const uint8_t *end = in + size_;
+        uint32_t ids[32];
+        size_t held = 0;
+        uint64_t count = 0;
+        uint64_t id = 0;
+        if (!readVarint(in, end, count))
+            return;
+        for (uint64_t i = 0; i < count && readVarint(in, end, id); ++i)
+        {
+            ids[held++] = static_cast<uint32_t>(id);
+            if (held == 32)
+            {
+                BarkInternTable::deviceKeys().releaseMany(ids, held);
+                held = 0;
+            }
+        }
+        BarkInternTable::deviceKeys().releaseMany(ids, held);
+        held = 0;
+        if (!skipString(in, end) || !skipString(in, end) || !readVarint(in, end, count))
+            return;
+        for (uint64_t i = 0; i < count && readVarint(in, end, id) && skipString(in, end); ++i)
+        {
+            ids[held++] = static_cast<uint32_t>(id);
+            if (held == 32)
+            {
+                BarkInternTable::paramNames().releaseMany(ids, held);
+                held = 0;
+            }
+        }
+        BarkInternTable::paramNames().releaseMany(ids, held);
+        data_.reset();
+        size_ = 0;
+    }
+
+public:
+    BarkCompactNotification() : size_(0), level_(0), expires_ns_(0) {}
+
+    BarkCompactNotification(BarkCompactNotification &&other) noexcept = default;
+
+    BarkCompactNotification& operator=(BarkCompactNotification &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            data_ = std::move(other.data_);
+            size_ = other.size_;
+            level_ = other.level_;
+            expires_ns_ = other.expires_ns_;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    ~BarkCompactNotification()
+    {
+        release();
+    }
+
+    static BarkCompactNotification encode(const BarkNotification &notification)
+    {
+        const std::vector<std::string> &keys = notification.device_keys;
+        std::vector<uint32_t> key_ids(keys.size());
+        BarkInternTable::deviceKeys().internMany(keys.begin(), keys.end(), key_ids.data(),
+                                                 [](const std::string &key) -> const std::string & { return key; });
+
+        std::vector<uint32_t> param_ids(notification.params.size());
+        BarkInternTable::paramNames().internMany(notification.params.begin(), notification.params.end(),
+                                                 param_ids.data(),
+                                                 [](const auto &param) -> const std::string & { return param.first; });
+
+        size_t size = varintSize(key_ids.size());
+        for (uint32_t id : key_ids)
+            size += varintSize(id);
+        size += varintSize(notification.title.size()) + notification.title.size();
+        size += varintSize(notification.body.size()) + notification.body.size();
+        size += varintSize(param_ids.size());
+        size_t index = 0;
+        for (const auto &param : notification.params)
+        {
+            size += varintSize(param_ids[index++]);
+            size += varintSize(param.second.size()) + param.second.size();
+        }
+        bool traced = notification.trace.valid();
+        size += 1 + (traced ? kTraceBytes : 0);
+
+        BarkCompactNotification compact;
+        compact.data_.reset(new uint8_t[size]);
+        compact.size_ = static_cast<uint32_t>(size);
+        compact.level_ = barkLevelIndex(notification.params);
+        compact.expireAt(notification.expires_at);
+
+        uint8_t *out = writeVarint(compact.data_.get(), key_ids.size());
+        for (uint32_t id : key_ids)
+            out = writeVarint(out, id);
+        out = writeString(out, notification.title);
+        out = writeString(out, notification.body);
+        out = writeVarint(out, param_ids.size());
+        index = 0;
+        for (const auto &param : notification.params)
+        {
+            out = writeVarint(out, param_ids[index++]);
+            out = writeString(out, param.second);
+        }
+        *out++ = traced ? 1 : 0;
+        if (traced)
+        {
+            const BarkSpanContext &trace = notification.trace;
+            std::memcpy(out, trace.trace_id, sizeof(trace.trace_id));
+            std::memcpy(out + sizeof(trace.trace_id), trace.span_id, sizeof(trace.span_id));
+            out[kTraceBytes - 1] = trace.flags;
+        }
+        return compact;
+    }
+
+    bool decode(BarkNotification &notification) const
+    {
+        const uint8_t *in = data_.get();
+        const uint8_t *end = in + size_;
+        uint64_t count = 0;
+        if (!readVarint(in, end, count) || count > size_)
+            return false;
+
+        notification.device_keys.resize(static_cast<size_t>(count));
+        for (std::string &key : notification.device_keys)
+        {
+            uint64_t id = 0;
+            if (!readVarint(in, end, id))
+                return false;
+            BarkInternTable::deviceKeys().lookup(static_cast<uint32_t>(id), key);
+        }
+
+        if (!readString(in, end, notification.title) || !readString(in, end, notification.body) ||
+            !readVarint(in, end, count))
+            return false;
+
+        notification.params.clear();
+        std::string name;
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            uint64_t id = 0;
+            std::string value;
+            if (!readVarint(in, end, id) || !readString(in, end, value))
+                return false;
+            BarkInternTable::paramNames().lookup(static_cast<uint32_t>(id), name);
+            notification.params.emplace(name, std::move(value));
+        }
+
+        notification.expires_at = BarkClock::time_point(std::chrono::nanoseconds(expires_ns_));
+        notification.trace = BarkSpanContext();
+        if (in == end)
+            return false;
+        if (*in++ != 0)
+        {
+            if (static_cast<size_t>(end - in) < kTraceBytes)
+                return false;
+            BarkSpanContext &trace = notification.trace;
+            std::memcpy(trace.trace_id, in, sizeof(trace.trace_id));
+            std::memcpy(trace.span_id, in + sizeof(trace.trace_id), sizeof(trace.span_id));
+            trace.flags = in[kTraceBytes - 1];
+            in += kTraceBytes;
+        }
+        return in == end;
+    }
+
+    // Portable form for handing notifications to another process. Keys and
+    // param names are written as strings instead of intern ids, and expiry
+    // as the time left relative to now.
+    static void serialize(const BarkNotification &notification, BarkClock::time_point now, std::string &out)
+    {
+        uint64_t remaining_ns = 0;
+        if (notification.expires_at != BarkClock::time_point())
+            remaining_ns = static_cast<uint64_t>(std::max<int64_t>(1,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(notification.expires_at - now).count()));
+
+        size_t size = varintSize(notification.device_keys.size());
+        for (const std::string &key : notification.device_keys)
+            size += varintSize(key.size()) + key.size();
+        size += varintSize(notification.title.size()) + notification.title.size();
+        size += varintSize(notification.body.size()) + notification.body.size();
+        size += varintSize(notification.params.size());
+        for (const auto &[name, value] : notification.params)
+            size += varintSize(name.size()) + name.size() + varintSize(value.size()) + value.size();
+        bool traced = notification.trace.valid();
+        size += varintSize(remaining_ns) + 1 + (traced ? kTraceBytes : 0);
+
+        size_t first = out.size();
+        out.resize(first + size);
+        uint8_t *out_ptr = reinterpret_cast<uint8_t *>(&out[first]);
+        out_ptr = writeVarint(out_ptr, notification.device_keys.size());
+        for (const std::string &key : notification.device_keys)
+            out_ptr = writeString(out_ptr, key);
+        out_ptr = writeString(out_ptr, notification.title);
+        out_ptr = writeString(out_ptr, notification.body);
+        out_ptr = writeVarint(out_ptr, notification.params.size());
+        for (const auto &[name, value] : notification.params)
+        {
+            out_ptr = writeString(out_ptr, name);
+            out_ptr = writeString(out_ptr, value);
+        }
+        out_ptr = writeVarint(out_ptr, remaining_ns);
+        *out_ptr++ = traced ? 1 : 0;
+        if (traced)
+        {
+            const BarkSpanContext &trace = notification.trace;
+            std::memcpy(out_ptr, trace.trace_id, sizeof(trace.trace_id));
+            std::memcpy(out_ptr + sizeof(trace.trace_id), trace.span_id, sizeof(trace.span_id));
+            out_ptr[kTraceBytes - 1] = trace.flags;
+        }
+    }
+
+    static bool deserialize(const uint8_t *&in, const uint8_t *end, BarkClock::time_point now,
+                            BarkNotification &notification)
+    {
+        uint64_t count = 0;
+        if (!readVarint(in, end, count) || count > static_cast<uint64_t>(end - in))
+            return false;
+        notification.device_keys.resize(static_cast<size_t>(count));
+        for (std::string &key : notification.device_keys)
+        {
+            if (!readString(in, end, key))
+                return false;
+        }
+        if (!readString(in, end, notification.title) || !readString(in, end, notification.body) ||
+            !readVarint(in, end, count))
+            return false;
+
+        notification.params.clear();
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            std::string name;
+            std::string value;
+            if (!readString(in, end, name) || !readString(in, end, value))
+                return false;
+            notification.params.emplace(std::move(name), std::move(value));
+        }
+
+        uint64_t remaining_ns = 0;
+        if (!readVarint(in, end, remaining_ns) || in == end)
+            return false;
+        notification.expires_at = remaining_ns == 0
+            ? BarkClock::time_point()
+            : now + std::chrono::nanoseconds(static_cast<int64_t>(std::min<uint64_t>(remaining_ns, INT64_MAX / 2)));
+        notification.trace = BarkSpanContext();
+        if (*in++ != 0)
+        {
+            if (static_cast<size_t>(end - in) < kTraceBytes)
+                return false;
+            BarkSpanContext &trace = notification.trace;
+            std::memcpy(trace.trace_id, in, sizeof(trace.trace_id));
+            std::memcpy(trace.span_id, in + sizeof(trace.trace_id), sizeof(trace.span_id));
+            trace.flags = in[kTraceBytes - 1];
+            in += kTraceBytes;
+        }
+        return true;
+    }
+
+    void expireAt(BarkClock::time_point expires_at)
+    {
+        expires_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            expires_at.time_since_epoch()).count();
+    }
+
+    int64_t expiresNanos() const
+    {
+        return expires_ns_;
+    }
+
+    bool expired(int64_t now_ns) const
+    {
+        return expires_ns_ != 0 && now_ns >= expires_ns_;
+    }
+
+    uint8_t level() const
+    {
+        return level_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    size_t residentBytes() const
+    {
+        return sizeof(*this) + size_;
+    }
+};
+
+class BarkTransport
+{
+public:
+    virtual ~BarkTransport() = default;
+
+    virtual BarkError send(const BarkNotification &notification, std::string &error) = 0;
+};
+
+class BarkParker
+{
+private:
+    std::atomic<uint32_t> sequence_;
+    std::atomic<uint32_t> sleepers_;
+    std::atomic<uint64_t> wake_syscalls_;
+#ifndef __linux__
+    std::mutex mutex_;
+    std::condition_variable cv_;
+#endif
+
+    static void relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    void block(uint32_t observed, std::chrono::nanoseconds timeout)
+    {
+#ifdef __linux__
+        timespec deadline{};
+        timespec *deadline_ptr = nullptr;
+        if (timeout.count() >= 0)
+        {
+            deadline.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+            deadline.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+            deadline_ptr = &deadline;
+        }
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sequence_), FUTEX_WAIT_PRIVATE, observed,
+                deadline_ptr, nullptr, 0);
+#else
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto changed = [this, observed]() { return sequence_.load(std::memory_order_acquire) != observed; };
+        if (timeout.count() >= 0)
+            cv_.wait_for(lock, timeout, changed);
+        else
+            cv_.wait(lock, changed);
+#endif
+    }
+
+public:
+    BarkParker() : sequence_(0), sleepers_(0), wake_syscalls_(0) {}
+
+    uint32_t prepare() const
+    {
+        return sequence_.load(std::memory_order_acquire);
+    }
+
+    bool wait(uint32_t observed, std::chrono::nanoseconds timeout, unsigned spin)
+    {
+        for (unsigned i = 0; i < spin; ++i)
+        {
+            if (sequence_.load(std::memory_order_acquire) != observed)
+                return true;
+            relax();
+        }
+
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        if (sequence_.load(std::memory_order_seq_cst) == observed && timeout.count() != 0)
+            block(observed, timeout);
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void notify(bool all = false)
+    {
+        sequence_.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_seq_cst) == 0)
+            return;
+
+        wake_syscalls_.fetch_add(1, std::memory_order_relaxed);
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sequence_), FUTEX_WAKE_PRIVATE,
+                all ? INT_MAX : 1, nullptr, nullptr, 0);
+#else
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (all)
+            cv_.notify_all();
+        else
+            cv_.notify_one();
+#endif
+    }
+
+    uint64_t wakeSyscalls() const
+    {
+        return wake_syscalls_.load(std::memory_order_relaxed);
+    }
+};
+
+struct BarkDispatcherOptions
+{
+    size_t max_queue_size = 100000;
+    size_t max_batch_size = 256;
+    size_t worker_count = 1;
+    std::chrono::milliseconds coalesce_window{20};
+    unsigned max_spin = 4096;
+    double requests_per_second = 0.0;
+    double burst = 10.0;
+    std::shared_ptr<BarkLimitBackend> limiter;
+    std::chrono::milliseconds default_ttl{0};
+    std::shared_ptr<BarkClock> clock;
+    std::shared_ptr<BarkTransport> transport;
+    bool manual_pump = false;
+    BarkHttpVersion http_version = BarkHttpVersion::DEFAULT;
+    bool early_data = false;
+    BarkProxyOptions proxy;
+    std::shared_ptr<BarkTracer> tracer;
+    std::shared_ptr<BarkTrafficRecorder> recorder;
+};
+
+struct BarkDispatcherStats
+{
+    uint64_t enqueued = 0;
+    uint64_t rejected = 0;
+    uint64_t suppressed = 0;
+    uint64_t coalesced = 0;
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t expired = 0;
+    uint64_t wake_syscalls = 0;
+};
+
+class BarkDispatcher
+{
+private:
+    std::string server_;
+    BarkDispatcherOptions options_;
+    std::shared_ptr<BarkClock> clock_;
+    std::mutex mutex_;
+    BarkParker parker_;
+    std::condition_variable idle_cv_;
+    // Notifications expired in place are left as empty tombstones until they
+    // reach the head; live_ counts the rest. Buckets list the sequence
+    // numbers of the notifications expiring in each second, oldest first.
+    std::deque<BarkCompactNotification> queue_;
+    uint64_t head_seq_;
+    size_t live_;
+    std::map<int64_t, std::deque<uint64_t>> expiry_buckets_;
+    std::vector<BarkNotification> spare_;
+    size_t queued_bytes_;
+    size_t in_flight_;
+    bool stopping_;
+    BarkDispatcherStats stats_;
+    std::string last_error_;
+    std::mutex rate_mutex_;
+    double tokens_;
+    BarkClock::time_point last_refill_;
+    std::vector<std::thread> workers_;
+    std::unique_ptr<BarkPush> pump_sender_;
+
+    BarkDispatcher(const BarkDispatcher&) = delete;
+    BarkDispatcher& operator=(const BarkDispatcher&) = delete;
+
+    void recycleLocked(BarkNotification &&notification)
+    {
+        if (spare_.size() >= options_.max_batch_size)
+            return;
+        notification.device_keys.clear();
+        notification.title.clear();
+        notification.body.clear();
+        notification.params.clear();
+        notification.trace = BarkSpanContext();
+        notification.expires_at = BarkClock::time_point();
+        spare_.push_back(std::move(notification));
+    }
+
+    int64_t nowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_->now().time_since_epoch()).count();
+    }
+
+    static int64_t expiryBucket(int64_t expires_ns)
+    {
+        return expires_ns / 1000000000;
+    }
+
+    BarkCompactNotification encode(const BarkNotification &notification)
+    {
+        if (options_.recorder)
+            options_.recorder->record(notification);
+        BarkCompactNotification compact = BarkCompactNotification::encode(notification);
+        if (notification.expires_at == BarkClock::time_point() && options_.default_ttl.count() > 0)
+            compact.expireAt(clock_->now() + options_.default_ttl);
+        return compact;
+    }
+
+    void pushLocked(BarkCompactNotification &&compact)
+    {
+        if (compact.expiresNanos() != 0)
+            expiry_buckets_[expiryBucket(compact.expiresNanos())].push_back(head_seq_ + queue_.size());
+        queued_bytes_ += compact.residentBytes();
+        queue_.push_back(std::move(compact));
+        ++live_;
+    }
+
+    static bool tombstone(const BarkCompactNotification &compact)
+    {
+        return compact.size() == 0;
+    }
+
+    void dropTombstonesLocked()
+    {
+        while (!queue_.empty() && tombstone(queue_.front()))
+        {
+            queue_.pop_front();
+            ++head_seq_;
+        }
+    }
+
+    // Takes the head notification, which is also the oldest entry of its
+    // expiry bucket.
+    BarkCompactNotification popLocked()
+    {
+        dropTombstonesLocked();
+        BarkCompactNotification compact = std::move(queue_.front());
+        queue_.pop_front();
+        ++head_seq_;
+        --live_;
+        queued_bytes_ -= compact.residentBytes();
+        if (compact.expiresNanos() != 0)
+        {
+            auto bucket = expiry_buckets_.find(expiryBucket(compact.expiresNanos()));
+            if (bucket != expiry_buckets_.end())
+            {
+                bucket->second.pop_front();
+                if (bucket->second.empty())
+                    expiry_buckets_.erase(bucket);
+            }
+        }
+        dropTombstonesLocked();
+        return compact;
+    }
+
+    void countExpiredLocked(uint8_t level, uint64_t notifications = 1)
+    {
+        stats_.expired += notifications;
+        BarkMetrics::instance().add(BarkMetrics::expiredCounter(level), notifications);
+    }
+
+    // Expires every bucket that ended before the current second, touching
+    // only the notifications in those buckets.
+    void expireBucketsLocked(int64_t now_ns)
+    {
+        int64_t current = expiryBucket(now_ns);
+        while (!expiry_buckets_.empty() && expiry_buckets_.begin()->first < current)
+        {
+            for (uint64_t seq : expiry_buckets_.begin()->second)
+            {
+                BarkCompactNotification &compact = queue_[seq - head_seq_];
+                queued_bytes_ -= compact.residentBytes();
+                countExpiredLocked(compact.level());
+                compact = BarkCompactNotification();
+                --live_;
+            }
+            expiry_buckets_.erase(expiry_buckets_.begin());
+        }
+        dropTombstonesLocked();
+        if (queue_.size() >= 2 * std::max<size_t>(live_, options_.max_batch_size))
+            compactLocked();
+    }
+
+    // Drops the tombstones behind the head once they make up half the
+    // queue, so the cost stays proportional to the expired notifications.
+    void compactLocked()
+    {
+        std::deque<BarkCompactNotification> kept;
+        for (BarkCompactNotification &compact : queue_)
+        {
+            if (!tombstone(compact))
+                kept.push_back(std::move(compact));
+        }
+        queue_.swap(kept);
+        expiry_buckets_.clear();
+        for (size_t i = 0; i < queue_.size(); ++i)
+        {
+            if (queue_[i].expiresNanos() != 0)
+                expiry_buckets_[expiryBucket(queue_[i].expiresNanos())].push_back(head_seq_ + i);
+        }
+    }
+
+    bool queueFullLocked()
+    {
+        if (live_ < options_.max_queue_size)
+            return false;
+        int64_t now_ns = nowNanos();
+        if (expiry_buckets_.empty() || expiry_buckets_.begin()->first >= expiryBucket(now_ns))
+            return true;
+        expireBucketsLocked(now_ns);
+        return live_ >= options_.max_queue_size;
+    }
+
+    static std::string coalesceKey(const BarkNotification &notification)
+    {
+        std::string key = notification.title;
+        key += '\0';
+        key += notification.body;
+        for (const auto &[name, value] : notification.params)
+        {
+            key += '\0';
+            key += name;
+            key += '\x01';
+            key += value;
+        }
+        return key;
+    }
+
+    // Merged notifications share title, body and params, so one level per
+    // request accounts for all of them on expiry. origins maps each batch
+    // entry to its request; links holds the traces of merged notifications
+    // other than the one the request carries.
+    static std::vector<BarkNotification> coalesce(std::vector<BarkNotification> &batch,
+                                                  std::vector<size_t> &origins,
+                                                  std::vector<std::vector<BarkSpanContext>> &links)
+    {
+        std::vector<BarkNotification> requests;
+        std::map<std::string, size_t> index;
+        origins.clear();
+        links.clear();
+        for (BarkNotification &notification : batch)
+        {
+            auto [it, inserted] = index.emplace(coalesceKey(notification), requests.size());
+            origins.push_back(it->second);
+            if (inserted)
+            {
+                requests.push_back(std::move(notification));
+                links.emplace_back();
+                continue;
+            }
+
+            BarkNotification &request = requests[it->second];
+            if (!request.trace.valid())
+                request.trace = notification.trace;
+            else if (notification.trace.valid())
+                links[it->second].push_back(notification.trace);
+            if (request.expires_at != BarkClock::time_point())
+            {
+                request.expires_at = notification.expires_at == BarkClock::time_point()
+                                         ? notification.expires_at
+                                         : std::max(request.expires_at, notification.expires_at);
+            }
+            std::vector<std::string> &keys = request.device_keys;
+            for (std::string &key : notification.device_keys)
+            {
+                if (std::find(keys.begin(), keys.end(), key) == keys.end())
+                    keys.push_back(std::move(key));
+            }
+        }
+        return requests;
+    }
+
+    // Leaves the hashes of the notifications kept in hashes, so failed
+    // deliveries can be forgotten.
+    uint64_t suppressDuplicates(std::vector<BarkNotification> &batch, std::vector<uint64_t> &hashes)
+    {
+        hashes.resize(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            std::string key = coalesceKey(batch[i]);
+            for (const std::string &device_key : batch[i].device_keys)
+            {
+                key += '\0';
+                key += device_key;
+            }
+            hashes[i] = barkHash(key);
+        }
+
+        std::unique_ptr<bool[]> fresh(new bool[batch.size()]);
+        options_.limiter->checkAndMarkMany(hashes.data(), hashes.size(), fresh.get());
+
+        size_t kept = 0;
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            if (fresh[i])
+            {
+                if (kept != i)
+                {
+                    batch[kept] = std::move(batch[i]);
+                    hashes[kept] = hashes[i];
+                }
+                ++kept;
+            }
+        }
+        uint64_t suppressed = batch.size() - kept;
+        batch.resize(kept);
+        hashes.resize(kept);
+        return suppressed;
+    }
+
+    static bool expiredAt(const BarkNotification &notification, BarkClock::time_point now)
+    {
+        return notification.expires_at != BarkClock::time_point() && now >= notification.expires_at;
+    }
+
+    // Gives up without taking a token once the deadline passes.
+    bool acquireToken(BarkClock::time_point deadline)
+    {
+        if (options_.requests_per_second <= 0.0)
+            return true;
+
+        std::unique_lock<std::mutex> lock(rate_mutex_);
+        while (true)
+        {
+            auto now = clock_->now();
+            double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+            tokens_ = std::min(options_.burst, tokens_ + elapsed * options_.requests_per_second);
+            last_refill_ = now;
+            if (deadline != BarkClock::time_point() && now >= deadline)
+                return false;
+            if (tokens_ >= 1.0)
+            {
+                tokens_ -= 1.0;
+                return true;
+            }
+
+            auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double>((1.0 - tokens_) / options_.requests_per_second)) +
+                std::chrono::nanoseconds(1);
+            if (deadline != BarkClock::time_point())
+                wait = std::min<std::chrono::nanoseconds>(wait, deadline - now);
+            lock.unlock();
+            clock_->sleepFor(wait);
+            lock.lock();
+        }
+    }
+
+    size_t takeBatchLocked(std::vector<BarkCompactNotification> &compact_batch,
+                           std::vector<BarkNotification> &batch)
+    {
+        size_t limit = std::min(live_, options_.max_batch_size);
+        compact_batch.reserve(limit);
+        batch.reserve(limit);
+        int64_t now_ns = expiry_buckets_.empty() ? 0 : nowNanos();
+        while (compact_batch.size() < limit && live_ > 0)
+        {
+            BarkCompactNotification compact = popLocked();
+            if (compact.expired(now_ns))
+            {
+                countExpiredLocked(compact.level());
+                continue;
+            }
+            compact_batch.push_back(std::move(compact));
+            if (!spare_.empty())
+            {
+                batch.push_back(std::move(spare_.back()));
+                spare_.pop_back();
+            }
+            else
+            {
+                batch.emplace_back();
+            }
+        }
+        in_flight_ += compact_batch.size();
+        return compact_batch.size();
+    }
+
+    void processBatch(std::unique_lock<std::mutex> &lock,
+                      std::vector<BarkCompactNotification> &compact_batch,
+                      std::vector<BarkNotification> &batch, size_t count, BarkPush &sender)
+    {
+        lock.unlock();
+
+        for (size_t i = 0; i < count; ++i)
+            compact_batch[i].decode(batch[i]);
+        compact_batch.clear();
+
+        std::vector<uint64_t> hashes;
+        uint64_t suppressed = options_.limiter ? suppressDuplicates(batch, hashes) : 0;
+        std::vector<size_t> origins;
+        std::vector<std::vector<BarkSpanContext>> links;
+        std::vector<BarkNotification> requests = coalesce(batch, origins, links);
+        std::vector<uint32_t> sources(requests.size(), 0);
+        for (size_t origin : origins)
+            ++sources[origin];
+        std::vector<uint8_t> delivered(requests.size(), 0);
+        uint64_t failures = 0;
+        uint64_t sent = 0;
+        std::vector<std::pair<uint8_t, uint32_t>> expired_levels;
+        std::string error;
+        size_t leased = 0;
+        for (size_t i = 0; i < requests.size(); ++i)
+        {
+            const BarkNotification &request = requests[i];
+            bool expired = expiredAt(request, clock_->now());
+            while (options_.limiter && leased == 0 && !expired)
+            {
+                BarkClock::time_point now = clock_->now();
+                size_t live = std::count_if(requests.begin() + i, requests.end(),
+                                            [now](const BarkNotification &pending) { return !expiredAt(pending, now); });
+                leased = options_.limiter->leaseTokens(live);
+                if (leased == 0)
+                {
+                    clock_->sleepFor(std::chrono::milliseconds(10));
+                    expired = expiredAt(request, clock_->now());
+                }
+            }
+            if (expired || !acquireToken(request.expires_at))
+            {
+                expired_levels.emplace_back(barkLevelIndex(request.params), sources[i]);
+                continue;
+            }
+            if (options_.limiter)
+                --leased;
+            ++sent;
+            if (options_.transport)
+            {
+                std::string transport_error;
+                if (options_.transport->send(request, transport_error) != BarkError::SUCCESS)
+                {
+                    ++failures;
+                    error = transport_error;
+                    continue;
+                }
+                delivered[i] = 1;
+                continue;
+            }
+            sender.clearDeviceKeys();
+            for (const std::string &key : request.device_keys)
+                sender.addDeviceKey(key);
+            sender.setTraceParent(request.trace);
+            sender.setTraceLinks(std::move(links[i]));
+            if (sender.send(request.title, request.body, request.params) != BarkError::SUCCESS)
+            {
+                ++failures;
+                error = sender.getLastError();
+                continue;
+            }
+            delivered[i] = 1;
+        }
+
+        if (options_.limiter)
+        {
+            if (leased > 0)
+                options_.limiter->returnTokens(leased);
+            std::vector<uint64_t> undelivered;
+            for (size_t j = 0; j < hashes.size(); ++j)
+            {
+                if (!delivered[origins[j]])
+                    undelivered.push_back(hashes[j]);
+            }
+            if (!undelivered.empty())
+                options_.limiter->forgetMany(undelivered.data(), undelivered.size());
+        }
+
+        lock.lock();
+        in_flight_ -= count;
+        stats_.suppressed += suppressed;
+        stats_.coalesced += count - suppressed - requests.size();
+        BarkMetrics::instance().add(BarkMetrics::SUPPRESSED, suppressed);
+        BarkMetrics::instance().add(BarkMetrics::COALESCED, count - suppressed - requests.size());
+        stats_.requests += sent;
+        stats_.failures += failures;
+        for (const auto &[level, notifications] : expired_levels)
+            countExpiredLocked(level, notifications);
+        if (!error.empty())
+            last_error_ = error;
+        for (BarkNotification &request : requests)
+            recycleLocked(std::move(request));
+        if (live_ == 0 && in_flight_ == 0)
+            idle_cv_.notify_all();
+    }
+
+    void workerLoop()
+    {
+        BarkPush sender(BARK_SHARED_ENGINE, {}, server_);
+        sender.setProxy(options_.proxy);
+        sender.setTracer(options_.tracer);
+        sender.setHttpVersion(options_.http_version);
+        sender.enableEarlyData(options_.early_data);
+        unsigned spin = options_.max_spin / 4;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            uint32_t observed = parker_.prepare();
+            if (live_ == 0 && !stopping_)
+            {
+                lock.unlock();
+                bool spun = parker_.wait(observed, std::chrono::nanoseconds(-1), spin);
+                spin = spun ? std::min(options_.max_spin, spin * 2 + 1) : spin / 2;
+                lock.lock();
+                continue;
+            }
+            if (live_ == 0)
+                break;
+
+            if (options_.coalesce_window.count() > 0)
+            {
+                auto deadline = clock_->now() + options_.coalesce_window;
+                while (!stopping_ && live_ < options_.max_batch_size)
+                {
+                    auto remaining = deadline - clock_->now();
+                    if (remaining.count() <= 0)
+                        break;
+                    observed = parker_.prepare();
+                    lock.unlock();
+                    parker_.wait(observed, remaining, 0);
+                    lock.lock();
+                }
+            }
+
+            std::vector<BarkCompactNotification> compact_batch;
+            std::vector<BarkNotification> batch;
+            size_t count = takeBatchLocked(compact_batch, batch);
+            if (live_ > 0)
+                parker_.notify();
+            processBatch(lock, compact_batch, batch, count, sender);
+        }
+    }
+
+public:
+    BarkDispatcher(const std::string &server = DEFAULT_BARK_SERVER,
+                   const BarkDispatcherOptions &options = BarkDispatcherOptions())
+        : server_(server), options_(options),
+          clock_(options.clock ? options.clock : BarkSteadyClock::instance()), head_seq_(0), live_(0),
+          queued_bytes_(0), in_flight_(0), stopping_(false), tokens_(options.burst), last_refill_(clock_->now())
+    {
+        BarkInternTable::deviceKeys();
+        BarkInternTable::paramNames();
+        if (options_.max_batch_size == 0)
+            options_.max_batch_size = 1;
+        if (options_.manual_pump)
+            return;
+        size_t worker_count = options_.worker_count > 0 ? options_.worker_count : 1;
+        for (size_t i = 0; i < worker_count; ++i)
+        {
+            workers_.emplace_back(&BarkDispatcher::workerLoop, this);
+        }
+    }
+
+    ~BarkDispatcher()
+    {
+        stop();
+    }
+
+    bool enqueue(const BarkNotification &notification)
+    {
+        if (notification.device_keys.empty())
+            return false;
+
+        BarkCompactNotification compact = encode(notification);
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_ || queueFullLocked())
+            {
+                ++stats_.rejected;
+                BarkMetrics::instance().add(BarkMetrics::REJECTED);
+                return false;
+            }
+            pushLocked(std::move(compact));
+            ++stats_.enqueued;
+            BarkMetrics::instance().add(BarkMetrics::ENQUEUED);
+            wake = live_ == 1 || live_ == options_.max_batch_size;
+        }
+        if (wake)
+            parker_.notify();
+        return true;
+    }
+
+    // Encodes the batch before taking the queue lock, then takes it once for
+    // the whole batch. Returns how many were accepted; the rest count as
+    // rejected.
+    size_t enqueueBatch(std::vector<BarkNotification> &&notifications)
+    {
+        std::vector<BarkCompactNotification> encoded;
+        encoded.reserve(notifications.size());
+        for (const BarkNotification &notification : notifications)
+        {
+            if (!notification.device_keys.empty())
+                encoded.push_back(encode(notification));
+        }
+
+        size_t accepted = 0;
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t before = live_;
+            for (BarkCompactNotification &compact : encoded)
+            {
+                if (stopping_ || queueFullLocked())
+                    continue;
+                pushLocked(std::move(compact));
+                ++accepted;
+            }
+            stats_.enqueued += accepted;
+            stats_.rejected += encoded.size() - accepted;
+            BarkMetrics::instance().add(BarkMetrics::ENQUEUED, accepted);
+            BarkMetrics::instance().add(BarkMetrics::REJECTED, encoded.size() - accepted);
+            wake = accepted > 0 && (before == 0 || (before < options_.max_batch_size &&
+                                                    live_ >= options_.max_batch_size));
+        }
+        notifications.clear();
+        if (wake)
+            parker_.notify(true);
+        return accepted;
+    }
+
+    size_t pump()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (live_ == 0)
+            return 0;
+        if (!pump_sender_)
+        {
+            pump_sender_.reset(new BarkPush(BARK_SHARED_ENGINE, {}, server_));
+            pump_sender_->setProxy(options_.proxy);
+            pump_sender_->setTracer(options_.tracer);
+            pump_sender_->setHttpVersion(options_.http_version);
+            pump_sender_->enableEarlyData(options_.early_data);
+        }
+
+        std::vector<BarkCompactNotification> compact_batch;
+        std::vector<BarkNotification> batch;
+        size_t queued = live_;
+        size_t count = takeBatchLocked(compact_batch, batch);
+        size_t consumed = queued - live_;
+        processBatch(lock, compact_batch, batch, count, *pump_sender_);
+        return consumed;
+    }
+
+    void flush()
+    {
+        if (options_.manual_pump)
+        {
+            while (pump() > 0)
+            {
+            }
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_cv_.wait(lock, [this]() { return live_ == 0 && in_flight_ == 0; });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        parker_.notify(true);
+        for (std::thread &worker : workers_)
+        {
+            if (worker.joinable())
+                worker.join();
+        }
+        workers_.clear();
+    }
+
+    size_t takePending(std::vector<BarkNotification> &notifications)
+    {
+        std::vector<BarkCompactNotification> compact_batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            compact_batch.reserve(live_);
+            int64_t now_ns = expiry_buckets_.empty() ? 0 : nowNanos();
+            while (live_ > 0)
+            {
+                BarkCompactNotification compact = popLocked();
+                if (compact.expired(now_ns))
+                    countExpiredLocked(compact.level());
+                else
+                    compact_batch.push_back(std::move(compact));
+            }
+            if (in_flight_ == 0)
+                idle_cv_.notify_all();
+        }
+
+        size_t first = notifications.size();
+        notifications.resize(first + compact_batch.size());
+        for (size_t i = 0; i < compact_batch.size(); ++i)
+            compact_batch[i].decode(notifications[first + i]);
+        return compact_batch.size();
+    }
+
+    size_t pendingCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return live_ + in_flight_;
+    }
+
+    size_t queuedBytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queued_bytes_;
+    }
+
+    // Queued notifications plus the process-wide intern tables they point
+    // into.
+    size_t residentBytes()
+    {
+        size_t tables = BarkInternTable::deviceKeys().residentBytes() + BarkInternTable::paramNames().residentBytes();
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queued_bytes_ + tables;
+    }
+
+    BarkDispatcherStats getStats()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        BarkDispatcherStats stats = stats_;
+        stats.wake_syscalls = parker_.wakeSyscalls();
+        return stats;
+    }
+
+    std::string getLastError()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_error_;
+    }
+};
+
+struct BarkSimulatedResponse
+{
+    BarkError error = BarkError::SUCCESS;
+    std::chrono::nanoseconds latency{0};
+};
+
+using BarkSimulatedServer =
+    std::function<BarkSimulatedResponse(const BarkNotification &, std::chrono::nanoseconds)>;
+
+class BarkScriptedTransport : public BarkTransport
+{
+private:
+    std::shared_ptr<BarkVirtualClock> clock_;
+    BarkSimulatedServer server_;
+    BarkClock::time_point start_;
+
+public:
+    BarkScriptedTransport(std::shared_ptr<BarkVirtualClock> clock, BarkSimulatedServer server)
+        : clock_(std::move(clock)), server_(std::move(server)), start_(clock_->now())
+    {
     }
 
-    BarkError sendCopy(const std::string &title, const std::string &message)
+    BarkError send(const BarkNotification &notification, std::string &error) override
     {
-        return sendAdvanced(title, message, "", "", "", "", "", "1", "1");
+        BarkSimulatedResponse response = server_(notification, clock_->now() - start_);
+        clock_->sleepFor(response.latency);
+        if (response.error != BarkError::SUCCESS)
+            error = barkErrorToString(response.error);
+        return response.error;
     }
+};
 
-    BarkError sendUrl(const std::string &url)
+struct BarkSimulationReport
+{
+    uint64_t offered = 0;
+    uint64_t rejected = 0;
+    uint64_t suppressed = 0;
+    uint64_t coalesced = 0;
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t expired = 0;
+    std::chrono::nanoseconds simulated_time{0};
+    double throughput = 0.0;
+    std::chrono::nanoseconds latency_p50{0};
+    std::chrono::nanoseconds latency_p99{0};
+    std::chrono::nanoseconds latency_max{0};
+};
+
+class BarkSimulation
+{
+private:
+    struct Arrival
     {
-        std::string normalizedUrl = normalizeUrl(url);
-        return sendAdvanced("跳转链接", normalizedUrl, normalizedUrl, 
-                           "", "", "", "", "1", "0");
+        std::chrono::nanoseconds offset;
+        BarkNotification notification;
+    };
+
+    std::shared_ptr<BarkVirtualClock> clock_;
+    std::vector<Arrival> arrivals_;
+
+    static std::chrono::nanoseconds percentile(std::vector<std::chrono::nanoseconds> &values,
+                                               double fraction)
+    {
+        if (values.empty())
+            return std::chrono::nanoseconds(0);
+        size_t index = std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
     }
 
-    BarkError sendUrl(const std::string &title, const std::string &message, const std::string &url)
+public:
+    BarkSimulation() : clock_(std::make_shared<BarkVirtualClock>()) {}
+
+    std::shared_ptr<BarkVirtualClock> clock() const
     {
-        return sendAdvanced(title, message, normalizeUrl(url), 
-                           "", "", "", "", "1", "0");
+        return clock_;
     }
 
-    BarkError sendCritical(const std::string &title, const std::string &message)
+    void schedule(std::chrono::nanoseconds offset, BarkNotification notification)
     {
-        return sendAdvanced(title, message, "", "", "", "critical", "", "1", "0");
+        arrivals_.push_back({offset, std::move(notification)});
     }
 
-    BarkError sendCall(const std::string &title, const std::string &message)
+    void clear()
     {
-        std::map<std::string, std::string> params;
-        params["call"] = "1";
-        params["archive"] = "1";
-        return send(title, message, params);
+        arrivals_.clear();
     }
 
-    BarkError sendSilence(const std::string &title, const std::string &message)
+    BarkSimulationReport run(BarkDispatcherOptions options, BarkSimulatedServer server)
     {
-        return sendAdvanced(title, message, "", "silence", "", "", "", "1", "0");
+        std::stable_sort(arrivals_.begin(), arrivals_.end(), [](const Arrival &a, const Arrival &b)
+        {
+            return a.offset < b.offset;
+        });
+
+        auto transport = std::make_shared<BarkScriptedTransport>(clock_, std::move(server));
+        options.clock = clock_;
+        options.transport = transport;
+        options.manual_pump = true;
+        size_t max_batch_size = std::max<size_t>(options.max_batch_size, 1);
+        BarkDispatcher dispatcher("", options);
+
+        BarkClock::time_point start = clock_->now();
+        BarkClock::time_point window_end = start;
+        std::deque<BarkClock::time_point> pending;
+        std::vector<std::chrono::nanoseconds> latencies;
+        latencies.reserve(arrivals_.size());
+        size_t next = 0;
+        while (next < arrivals_.size() || !pending.empty())
+        {
+            while (next < arrivals_.size() && start + arrivals_[next].offset <= clock_->now())
+            {
+                bool was_empty = pending.empty();
+                if (dispatcher.enqueue(arrivals_[next].notification))
+                {
+                    pending.push_back(start + arrivals_[next].offset);
+                    if (was_empty)
+                        window_end = clock_->now() + options.coalesce_window;
+                }
+                ++next;
+            }
+
+            BarkClock::time_point next_arrival = next < arrivals_.size()
+                ? start + arrivals_[next].offset : BarkClock::time_point::max();
+            if (pending.empty())
+            {
+                if (next < arrivals_.size())
+                    clock_->advanceTo(next_arrival);
+                continue;
+            }
+            if (pending.size() < max_batch_size && clock_->now() < window_end)
+            {
+                clock_->advanceTo(std::min(window_end, next_arrival));
+                continue;
+            }
+
+            uint64_t expired_before = dispatcher.getStats().expired;
+            size_t count = dispatcher.pump();
+            uint64_t expired = dispatcher.getStats().expired - expired_before;
+            BarkClock::time_point now = clock_->now();
+            for (size_t i = 0; i < count && !pending.empty(); ++i)
+            {
+                if (expired > 0)
+                    --expired;
+                else
+                    latencies.push_back(now - pending.front());
+                pending.pop_front();
+            }
+            window_end = now + options.coalesce_window;
+        }
+
+        BarkDispatcherStats stats = dispatcher.getStats();
+        BarkSimulationReport report;
+        report.offered = arrivals_.size();
+        report.rejected = stats.rejected;
+        report.suppressed = stats.suppressed;
+        report.coalesced = stats.coalesced;
+        report.requests = stats.requests;
+        report.failures = stats.failures;
+        report.expired = stats.expired;
+        report.simulated_time = clock_->now() - start;
+        double seconds = std::chrono::duration<double>(report.simulated_time).count();
+        if (seconds > 0.0)
+            report.throughput = static_cast<double>(stats.enqueued - stats.suppressed - stats.expired) / seconds;
+        report.latency_p50 = percentile(latencies, 0.50);
+        report.latency_p99 = percentile(latencies, 0.99);
+        for (std::chrono::nanoseconds latency : latencies)
+            report.latency_max = std::max(report.latency_max, latency);
+        return report;
     }
+};
+
+#ifdef BARK_PUSH_USE_OPENSSL
+
+const std::string APNS_PRODUCTION_SERVER = "https://api.push.apple.com";
+const std::string APNS_DEVELOPMENT_SERVER = "https://api.sandbox.push.apple.com";
 
+struct BarkApnsResult
+{
+    BarkError error;
+    long http_status;
+    std::string reason;
+};
+
+class BarkApnsPush
+{
 private:
-    void init()
+    std::string team_id_;
+    std::string key_id_;
+    std::string topic_;
+    std::string server_;
+    EVP_PKEY *signing_key_;
+    CURLM *multi_handle_;
+    std::vector<CURL *> idle_handles_;
+    std::string cached_token_;
+    std::chrono::steady_clock::time_point token_issued_at_;
+    std::chrono::seconds token_lifetime_;
+    size_t max_concurrent_streams_;
+    std::string last_error_;
+    long http_status_code_;
+
+    BarkApnsPush(const BarkApnsPush&) = delete;
+    BarkApnsPush& operator=(const BarkApnsPush&) = delete;
+
+    static std::string base64UrlEncode(const unsigned char *data, size_t length)
+    {
+        static const char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        std::string output;
+        output.reserve((length + 2) / 3 * 4);
+        size_t i = 0;
+        for (; i + 2 < length; i += 3)
+        {
+            unsigned int n = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+            output += alphabet[(n >> 18) & 0x3F];
+            output += alphabet[(n >> 12) & 0x3F];
+            output += alphabet[(n >> 6) & 0x3F];
+            output += alphabet[n & 0x3F];
+        }
+        if (i + 1 == length)
+        {
+            unsigned int n = data[i] << 16;
+            output += alphabet[(n >> 18) & 0x3F];
+            output += alphabet[(n >> 12) & 0x3F];
+        }
+        else if (i + 2 == length)
+        {
+            unsigned int n = (data[i] << 16) | (data[i + 1] << 8);
+            output += alphabet[(n >> 18) & 0x3F];
+            output += alphabet[(n >> 12) & 0x3F];
+            output += alphabet[(n >> 6) & 0x3F];
+        }
+        return output;
+    }
+
+    static std::string base64UrlEncode(const std::string &data)
+    {
+        return base64UrlEncode(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    }
+
+    static std::string parseReason(const std::string &response)
+    {
+        const std::string marker = "\"reason\":\"";
+        size_t start = response.find(marker);
+        if (start == std::string::npos)
+            return "";
+        start += marker.size();
+        size_t end = response.find('"', start);
+        if (end == std::string::npos)
+            return "";
+        return response.substr(start, end - start);
+    }
+
+    bool signToken()
+    {
+        long long issued_at = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+        std::string signing_input =
+            base64UrlEncode("{\"alg\":\"ES256\",\"kid\":\"" + BarkPush::escapeJson(key_id_) + "\"}") + "." +
+            base64UrlEncode("{\"iss\":\"" + BarkPush::escapeJson(team_id_) + "\",\"iat\":" +
+                            std::to_string(issued_at) + "}");
+
+        EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+        if (!md_ctx)
+        {
+            last_error_ = "Failed to allocate signing context";
+            return false;
+        }
+
+        size_t der_length = 0;
+        std::vector<unsigned char> der_signature;
+        bool signed_ok =
+            EVP_DigestSignInit(md_ctx, nullptr, EVP_sha256(), nullptr, signing_key_) == 1 &&
+            EVP_DigestSignUpdate(md_ctx, signing_input.data(), signing_input.size()) == 1 &&
+            EVP_DigestSignFinal(md_ctx, nullptr, &der_length) == 1;
+        if (signed_ok)
+        {
+            der_signature.resize(der_length);
+            signed_ok = EVP_DigestSignFinal(md_ctx, der_signature.data(), &der_length) == 1;
+        }
+        EVP_MD_CTX_free(md_ctx);
+        if (!signed_ok)
+        {
+            last_error_ = "Failed to sign APNs provider token";
+            return false;
+        }
+
+        const unsigned char *der_ptr = der_signature.data();
+        ECDSA_SIG *signature = d2i_ECDSA_SIG(nullptr, &der_ptr, static_cast<long>(der_length));
+        if (!signature)
+        {
+            last_error_ = "Failed to decode APNs provider token signature";
+            return false;
+        }
+
+        unsigned char raw_signature[64];
+        const BIGNUM *r = nullptr;
+        const BIGNUM *s = nullptr;
+        ECDSA_SIG_get0(signature, &r, &s);
+        bool encoded = BN_bn2binpad(r, raw_signature, 32) == 32 && BN_bn2binpad(s, raw_signature + 32, 32) == 32;
+        ECDSA_SIG_free(signature);
+        if (!encoded)
+        {
+            last_error_ = "APNs provider token signature does not fit ES256";
+            return false;
+        }
+
+        cached_token_ = signing_input + "." + base64UrlEncode(raw_signature, sizeof(raw_signature));
+        token_issued_at_ = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    static bool isP256Key(EVP_PKEY *key)
+    {
+        if (EVP_PKEY_base_id(key) != EVP_PKEY_EC)
+            return false;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        char group[64] = {0};
+        size_t length = 0;
+        if (EVP_PKEY_get_utf8_string_param(key, OSSL_PKEY_PARAM_GROUP_NAME, group, sizeof(group), &length) != 1)
+            return false;
+        return OBJ_txt2nid(group) == NID_X9_62_prime256v1;
+#else
+        const EC_KEY *ec_key = EVP_PKEY_get0_EC_KEY(key);
+        return ec_key && EC_GROUP_get_curve_name(EC_KEY_get0_group(ec_key)) == NID_X9_62_prime256v1;
+#endif
+    }
+
+    CURL *acquireHandle()
+    {
+        if (!idle_handles_.empty())
+        {
+            CURL *handle = idle_handles_.back();
+            idle_handles_.pop_back();
+            return handle;
+        }
+
+        CURL *handle = curl_easy_init();
+        if (!handle)
+            return nullptr;
+
+        bool cleartext = server_.compare(0, 7, "http://") == 0;
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+                         cleartext ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(handle, CURLOPT_POST, 1L);
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(handle, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(handle, CURLOPT_USERAGENT, "BarkPush-C++/1.0");
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, BarkPush::writeCallback);
+        return handle;
+    }
+
+    void dispatch(const std::vector<std::string> &device_tokens,
+                  const std::vector<size_t> &indices,
+                  const std::string &payload,
+                  const std::string &collapse_id,
+                  std::vector<BarkApnsResult> &results)
+    {
+        std::string authorization = "authorization: bearer " + cached_token_;
+        std::string topic = "apns-topic: " + topic_;
+        struct curl_slist *headers = nullptr;
+        headers = curl_slist_append(headers, "content-type: application/json");
+        headers = curl_slist_append(headers, authorization.c_str());
+        headers = curl_slist_append(headers, topic.c_str());
+        headers = curl_slist_append(headers, "apns-push-type: alert");
+        headers = curl_slist_append(headers, "apns-priority: 10");
+        std::string collapse_header = "apns-collapse-id: " + collapse_id;
+        if (!collapse_id.empty())
+            headers = curl_slist_append(headers, collapse_header.c_str());
+
+        std::string base_url = server_;
+        if (base_url.back() == '/')
+            base_url.pop_back();
+        base_url += "/3/device/";
+
+        std::vector<std::string> urls(indices.size());
+        std::vector<std::string> responses(indices.size());
+        size_t next = 0;
+        size_t active = 0;
+
+        while (next < indices.size() || active > 0)
+        {
+            while (next < indices.size() && active < max_concurrent_streams_)
+            {
+                size_t slot = next++;
+                BarkApnsResult &result = results[indices[slot]];
+                CURL *handle = acquireHandle();
+                if (!handle)
+                {
+                    result = {BarkError::CURL_INIT_FAILED, 0, "cURL initialization failed"};
+                    continue;
+                }
+
+                urls[slot] = base_url + device_tokens[indices[slot]];
+                curl_easy_setopt(handle, CURLOPT_URL, urls[slot].c_str());
+                curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+                curl_easy_setopt(handle, CURLOPT_POSTFIELDS, payload.c_str());
+                curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, static_cast<long>(payload.size()));
+                curl_easy_setopt(handle, CURLOPT_WRITEDATA, &responses[slot]);
+                curl_easy_setopt(handle, CURLOPT_PRIVATE, reinterpret_cast<void *>(slot));
+                curl_multi_add_handle(multi_handle_, handle);
+                ++active;
+            }
+
+            int still_running = 0;
+            curl_multi_perform(multi_handle_, &still_running);
+
+            int queued = 0;
+            CURLMsg *message = nullptr;
+            while ((message = curl_multi_info_read(multi_handle_, &queued)))
+            {
+                if (message->msg != CURLMSG_DONE)
+                    continue;
+
+                CURL *handle = message->easy_handle;
+                void *slot_ptr = nullptr;
+                curl_easy_getinfo(handle, CURLINFO_PRIVATE, &slot_ptr);
+                size_t slot = reinterpret_cast<size_t>(slot_ptr);
+                BarkApnsResult &result = results[indices[slot]];
+
+                if (message->data.result != CURLE_OK)
+                {
+                    result = {BarkError::NETWORK_ERROR, 0,
+                              "cURL error: " + std::string(curl_easy_strerror(message->data.result))};
+                }
+                else
+                {
+                    long status = 0;
+                    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+                    if (status == 200)
+                        result = {BarkError::SUCCESS, status, ""};
+                    else
+                        result = {BarkError::HTTP_ERROR, status, parseReason(responses[slot])};
+                }
+
+                curl_multi_remove_handle(multi_handle_, handle);
+                idle_handles_.push_back(handle);
+                --active;
+            }
+
+            if (active > 0)
+                curl_multi_wait(multi_handle_, nullptr, 0, 1000, nullptr);
+        }
+
+        curl_slist_free_all(headers);
+    }
+
+public:
+    BarkApnsPush(const std::string &team_id,
+                 const std::string &key_id,
+                 const std::string &private_key_pem,
+                 const std::string &topic,
+                 const std::string &server = APNS_PRODUCTION_SERVER)
+        : team_id_(team_id), key_id_(key_id), topic_(topic), server_(server),
+          signing_key_(nullptr), multi_handle_(nullptr), token_lifetime_(std::chrono::minutes(50)),
+          max_concurrent_streams_(1000), http_status_code_(0)
     {
-        if (!initCurlGlobal())
+        if (!barkInitCurlGlobal())
         {
             throw std::runtime_error("Failed to initialize cURL globally");
         }
-        
-        CURL* temp_handle = curl_easy_init();
-        if (!temp_handle)
+
+        BIO *bio = BIO_new_mem_buf(private_key_pem.data(), static_cast<int>(private_key_pem.size()));
+        if (bio)
         {
-            throw std::runtime_error("cURL initialization failed");
+            signing_key_ = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+            BIO_free(bio);
         }
-        
-        curl_handle_ = temp_handle;
-        setDefaultOptions();
+        if (!signing_key_ || !isP256Key(signing_key_))
+        {
+            EVP_PKEY_free(signing_key_);
+            throw std::runtime_error("Invalid APNs signing key, expected an EC P-256 PEM key");
+        }
+
+        multi_handle_ = curl_multi_init();
+        if (!multi_handle_)
+        {
+            EVP_PKEY_free(signing_key_);
+            throw std::runtime_error("cURL multi initialization failed");
+        }
+        curl_multi_setopt(multi_handle_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(multi_handle_, CURLMOPT_MAX_HOST_CONNECTIONS, 2L);
+    }
+
+    ~BarkApnsPush()
+    {
+        for (CURL *handle : idle_handles_)
+        {
+            curl_easy_cleanup(handle);
+        }
+        if (multi_handle_)
+        {
+            curl_multi_cleanup(multi_handle_);
+            multi_handle_ = nullptr;
+        }
+        EVP_PKEY_free(signing_key_);
+        signing_key_ = nullptr;
+    }
+
+    void setMaxConcurrentStreams(size_t streams)
+    {
+        max_concurrent_streams_ = streams > 0 ? streams : 1;
+    }
+
+    void setMaxConnections(long connections)
+    {
+        curl_multi_setopt(multi_handle_, CURLMOPT_MAX_HOST_CONNECTIONS, connections > 0 ? connections : 1L);
+    }
+
+    void setTokenLifetime(std::chrono::seconds lifetime)
+    {
+        token_lifetime_ = lifetime;
+        cached_token_.clear();
+    }
+
+    std::string getLastError() const
+    {
+        return last_error_;
+    }
+
+    long getLastHttpStatusCode() const
+    {
+        return http_status_code_;
+    }
+
+    const std::string &providerToken()
+    {
+        if (cached_token_.empty() ||
+            std::chrono::steady_clock::now() - token_issued_at_ >= token_lifetime_)
+        {
+            if (!signToken())
+                cached_token_.clear();
+        }
+        return cached_token_;
+    }
+
+    static std::string buildApnsPayload(const std::string &title,
+                                        const std::string &message,
+                                        const std::map<std::string, std::string> &params = {})
+    {
+        std::ostringstream json_stream;
+        json_stream << "{\"aps\":{\"alert\":{";
+        json_stream << "\"title\":\"" << BarkPush::escapeJson(title) << "\",";
+        json_stream << "\"body\":\"" << BarkPush::escapeJson(message) << "\"";
+        auto subtitle_it = params.find("subtitle");
+        if (subtitle_it != params.end())
+            json_stream << ",\"subtitle\":\"" << BarkPush::escapeJson(subtitle_it->second) << "\"";
+        json_stream << "}";
+
+        auto badge_it = params.find("badge");
+        if (badge_it != params.end() && !badge_it->second.empty() &&
+            badge_it->second.find_first_not_of("0123456789") == std::string::npos)
+        {
+            json_stream << ",\"badge\":" << badge_it->second;
+        }
+
+        auto sound_it = params.find("sound");
+        if (sound_it != params.end() && !sound_it->second.empty())
+        {
+            std::string sound = sound_it->second;
+            if (sound.size() < 4 || sound.compare(sound.size() - 4, 4, ".caf") != 0)
+                sound += ".caf";
+            json_stream << ",\"sound\":\"" << BarkPush::escapeJson(sound) << "\"";
+        }
+
+        auto group_it = params.find("group");
+        if (group_it != params.end() && !group_it->second.empty())
+            json_stream << ",\"thread-id\":\"" << BarkPush::escapeJson(group_it->second) << "\"";
+
+        auto level_it = params.find("level");
+        if (level_it != params.end() && !level_it->second.empty())
+        {
+            std::string level = level_it->second == "timeSensitive" ? "time-sensitive" : level_it->second;
+            json_stream << ",\"interruption-level\":\"" << BarkPush::escapeJson(level) << "\"";
+        }
+
+        json_stream << ",\"category\":\"myNotificationCategory\",\"mutable-content\":1}";
+
+        for (const auto &[key, value] : params)
+        {
+            if (key == "subtitle" || key == "badge" || key == "sound" || key == "group" || key == "level")
+                continue;
+
+            std::string lower_key = key;
+            for (char &c : lower_key)
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            const std::string &field = key == "url" ? BarkPush::normalizeUrl(value) : value;
+            json_stream << ",\"" << BarkPush::escapeJson(lower_key) << "\":\""
+                        << BarkPush::escapeJson(field) << "\"";
+        }
+        json_stream << "}";
+
+        return json_stream.str();
+    }
+
+    std::vector<BarkApnsResult> sendMany(const std::vector<std::string> &device_tokens,
+                                         const std::string &title,
+                                         const std::string &message,
+                                         const std::map<std::string, std::string> &params = {})
+    {
+        last_error_.clear();
+        std::vector<BarkApnsResult> results(device_tokens.size(), {BarkError::SUCCESS, 0, ""});
+        if (device_tokens.empty())
+            return results;
+
+        if (providerToken().empty())
+        {
+            for (BarkApnsResult &result : results)
+                result = {BarkError::CURL_INIT_FAILED, 0, last_error_};
+            return results;
+        }
+
+        std::string payload = buildApnsPayload(title, message, params);
+        auto id_it = params.find("id");
+        std::string collapse_id = id_it != params.end() ? id_it->second : "";
+
+        std::vector<size_t> indices(device_tokens.size());
+        for (size_t i = 0; i < indices.size(); ++i)
+            indices[i] = i;
+        dispatch(device_tokens, indices, payload, collapse_id, results);
+
+        std::vector<size_t> expired;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            if (results[i].http_status == 403 && results[i].reason == "ExpiredProviderToken")
+                expired.push_back(i);
+        }
+        if (!expired.empty() && signToken())
+            dispatch(device_tokens, expired, payload, collapse_id, results);
+
+        return results;
+    }
+
+    BarkError send(const std::string &device_token,
+                   const std::string &title,
+                   const std::string &message,
+                   const std::map<std::string, std::string> &params = {})
+    {
+        http_status_code_ = 0;
+        if (device_token.empty())
+        {
+            last_error_ = "No device keys specified";
+            return BarkError::NO_DEVICES_SPECIFIED;
+        }
+
+        BarkApnsResult result = sendMany({device_token}, title, message, params).front();
+        http_status_code_ = result.http_status;
+        if (result.error == BarkError::HTTP_ERROR)
+            last_error_ = "HTTP error " + std::to_string(result.http_status) + ", Reason: " + result.reason;
+        else if (result.error != BarkError::SUCCESS)
+            last_error_ = result.reason;
+        return result.error;
     }
 };
 
 #endif
+
+#endif
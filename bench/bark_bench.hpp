@@ -0,0 +1,230 @@
+// Benchmark harness shared by the programs in this directory.
+//
+// Each benchmark is calibrated to run for at least BARK_BENCH_MS milliseconds
+// (default 300) and reported per notification: wall time, task clock, and on
+// Linux the cycles, instructions, branch misses and cache misses counted with
+// perf_event_open. Counters the kernel or VM does not expose print as n/a.
+// Hardware counters need kernel.perf_event_paranoid <= 2; only user space is
+// counted.
+
+#ifndef BARK_BENCH_HPP
+#define BARK_BENCH_HPP
+
+#include "bark_push.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class BarkPerfCounters
+{
+public:
+    enum Event
+    {
+        TASK_CLOCK,
+        CYCLES,
+        INSTRUCTIONS,
+        BRANCH_MISSES,
+        CACHE_MISSES,
+        kEvents
+    };
+
+    struct Sample
+    {
+        bool valid[kEvents] = {};
+        double value[kEvents] = {};
+    };
+
+private:
+    int fds_[kEvents];
+
+    BarkPerfCounters(const BarkPerfCounters&) = delete;
+    BarkPerfCounters& operator=(const BarkPerfCounters&) = delete;
+
+#ifdef __linux__
+    static int openEvent(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+#endif
+
+public:
+    BarkPerfCounters()
+    {
+        for (int &fd : fds_)
+            fd = -1;
+#ifdef __linux__
+        fds_[TASK_CLOCK] = openEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+        fds_[CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds_[INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds_[BRANCH_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds_[CACHE_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    ~BarkPerfCounters()
+    {
+#ifdef __linux__
+        for (int fd : fds_)
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+#endif
+    }
+
+    bool hardwareAvailable() const
+    {
+        return fds_[CYCLES] >= 0 || fds_[INSTRUCTIONS] >= 0;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int fd : fds_)
+        {
+            if (fd < 0)
+                continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Values are scaled up when the kernel multiplexed an event.
+    Sample stop()
+    {
+        Sample sample;
+#ifdef __linux__
+        for (int fd : fds_)
+        {
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (int i = 0; i < kEvents; ++i)
+        {
+            uint64_t values[3] = {0, 0, 0};
+            if (fds_[i] < 0 || read(fds_[i], values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) ||
+                values[2] == 0)
+                continue;
+            sample.valid[i] = true;
+            sample.value[i] = static_cast<double>(values[0]) * values[1] / values[2];
+        }
+#endif
+        return sample;
+    }
+};
+
+struct BarkBenchResult
+{
+    std::string name;
+    uint64_t items = 0;
+    double wall_ns = 0.0;
+    BarkPerfCounters::Sample counters;
+
+    double perItem(BarkPerfCounters::Event event) const
+    {
+        return items > 0 ? counters.value[event] / items : 0.0;
+    }
+};
+
+class BarkBench
+{
+private:
+    BarkPerfCounters counters_;
+    std::chrono::nanoseconds min_time_;
+    std::vector<BarkBenchResult> results_;
+
+    static void printCounter(const BarkBenchResult &result, BarkPerfCounters::Event event)
+    {
+        if (result.counters.valid[event])
+            std::printf(" %10.1f", result.perItem(event));
+        else
+            std::printf(" %10s", "n/a");
+    }
+
+public:
+    BarkBench() : min_time_(std::chrono::milliseconds(300))
+    {
+        const char *ms = std::getenv("BARK_BENCH_MS");
+        if (ms && std::atol(ms) > 0)
+            min_time_ = std::chrono::milliseconds(std::atol(ms));
+        if (!counters_.hardwareAvailable())
+            std::printf("# hardware counters unavailable, reporting time and task clock only\n");
+        std::printf("%-40s %10s %10s %10s %10s %6s %10s %10s\n", "benchmark (per notification)", "ns",
+                    "task-ns", "cycles", "instr", "IPC", "br-miss", "cache-miss");
+    }
+
+    // body(iterations) runs the measured work and returns how many
+    // notifications it handled. Iterations double until min_time is reached.
+    template <typename Body>
+    const BarkBenchResult &run(const std::string &name, Body body)
+    {
+        body(1);
+        size_t iterations = 1;
+        BarkBenchResult result;
+        result.name = name;
+        while (true)
+        {
+            counters_.start();
+            auto started = std::chrono::steady_clock::now();
+            uint64_t items = body(iterations);
+            auto elapsed = std::chrono::steady_clock::now() - started;
+            BarkPerfCounters::Sample sample = counters_.stop();
+            if (elapsed >= min_time_ || iterations >= (size_t(1) << 40))
+            {
+                result.items = items;
+                result.wall_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+                result.counters = sample;
+                break;
+            }
+            iterations *= 2;
+        }
+
+        std::printf("%-40s %10.1f", result.name.c_str(), result.items > 0 ? result.wall_ns / result.items : 0.0);
+        printCounter(result, BarkPerfCounters::TASK_CLOCK);
+        printCounter(result, BarkPerfCounters::CYCLES);
+        printCounter(result, BarkPerfCounters::INSTRUCTIONS);
+        if (result.counters.valid[BarkPerfCounters::CYCLES] && result.counters.valid[BarkPerfCounters::INSTRUCTIONS] &&
+            result.counters.value[BarkPerfCounters::CYCLES] > 0.0)
+            std::printf(" %6.2f", result.counters.value[BarkPerfCounters::INSTRUCTIONS] /
+                                      result.counters.value[BarkPerfCounters::CYCLES]);
+        else
+            std::printf(" %6s", "n/a");
+        printCounter(result, BarkPerfCounters::BRANCH_MISSES);
+        printCounter(result, BarkPerfCounters::CACHE_MISSES);
+        std::printf("\n");
+        std::fflush(stdout);
+
+        results_.push_back(std::move(result));
+        return results_.back();
+    }
+
+    const std::vector<BarkBenchResult> &results() const
+    {
+        return results_;
+    }
+};
+
+template <typename T>
+inline void barkBenchKeep(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#endif
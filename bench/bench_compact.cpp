@@ -0,0 +1,118 @@
+// Compact in-queue encoding: encode/decode cost and resident bytes per
+// pending notification.
+//
+//   g++ -std=c++17 -O2 -I.. bench_compact.cpp -o bench_compact -lcurl -pthread
+//   ./bench_compact [pending]
+//
+// Heap growth is read from glibc's mallinfo2() and is skipped elsewhere.
+
+#include "bark_bench.hpp"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define BARK_BENCH_HAVE_MALLINFO2 1
+#endif
+
+static long long heapInUse()
+{
+#ifdef BARK_BENCH_HAVE_MALLINFO2
+    return static_cast<long long>(mallinfo2().uordblks);
+#else
+    return -1;
+#endif
+}
+
+static BarkNotification sampleNotification(size_t index)
+{
+    BarkNotification notification;
+    notification.device_keys = {"dEvIcEkEy" + std::to_string(index % 512)};
+    notification.title = "CPU on web-" + std::to_string(index % 40);
+    notification.body = "Load average 12.4 over the last 5 minutes, threshold 8";
+    notification.params = {{"group", "compute"}, {"level", "timeSensitive"}, {"sound", "alarm"}};
+    return notification;
+}
+
+int main(int argc, char **argv)
+{
+    size_t pending = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    const size_t batch = 1024;
+    std::vector<BarkNotification> notifications;
+    size_t payload_bytes = 0;
+    for (size_t i = 0; i < batch; ++i)
+    {
+        notifications.push_back(sampleNotification(i));
+        const BarkNotification &n = notifications.back();
+        payload_bytes += BarkPush::buildPayload(n.device_keys, n.title, n.body, n.params).size();
+    }
+
+    BarkBench bench;
+
+    bench.run("compact encode", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+            barkBenchKeep(BarkCompactNotification::encode(notifications[i % batch]).size());
+        return iterations;
+    });
+
+    std::vector<BarkCompactNotification> encoded;
+    for (const BarkNotification &n : notifications)
+        encoded.push_back(BarkCompactNotification::encode(n));
+    BarkNotification decoded;
+    bench.run("compact decode into reused notification", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            encoded[i % batch].decode(decoded);
+            barkBenchKeep(decoded.body);
+        }
+        return iterations;
+    });
+
+    bench.run("portable serialize + deserialize", [&](size_t iterations)
+    {
+        std::string wire;
+        BarkClock::time_point now = BarkSteadyClock::instance()->now();
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            wire.clear();
+            BarkCompactNotification::serialize(notifications[i % batch], now, wire);
+            const uint8_t *in = reinterpret_cast<const uint8_t *>(wire.data());
+            BarkCompactNotification::deserialize(in, in + wire.size(), now, decoded);
+            barkBenchKeep(decoded.body);
+        }
+        return iterations;
+    });
+
+    std::printf("\nresident bytes per pending notification (%zu pending)\n", pending);
+    std::printf("  JSON payload                      %8.1f\n", static_cast<double>(payload_bytes) / batch);
+
+    long long before = heapInUse();
+    {
+        std::vector<BarkNotification> plain;
+        plain.reserve(pending);
+        long long reserved = heapInUse();
+        for (size_t i = 0; i < pending; ++i)
+            plain.push_back(notifications[i % batch]);
+        if (before >= 0)
+            std::printf("  std::vector<BarkNotification>     %8.1f heap + %zu inline\n",
+                        static_cast<double>(heapInUse() - reserved) / pending, sizeof(BarkNotification));
+    }
+
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    options.max_queue_size = pending;
+    BarkDispatcher dispatcher("http://127.0.0.1:9/", options);
+    before = heapInUse();
+    for (size_t i = 0; i < pending; ++i)
+        dispatcher.enqueue(notifications[i % batch]);
+    std::printf("  dispatcher queue (own accounting) %8.1f\n",
+                static_cast<double>(dispatcher.queuedBytes()) / pending);
+    std::printf("  with intern tables                %8.1f\n",
+                static_cast<double>(dispatcher.residentBytes()) / pending);
+    if (before >= 0)
+        std::printf("  dispatcher queue (heap growth)    %8.1f\n",
+                    static_cast<double>(heapInUse() - before) / pending);
+    std::printf("  interned keys %zu, param names %zu\n", BarkInternTable::deviceKeys().size(),
+                BarkInternTable::paramNames().size());
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Payload building and queue operation benchmarks.
+//
+//   g++ -std=c++17 -O2 -I.. bench_payload.cpp -o bench_payload -lcurl -pthread
+//   ./bench_payload
+//
+// See bark_bench.hpp for the counters and BARK_BENCH_MS.
+
+#include "bark_bench.hpp"
+
+static BarkNotification sampleNotification(size_t index, size_t key_count)
+{
+    BarkNotification notification;
+    for (size_t k = 0; k < key_count; ++k)
+        notification.device_keys.push_back("dEvIcEkEy" + std::to_string(index % 97) + "x" + std::to_string(k));
+    notification.title = "Disk usage on db-" + std::to_string(index % 13);
+    notification.body = "Volume /var/lib/postgres is at 91% (threshold 90%), growing 2.1 GB/h";
+    notification.params = {{"group", "storage"}, {"level", "timeSensitive"}, {"badge", "3"},
+                           {"url", "grafana.example.com/d/disk"}};
+    return notification;
+}
+
+int main()
+{
+    const std::string plain = "Volume /var/lib/postgres is at 91% (threshold 90%), growing 2.1 GB/h";
+    const std::string escaped = "line \"one\"\n\tline \\two\\\r\n\x01 end \"quoted\" \x1f";
+    const size_t batch = 1024;
+    std::vector<BarkNotification> notifications;
+    for (size_t i = 0; i < batch; ++i)
+        notifications.push_back(sampleNotification(i, 1));
+    std::vector<BarkNotification> fanout;
+    for (size_t i = 0; i < batch; ++i)
+        fanout.push_back(sampleNotification(i, 10));
+
+    BarkBench bench;
+
+    bench.run("escapeJson plain 68B", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+            barkBenchKeep(BarkPush::escapeJson(plain));
+        return iterations;
+    });
+
+    bench.run("escapeJson escape-heavy 44B", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+            barkBenchKeep(BarkPush::escapeJson(escaped));
+        return iterations;
+    });
+
+    bench.run("buildPayload 1 key, 4 params", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            const BarkNotification &n = notifications[i % batch];
+            barkBenchKeep(BarkPush::buildPayload(n.device_keys, n.title, n.body, n.params));
+        }
+        return iterations;
+    });
+
+    bench.run("buildPayload 10 keys, 4 params", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            const BarkNotification &n = fanout[i % batch];
+            barkBenchKeep(BarkPush::buildPayload(n.device_keys, n.title, n.body, n.params));
+        }
+        return iterations;
+    });
+
+    bench.run("appendPayloadTail reused buffer", [&](size_t iterations)
+    {
+        std::string buffer;
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            const BarkNotification &n = notifications[i % batch];
+            buffer.clear();
+            BarkPush::appendPayloadTail(buffer, n.title, n.body, n.params);
+            barkBenchKeep(buffer);
+        }
+        return iterations;
+    });
+
+    bench.run("prepare", [&](size_t iterations)
+    {
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            const BarkNotification &n = notifications[i % batch];
+            barkBenchKeep(BarkPush::prepare(n.title, n.body, n.params));
+        }
+        return iterations;
+    });
+
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    options.max_queue_size = batch;
+    BarkDispatcher dispatcher("http://127.0.0.1:9/", options);
+    std::vector<BarkNotification> drained;
+
+    bench.run("dispatcher enqueue + takePending", [&](size_t iterations)
+    {
+        uint64_t items = 0;
+        for (size_t round = 0; round < iterations; ++round)
+        {
+            for (const BarkNotification &n : notifications)
+                dispatcher.enqueue(n);
+            drained.clear();
+            items += dispatcher.takePending(drained);
+        }
+        return items;
+    });
+
+    bench.run("dispatcher enqueueBatch + takePending", [&](size_t iterations)
+    {
+        uint64_t items = 0;
+        for (size_t round = 0; round < iterations; ++round)
+        {
+            std::vector<BarkNotification> copy = notifications;
+            dispatcher.enqueueBatch(std::move(copy));
+            drained.clear();
+            items += dispatcher.takePending(drained);
+        }
+        return items;
+    });
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+// BasicBarkPush policy configurations against hand-written libcurl code and
+// the dynamic BarkPush, over a loopback server and with a null transport.
+//
+//   g++ -std=c++17 -O2 -I.. bench_policy.cpp -o bench_policy -lcurl -pthread
+//   ./bench_policy
+
+#include "bark_bench.hpp"
+#include "bench_server.hpp"
+
+struct NullTransport
+{
+    BarkError post(const std::string &, const std::string &body, long &http_status, std::string &response,
+                   std::string &)
+    {
+        barkBenchKeep(body.size());
+        http_status = 200;
+        response = "{}";
+        return BarkError::SUCCESS;
+    }
+};
+
+static size_t discardResponse(void *contents, size_t size, size_t nmemb, std::string *response)
+{
+    response->append(static_cast<char *>(contents), size * nmemb);
+    return size * nmemb;
+}
+
+int main()
+{
+    BarkBenchServer server;
+    const std::string url = server.url() + "push";
+    const std::vector<std::string> keys = {"dEvIcEkEy"};
+    const std::string title = "Deploy finished";
+    const std::string body = "api-gateway 2024.06.1 rolled out to 12/12 hosts";
+    const std::map<std::string, std::string> params = {{"group", "deploys"}, {"sound", "bell"}};
+
+    BarkBench bench;
+
+    bench.run("hand-written buildPayload only", [&](size_t iterations)
+    {
+        std::string payload;
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            payload = BarkPush::buildPayload(keys, title, body, params);
+            barkBenchKeep(payload.size());
+        }
+        return iterations;
+    });
+
+    bench.run("BasicBarkPush<NullTransport>", [&](size_t iterations)
+    {
+        BasicBarkPush<NullTransport> push(keys, server.url());
+        for (size_t i = 0; i < iterations; ++i)
+            barkBenchKeep(push.send(title, body, params));
+        return iterations;
+    });
+
+    bench.run("BasicBarkPush<Null, retry, limit>", [&](size_t iterations)
+    {
+        BasicBarkPush<NullTransport, BarkExponentialRetry<>, BarkBackendLimit> push(
+            keys, server.url(), NullTransport(), BarkBackendLimit(std::make_shared<BarkLocalLimitBackend>()));
+        for (size_t i = 0; i < iterations; ++i)
+            barkBenchKeep(push.send(title, body, params));
+        return iterations;
+    });
+
+    bench.run("hand-written curl loopback", [&](size_t iterations)
+    {
+        CURL *handle = curl_easy_init();
+        struct curl_slist *headers = curl_slist_append(nullptr, "Content-Type: application/json");
+        std::string response;
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_POST, 1L);
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, discardResponse);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response);
+        size_t ok = 0;
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            std::string payload = BarkPush::buildPayload(keys, title, body, params);
+            response.clear();
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(payload.size()));
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDS, payload.c_str());
+            long status = 0;
+            if (curl_easy_perform(handle) == CURLE_OK &&
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK && status == 200)
+                ++ok;
+        }
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(handle);
+        return ok;
+    });
+
+    bench.run("BasicBarkPush<> loopback", [&](size_t iterations)
+    {
+        BasicBarkPush<> push(keys, server.url());
+        size_t ok = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            ok += push.send(title, body, params) == BarkError::SUCCESS;
+        return ok;
+    });
+
+    bench.run("BarkPush loopback", [&](size_t iterations)
+    {
+        BarkPush push(keys, server.url());
+        size_t ok = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            ok += push.send(title, body, params) == BarkError::SUCCESS;
+        return ok;
+    });
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Sends through a local CONNECT proxy stand-in with private per-instance
+// handles and with the shared engine, which keeps tunnels across senders.
+//
+//   g++ -std=c++17 -O2 -I.. bench_proxy.cpp -o bench_proxy -lcurl -pthread
+//   ./bench_proxy [tunnel setup delay in ms, default 2]
+//
+// Each sender is a fresh BarkPush that sends kSendsPerSender notifications,
+// the pattern of short-lived request handlers.
+
+#include "bark_bench.hpp"
+#include "bench_server.hpp"
+
+static const size_t kSendsPerSender = 4;
+
+int main(int argc, char **argv)
+{
+    long delay_ms = argc > 1 ? std::atol(argv[1]) : 2;
+    BarkBenchServer server;
+    BarkBenchConnectProxy proxy{std::chrono::milliseconds(delay_ms)};
+    BarkProxyOptions options;
+    options.url = proxy.url();
+    const std::vector<std::string> keys = {"dEvIcEkEy"};
+
+    std::printf("# CONNECT setup delay %ld ms\n", delay_ms);
+    BarkBench bench;
+
+    auto run = [&](const char *name, bool shared)
+    {
+        uint64_t tunnels = 0;
+        uint64_t failures = 0;
+        const BarkBenchResult &result = bench.run(name, [&](size_t iterations)
+        {
+            uint64_t tunnels_before = proxy.tunnels();
+            size_t sent = 0;
+            failures = 0;
+            for (size_t i = 0; i < iterations; ++i)
+            {
+                std::unique_ptr<BarkPush> push(shared ? new BarkPush(BARK_SHARED_ENGINE, keys, server.url())
+                                                      : new BarkPush(keys, server.url()));
+                push->setProxy(options);
+                for (size_t s = 0; s < kSendsPerSender; ++s)
+                {
+                    if (push->send("Proxy", "through the egress proxy") == BarkError::SUCCESS)
+                        ++sent;
+                    else
+                        ++failures;
+                }
+            }
+            tunnels = proxy.tunnels() - tunnels_before;
+            return sent;
+        });
+        std::printf("%-40s %10.3f tunnels per notification, %llu failures\n", "",
+                    result.items > 0 ? static_cast<double>(tunnels) / result.items : 0.0,
+                    static_cast<unsigned long long>(failures));
+    };
+
+    run("private handles through proxy", false);
+    run("shared engine through proxy", true);
+    return 0;
+}
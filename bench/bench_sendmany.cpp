@@ -0,0 +1,64 @@
+// sendMany() throughput against sequential send() over loopback, with the
+// server answering immediately and after a fixed latency.
+//
+//   g++ -std=c++17 -O2 -I.. bench_sendmany.cpp -o bench_sendmany -lcurl -pthread
+//   ./bench_sendmany [latency_us]
+
+#include "bark_bench.hpp"
+#include "bench_server.hpp"
+
+static BarkNotification sampleNotification(size_t index)
+{
+    BarkNotification notification;
+    notification.device_keys = {"dEvIcEkEy" + std::to_string(index % 64)};
+    notification.title = "Build #" + std::to_string(index);
+    notification.body = "pipeline main finished in 4m12s, 1,204 tests passed";
+    notification.params = {{"group", "ci"}, {"sound", "bell"}};
+    return notification;
+}
+
+int main(int argc, char **argv)
+{
+    long latency_us = argc > 1 ? std::atol(argv[1]) : 2000;
+    const size_t batch = 256;
+    std::vector<BarkNotification> notifications;
+    for (size_t i = 0; i < batch; ++i)
+        notifications.push_back(sampleNotification(i));
+
+    BarkBench bench;
+    for (long latency : {0L, latency_us})
+    {
+        BarkBenchServer server{std::chrono::microseconds(latency)};
+        const std::string suffix = " (" + std::to_string(latency) + "us)";
+
+        bench.run("send() sequential" + suffix, [&](size_t iterations)
+        {
+            BarkPush push(notifications[0].device_keys, server.url());
+            size_t ok = 0;
+            for (size_t i = 0; i < iterations; ++i)
+            {
+                const BarkNotification &n = notifications[i % batch];
+                ok += push.send(n.title, n.body, n.params) == BarkError::SUCCESS;
+            }
+            return ok;
+        });
+
+        for (size_t in_flight : {size_t(8), size_t(64)})
+        {
+            bench.run("sendMany x" + std::to_string(batch) + ", " + std::to_string(in_flight) + " in flight" + suffix,
+                      [&](size_t iterations)
+            {
+                BarkPush push(std::vector<std::string>(), server.url());
+                size_t ok = 0;
+                for (size_t round = 0; round < iterations; ++round)
+                {
+                    for (BarkError error : push.sendMany(notifications, in_flight))
+                        ok += error == BarkError::SUCCESS;
+                }
+                return ok;
+            });
+        }
+        std::printf("# server saw %llu connections\n", static_cast<unsigned long long>(server.connections()));
+    }
+    return 0;
+}
@@ -0,0 +1,435 @@
+// Loopback stand-ins for the Bark server used by the network benchmarks.
+//
+// BarkBenchServer answers every POST with a Bark success body over HTTP/1.1
+// keep-alive, one thread per connection, after an optional fixed latency.
+// With BARK_PUSH_USE_OPENSSL it can also serve HTTPS with a self-signed
+// P-256 certificate generated at startup.
+// BarkBenchConnectProxy is an HTTP CONNECT proxy that can delay each tunnel
+// setup to stand in for a remote egress proxy.
+
+#ifndef BARK_BENCH_SERVER_HPP
+#define BARK_BENCH_SERVER_HPP
+
+#include "bark_push.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+
+#ifdef BARK_PUSH_USE_OPENSSL
+#include <openssl/x509.h>
+#endif
+
+inline int barkBenchListen(uint16_t &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 128) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(address.sin_port);
+    return fd;
+}
+
+inline bool barkBenchWriteAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+class BarkBenchServer
+{
+private:
+    int listen_fd_;
+    uint16_t port_;
+    std::chrono::microseconds latency_;
+    bool tls_;
+#ifdef BARK_PUSH_USE_OPENSSL
+    SSL_CTX *ssl_ctx_;
+#endif
+    std::atomic<bool> stopping_;
+    std::atomic<uint64_t> requests_;
+    std::atomic<uint64_t> connections_;
+    std::mutex mutex_;
+    std::vector<int> client_fds_;
+    std::vector<std::thread> threads_;
+    std::thread acceptor_;
+
+    BarkBenchServer(const BarkBenchServer&) = delete;
+    BarkBenchServer& operator=(const BarkBenchServer&) = delete;
+
+    static size_t contentLength(const std::string &headers)
+    {
+        std::string lower(headers);
+        for (char &c : lower)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        size_t pos = lower.find("\r\ncontent-length:");
+        return pos == std::string::npos ? 0 : std::strtoul(lower.c_str() + pos + 17, nullptr, 10);
+    }
+
+#ifdef BARK_PUSH_USE_OPENSSL
+    bool createTlsContext()
+    {
+        EVP_PKEY *key = nullptr;
+        EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        bool ok = key_ctx && EVP_PKEY_keygen_init(key_ctx) == 1 &&
+                  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) == 1 &&
+                  EVP_PKEY_keygen(key_ctx, &key) == 1;
+        EVP_PKEY_CTX_free(key_ctx);
+
+        X509 *cert = ok ? X509_new() : nullptr;
+        if (cert)
+        {
+            X509_set_version(cert, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+            X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+            X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+            X509_set_pubkey(cert, key);
+            X509_NAME *name = X509_get_subject_name(cert);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                       reinterpret_cast<const unsigned char *>("127.0.0.1"), -1, -1, 0);
+            X509_set_issuer_name(cert, name);
+            ok = X509_sign(cert, key, EVP_sha256()) > 0;
+        }
+
+        ssl_ctx_ = ok ? SSL_CTX_new(TLS_server_method()) : nullptr;
+        ok = ssl_ctx_ && SSL_CTX_use_certificate(ssl_ctx_, cert) == 1 && SSL_CTX_use_PrivateKey(ssl_ctx_, key) == 1;
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        return ok;
+    }
+#endif
+
+    ssize_t receive(void *ssl, int fd, char *data, size_t size)
+    {
+#ifdef BARK_PUSH_USE_OPENSSL
+        if (ssl)
+            return SSL_read(static_cast<SSL *>(ssl), data, static_cast<int>(size));
+#endif
+        (void)ssl;
+        return recv(fd, data, size, 0);
+    }
+
+    bool reply(void *ssl, int fd, const std::string &response)
+    {
+#ifdef BARK_PUSH_USE_OPENSSL
+        if (ssl)
+            return SSL_write(static_cast<SSL *>(ssl), response.data(), static_cast<int>(response.size())) ==
+                   static_cast<int>(response.size());
+#endif
+        (void)ssl;
+        return barkBenchWriteAll(fd, response.data(), response.size());
+    }
+
+    void serve(int fd)
+    {
+        void *ssl = nullptr;
+#ifdef BARK_PUSH_USE_OPENSSL
+        if (tls_)
+        {
+            SSL *session = SSL_new(ssl_ctx_);
+            SSL_set_fd(session, fd);
+            if (SSL_accept(session) != 1)
+            {
+                SSL_free(session);
+                shutdown(fd, SHUT_RDWR);
+                return;
+            }
+            ssl = session;
+        }
+#endif
+        serveRequests(ssl, fd);
+#ifdef BARK_PUSH_USE_OPENSSL
+        SSL_free(static_cast<SSL *>(ssl));
+#endif
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    void serveRequests(void *ssl, int fd)
+    {
+        static const std::string body = "{\"code\":200,\"message\":\"success\",\"timestamp\":1}";
+        const std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                                     std::to_string(body.size()) + "\r\n\r\n" + body;
+        std::string buffer;
+        char chunk[16384];
+        while (!stopping_.load())
+        {
+            size_t header_end = buffer.find("\r\n\r\n");
+            if (header_end != std::string::npos)
+            {
+                size_t total = header_end + 4 + contentLength(buffer.substr(0, header_end + 2));
+                if (buffer.size() >= total)
+                {
+                    buffer.erase(0, total);
+                    if (latency_.count() > 0)
+                        std::this_thread::sleep_for(latency_);
+                    requests_.fetch_add(1, std::memory_order_relaxed);
+                    if (!reply(ssl, fd, response))
+                        break;
+                    continue;
+                }
+            }
+            ssize_t n = receive(ssl, fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR && !ssl)
+                continue;
+            if (n <= 0)
+                break;
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+    }
+
+    void acceptLoop()
+    {
+        while (!stopping_.load())
+        {
+            pollfd entry{listen_fd_, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            connections_.fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(mutex_);
+            client_fds_.push_back(fd);
+            threads_.emplace_back(&BarkBenchServer::serve, this, fd);
+        }
+    }
+
+public:
+    explicit BarkBenchServer(std::chrono::microseconds latency = std::chrono::microseconds(0), bool tls = false)
+        : listen_fd_(-1), port_(0), latency_(latency), tls_(tls),
+#ifdef BARK_PUSH_USE_OPENSSL
+          ssl_ctx_(nullptr),
+#endif
+          stopping_(false), requests_(0), connections_(0)
+    {
+#ifdef BARK_PUSH_USE_OPENSSL
+        if (tls_ && !createTlsContext())
+        {
+            SSL_CTX_free(ssl_ctx_);
+            throw std::runtime_error("Failed to create the TLS server context");
+        }
+#else
+        if (tls_)
+            throw std::runtime_error("TLS needs BARK_PUSH_USE_OPENSSL");
+#endif
+        listen_fd_ = barkBenchListen(port_);
+        if (listen_fd_ < 0)
+            throw std::runtime_error("Failed to listen on a loopback port");
+        acceptor_ = std::thread(&BarkBenchServer::acceptLoop, this);
+    }
+
+    ~BarkBenchServer()
+    {
+        stopping_ = true;
+        acceptor_.join();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int fd : client_fds_)
+                shutdown(fd, SHUT_RDWR);
+        }
+        for (std::thread &thread : threads_)
+            thread.join();
+        for (int fd : client_fds_)
+            close(fd);
+        close(listen_fd_);
+#ifdef BARK_PUSH_USE_OPENSSL
+        SSL_CTX_free(ssl_ctx_);
+#endif
+    }
+
+    uint16_t port() const
+    {
+        return port_;
+    }
+
+    std::string url() const
+    {
+        return (tls_ ? "https://127.0.0.1:" : "http://127.0.0.1:") + std::to_string(port_) + "/";
+    }
+
+    uint64_t requests() const
+    {
+        return requests_.load();
+    }
+
+    uint64_t connections() const
+    {
+        return connections_.load();
+    }
+};
+
+class BarkBenchConnectProxy
+{
+private:
+    int listen_fd_;
+    uint16_t port_;
+    std::chrono::microseconds connect_delay_;
+    std::atomic<bool> stopping_;
+    std::atomic<uint64_t> tunnels_;
+    std::mutex mutex_;
+    std::vector<int> fds_;
+    std::vector<std::thread> threads_;
+    std::thread acceptor_;
+
+    BarkBenchConnectProxy(const BarkBenchConnectProxy&) = delete;
+    BarkBenchConnectProxy& operator=(const BarkBenchConnectProxy&) = delete;
+
+    int connectUpstream(uint16_t port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        if (fd >= 0)
+        {
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            std::lock_guard<std::mutex> lock(mutex_);
+            fds_.push_back(fd);
+        }
+        return fd;
+    }
+
+    void tunnel(int client)
+    {
+        std::string request;
+        char chunk[16384];
+        size_t header_end = std::string::npos;
+        while ((header_end = request.find("\r\n\r\n")) == std::string::npos)
+        {
+            ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return;
+            request.append(chunk, static_cast<size_t>(n));
+        }
+
+        size_t colon = request.find(':');
+        int upstream = -1;
+        if (request.compare(0, 8, "CONNECT ") == 0 && colon != std::string::npos && colon < header_end)
+            upstream = connectUpstream(static_cast<uint16_t>(std::strtoul(request.c_str() + colon + 1, nullptr, 10)));
+        if (upstream < 0)
+        {
+            static const char refused[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+            barkBenchWriteAll(client, refused, sizeof(refused) - 1);
+            return;
+        }
+
+        if (connect_delay_.count() > 0)
+            std::this_thread::sleep_for(connect_delay_);
+        tunnels_.fetch_add(1, std::memory_order_relaxed);
+        static const char established[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+        if (!barkBenchWriteAll(client, established, sizeof(established) - 1) ||
+            !barkBenchWriteAll(upstream, request.data() + header_end + 4, request.size() - header_end - 4))
+            return;
+
+        pollfd entries[2] = {{client, POLLIN, 0}, {upstream, POLLIN, 0}};
+        while (!stopping_.load())
+        {
+            if (poll(entries, 2, 100) <= 0)
+                continue;
+            for (int i = 0; i < 2; ++i)
+            {
+                if (!(entries[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+                ssize_t n = recv(entries[i].fd, chunk, sizeof(chunk), 0);
+                if (n <= 0 || !barkBenchWriteAll(entries[1 - i].fd, chunk, static_cast<size_t>(n)))
+                {
+                    shutdown(client, SHUT_RDWR);
+                    shutdown(upstream, SHUT_RDWR);
+                    return;
+                }
+            }
+        }
+    }
+
+    void acceptLoop()
+    {
+        while (!stopping_.load())
+        {
+            pollfd entry{listen_fd_, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            std::lock_guard<std::mutex> lock(mutex_);
+            fds_.push_back(fd);
+            threads_.emplace_back(&BarkBenchConnectProxy::tunnel, this, fd);
+        }
+    }
+
+public:
+    explicit BarkBenchConnectProxy(std::chrono::microseconds connect_delay = std::chrono::microseconds(0))
+        : listen_fd_(-1), port_(0), connect_delay_(connect_delay), stopping_(false), tunnels_(0)
+    {
+        listen_fd_ = barkBenchListen(port_);
+        if (listen_fd_ < 0)
+            throw std::runtime_error("Failed to listen on a loopback port");
+        acceptor_ = std::thread(&BarkBenchConnectProxy::acceptLoop, this);
+    }
+
+    ~BarkBenchConnectProxy()
+    {
+        stopping_ = true;
+        acceptor_.join();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int fd : fds_)
+                shutdown(fd, SHUT_RDWR);
+        }
+        for (std::thread &thread : threads_)
+            thread.join();
+        for (int fd : fds_)
+            close(fd);
+        close(listen_fd_);
+    }
+
+    std::string url() const
+    {
+        return "http://127.0.0.1:" + std::to_string(port_);
+    }
+
+    uint64_t tunnels() const
+    {
+        return tunnels_.load();
+    }
+};
+
+#endif
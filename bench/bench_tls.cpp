@@ -0,0 +1,55 @@
+// HTTPS sends over loopback with libcurl's user-space TLS, plus plain HTTP as
+// the floor. task-ns is the client thread's CPU time per notification, so the
+// difference between the two lines is the TLS record cost per send.
+//
+//   g++ -std=c++17 -O2 -DBARK_PUSH_USE_OPENSSL -I.. bench_tls.cpp -o bench_tls -lcurl -lssl -lcrypto -pthread
+//   ./bench_tls
+
+#include "bark_bench.hpp"
+#include "bench_server.hpp"
+
+#ifdef BARK_PUSH_USE_OPENSSL
+
+int main()
+{
+    BarkBenchServer http;
+    BarkBenchServer https(std::chrono::microseconds(0), true);
+    const std::vector<std::string> keys = {"dEvIcEkEy"};
+    const std::string title = "Deploy finished";
+    const std::string body = "api-gateway 2024.06.1 rolled out to 12/12 hosts";
+    const std::map<std::string, std::string> params = {{"group", "deploys"}, {"sound", "bell"}};
+
+    BarkBench bench;
+
+    bench.run("BarkPush http", [&](size_t iterations)
+    {
+        BarkPush push(keys, http.url());
+        size_t ok = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            ok += push.send(title, body, params) == BarkError::SUCCESS;
+        return ok;
+    });
+
+    bench.run("BarkPush https, user-space TLS", [&](size_t iterations)
+    {
+        BarkPush push(keys, https.url());
+        push.disableSslVerification();
+        size_t ok = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            ok += push.send(title, body, params) == BarkError::SUCCESS;
+        return ok;
+    });
+
+    std::printf("\nhttps connections accepted: %llu\n", static_cast<unsigned long long>(https.connections()));
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::printf("bench_tls needs -DBARK_PUSH_USE_OPENSSL\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Builds and runs every test program in this directory, then builds them all
+# again with BARK_PUSH_USE_OPENSSL and runs the APNs tests, which need it.
+#
+#   ./run_tests.sh
+#   CXXFLAGS="-g -fsanitize=address,undefined" ./run_tests.sh
+
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+OUT=${OUT:-build}
+mkdir -p "$OUT" "$OUT/openssl"
+
+status=0
+for source in test_*.cpp; do
+    name=${source%.cpp}
+    [ "$name" = test_apns ] && continue
+    $CXX -std=c++17 -Wall -Wextra ${CXXFLAGS:-} -I.. -I../bench "$source" -o "$OUT/$name" -lcurl -pthread
+    echo "== $name"
+    "$OUT/$name" || status=1
+done
+
+for source in test_*.cpp; do
+    name=${source%.cpp}
+    $CXX -std=c++17 -Wall -Wextra ${CXXFLAGS:-} -DBARK_PUSH_USE_OPENSSL -I.. -I../bench "$source" \
+        -o "$OUT/openssl/$name" -lcurl -lssl -lcrypto -pthread
+done
+echo "== test_apns (openssl)"
+"$OUT/openssl/test_apns" || status=1
+exit $status
@@ -0,0 +1,612 @@
+// BarkApnsPush against a cleartext HTTP/2 stand-in for APNs: the provider
+// token's header, claims and signature, the request path, headers and
+// payload, and the retry after ExpiredProviderToken.
+//
+//   g++ -std=c++17 -DBARK_PUSH_USE_OPENSSL -I.. -I../bench test_apns.cpp -o test_apns
+//       -lcurl -lssl -lcrypto -pthread
+//   ./test_apns
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+// RFC 7541 appendix A.
+static const char *const kStaticTable[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""},
+    {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+    {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+// RFC 7541 appendix B, indexed by symbol; 256 is EOS.
+static const uint32_t kHuffmanCodes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff
+};
+
+static const uint8_t kHuffmanLengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+// Decodes the HPACK header blocks of one connection.
+class HpackDecoder
+{
+private:
+    std::deque<std::pair<std::string, std::string>> dynamic_;
+    size_t size_ = 0;
+    size_t max_size_ = 4096;
+
+    static bool readInteger(const uint8_t *&in, const uint8_t *end, unsigned prefix_bits, uint64_t &value)
+    {
+        if (in == end)
+            return false;
+        uint64_t limit = (uint64_t(1) << prefix_bits) - 1;
+        value = *in++ & limit;
+        if (value < limit)
+            return true;
+        for (unsigned shift = 0; in < end && shift < 56; shift += 7)
+        {
+            uint8_t byte = *in++;
+            value += static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    static bool huffmanDecode(const uint8_t *in, size_t length, std::string &out)
+    {
+        uint32_t code = 0;
+        unsigned bits = 0;
+        for (size_t i = 0; i < length; ++i)
+        {
+            for (int bit = 7; bit >= 0; --bit)
+            {
+                code = (code << 1) | ((in[i] >> bit) & 1);
+                if (++bits > 30)
+                    return false;
+                for (int symbol = 0; symbol < 256; ++symbol)
+                {
+                    if (kHuffmanLengths[symbol] == bits && kHuffmanCodes[symbol] == code)
+                    {
+                        out += static_cast<char>(symbol);
+                        code = 0;
+                        bits = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        // Padding is a prefix of EOS: fewer than eight one bits.
+        return bits < 8 && code == (uint32_t(1) << bits) - 1;
+    }
+
+    static bool readString(const uint8_t *&in, const uint8_t *end, std::string &out)
+    {
+        if (in == end)
+            return false;
+        bool huffman = (*in & 0x80) != 0;
+        uint64_t length = 0;
+        if (!readInteger(in, end, 7, length) || length > static_cast<uint64_t>(end - in))
+            return false;
+        out.clear();
+        bool ok = true;
+        if (huffman)
+            ok = huffmanDecode(in, length, out);
+        else
+            out.assign(reinterpret_cast<const char *>(in), length);
+        in += length;
+        return ok;
+    }
+
+    bool entry(uint64_t index, std::pair<std::string, std::string> &out) const
+    {
+        if (index >= 1 && index <= 61)
+            out = {kStaticTable[index - 1][0], kStaticTable[index - 1][1]};
+        else if (index >= 62 && index - 62 < dynamic_.size())
+            out = dynamic_[index - 62];
+        else
+            return false;
+        return true;
+    }
+
+    void evict()
+    {
+        while (size_ > max_size_ && !dynamic_.empty())
+        {
+            size_ -= dynamic_.back().first.size() + dynamic_.back().second.size() + 32;
+            dynamic_.pop_back();
+        }
+    }
+
+public:
+    bool decode(const std::string &block, std::map<std::string, std::string> &headers)
+    {
+        const uint8_t *in = reinterpret_cast<const uint8_t *>(block.data());
+        const uint8_t *end = in + block.size();
+        while (in < end)
+        {
+            uint8_t first = *in;
+            uint64_t index = 0;
+            std::pair<std::string, std::string> field;
+            if (first & 0x80)
+            {
+                if (!readInteger(in, end, 7, index) || !entry(index, field))
+                    return false;
+                headers[field.first] = field.second;
+                continue;
+            }
+            if ((first & 0xE0) == 0x20)
+            {
+                if (!readInteger(in, end, 5, index))
+                    return false;
+                max_size_ = static_cast<size_t>(index);
+                evict();
+                continue;
+            }
+
+            bool indexed = (first & 0xC0) == 0x40;
+            if (!readInteger(in, end, indexed ? 6 : 4, index))
+                return false;
+            if (index != 0 ? !entry(index, field) : !readString(in, end, field.first))
+                return false;
+            if (!readString(in, end, field.second))
+                return false;
+            headers[field.first] = field.second;
+            if (indexed)
+            {
+                size_ += field.first.size() + field.second.size() + 32;
+                dynamic_.push_front(std::move(field));
+                evict();
+            }
+        }
+        return true;
+    }
+};
+
+struct H2Request
+{
+    std::map<std::string, std::string> headers;
+    std::string body;
+
+    std::string header(const std::string &name) const
+    {
+        auto it = headers.find(name);
+        return it == headers.end() ? std::string() : it->second;
+    }
+};
+
+using H2Reply = std::pair<int, std::string>;
+
+// Speaks just enough HTTP/2 with prior knowledge to record each request and
+// answer it with the handler's status and body. curl 7.88 fails to send on a
+// reused prior-knowledge connection, so each connection answers one request
+// and then sends GOAWAY.
+class H2cServer
+{
+private:
+    int listen_fd_;
+    uint16_t port_;
+    std::atomic<bool> stopping_;
+    std::atomic<int> connections_;
+    std::function<H2Reply(const H2Request &)> handler_;
+    std::vector<H2Request> requests_;
+    std::mutex mutex_;
+    std::vector<std::thread> workers_;
+    std::thread acceptor_;
+
+    static std::string frame(uint8_t type, uint8_t flags, uint32_t stream, const std::string &payload)
+    {
+        char header[9] = {static_cast<char>(payload.size() >> 16), static_cast<char>(payload.size() >> 8),
+                          static_cast<char>(payload.size()), static_cast<char>(type), static_cast<char>(flags),
+                          static_cast<char>(stream >> 24), static_cast<char>(stream >> 16),
+                          static_cast<char>(stream >> 8), static_cast<char>(stream)};
+        return std::string(header, sizeof(header)) + payload;
+    }
+
+    bool fill(int fd, std::string &buffer, size_t size)
+    {
+        char chunk[4096];
+        while (buffer.size() < size)
+        {
+            if (stopping_.load())
+                return false;
+            pollfd entry{fd, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+        return true;
+    }
+
+    static bool send(int fd, const std::string &data)
+    {
+        return barkBenchWriteAll(fd, data.data(), data.size());
+    }
+
+    void respond(int fd, uint32_t stream, H2Request &&request)
+    {
+        H2Reply reply = handler_(request);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_.push_back(std::move(request));
+        }
+        // :status as a literal without indexing that reuses the static name.
+        std::string status = std::to_string(reply.first);
+        std::string block = std::string(1, '\x08') + static_cast<char>(status.size()) + status;
+        std::string out = frame(1, reply.second.empty() ? 0x5 : 0x4, stream, block);
+        if (!reply.second.empty())
+            out += frame(0, 0x1, stream, reply.second);
+        char goaway[8] = {static_cast<char>(stream >> 24), static_cast<char>(stream >> 16),
+                          static_cast<char>(stream >> 8), static_cast<char>(stream), 0, 0, 0, 0};
+        out += frame(7, 0, 0, std::string(goaway, sizeof(goaway)));
+        send(fd, out);
+    }
+
+    void serve(int fd)
+    {
+        static const std::string preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        std::string buffer;
+        if (!fill(fd, buffer, preface.size()) || buffer.compare(0, preface.size(), preface) != 0)
+            return;
+        buffer.erase(0, preface.size());
+        if (!send(fd, frame(4, 0, 0, "")))
+            return;
+
+        HpackDecoder decoder;
+        std::map<uint32_t, H2Request> streams;
+        std::string block;
+        bool block_ends_stream = false;
+        while (fill(fd, buffer, 9))
+        {
+            size_t length = (static_cast<uint8_t>(buffer[0]) << 16) | (static_cast<uint8_t>(buffer[1]) << 8) |
+                            static_cast<uint8_t>(buffer[2]);
+            if (!fill(fd, buffer, 9 + length))
+                return;
+            uint8_t type = static_cast<uint8_t>(buffer[3]);
+            uint8_t flags = static_cast<uint8_t>(buffer[4]);
+            uint32_t stream = (static_cast<uint32_t>(static_cast<uint8_t>(buffer[5]) & 0x7F) << 24) |
+                              (static_cast<uint8_t>(buffer[6]) << 16) | (static_cast<uint8_t>(buffer[7]) << 8) |
+                              static_cast<uint8_t>(buffer[8]);
+            std::string payload = buffer.substr(9, length);
+            buffer.erase(0, 9 + length);
+            if ((type == 0 || type == 1) && (flags & 0x8) && !payload.empty())
+            {
+                size_t padding = static_cast<uint8_t>(payload[0]);
+                payload = payload.substr(1, payload.size() - 1 - std::min(padding, payload.size() - 1));
+            }
+
+            bool end_stream = false;
+            if (type == 0)
+            {
+                streams[stream].body += payload;
+                end_stream = (flags & 0x1) != 0;
+            }
+            else if (type == 1 || type == 9)
+            {
+                if (type == 1)
+                {
+                    block.clear();
+                    block_ends_stream = (flags & 0x1) != 0;
+                    if (flags & 0x20)
+                        payload.erase(0, 5);
+                }
+                block += payload;
+                if (!(flags & 0x4))
+                    continue;
+                if (!decoder.decode(block, streams[stream].headers))
+                    return;
+                end_stream = block_ends_stream;
+            }
+            else if (type == 4 && !(flags & 0x1))
+            {
+                if (!send(fd, frame(4, 0x1, 0, "")))
+                    return;
+            }
+            else if (type == 6 && !(flags & 0x1))
+            {
+                if (!send(fd, frame(6, 0x1, 0, payload)))
+                    return;
+            }
+            else if (type == 7)
+            {
+                return;
+            }
+
+            if (end_stream)
+            {
+                respond(fd, stream, std::move(streams[stream]));
+                return;
+            }
+        }
+    }
+
+    void acceptLoop()
+    {
+        while (!stopping_.load())
+        {
+            pollfd entry{listen_fd_, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            ++connections_;
+            workers_.emplace_back([this, fd]()
+            {
+                serve(fd);
+                close(fd);
+            });
+        }
+    }
+
+public:
+    explicit H2cServer(std::function<H2Reply(const H2Request &)> handler)
+        : listen_fd_(barkBenchListen(port_)), stopping_(false), connections_(0), handler_(std::move(handler))
+    {
+        acceptor_ = std::thread(&H2cServer::acceptLoop, this);
+    }
+
+    ~H2cServer()
+    {
+        stopping_ = true;
+        acceptor_.join();
+        for (std::thread &worker : workers_)
+            worker.join();
+        close(listen_fd_);
+    }
+
+    std::string url() const
+    {
+        return "http://127.0.0.1:" + std::to_string(port_);
+    }
+
+    int connections() const
+    {
+        return connections_.load();
+    }
+
+    std::vector<H2Request> requests()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_;
+    }
+};
+
+static const std::string kTeamId = "TEAM123456";
+static const std::string kKeyId = "KEY7890ABC";
+static const std::string kTopic = "me.fin.bark";
+
+static const std::string &signingKeyPem()
+{
+    static const std::string pem = []()
+    {
+        EVP_PKEY *key = nullptr;
+        EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        if (context && EVP_PKEY_keygen_init(context) == 1 &&
+            EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context, NID_X9_62_prime256v1) == 1)
+            EVP_PKEY_keygen(context, &key);
+        EVP_PKEY_CTX_free(context);
+        BIO *bio = BIO_new(BIO_s_mem());
+        PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr);
+        char *data = nullptr;
+        long size = BIO_get_mem_data(bio, &data);
+        std::string text(data, static_cast<size_t>(size));
+        BIO_free(bio);
+        EVP_PKEY_free(key);
+        return text;
+    }();
+    return pem;
+}
+
+static std::string base64UrlDecode(const std::string &text)
+{
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    std::string out;
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : text)
+    {
+        size_t value = alphabet.find(c);
+        if (value == std::string::npos)
+            return std::string();
+        bits = (bits << 6) | static_cast<uint32_t>(value);
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            out += static_cast<char>((bits >> count) & 0xFF);
+        }
+    }
+    return out;
+}
+
+static bool verifySignature(const std::string &input, const std::string &raw)
+{
+    if (raw.size() != 64)
+        return false;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(raw.data());
+    ECDSA_SIG *signature = ECDSA_SIG_new();
+    ECDSA_SIG_set0(signature, BN_bin2bn(bytes, 32, nullptr), BN_bin2bn(bytes + 32, 32, nullptr));
+    unsigned char *der = nullptr;
+    int der_length = i2d_ECDSA_SIG(signature, &der);
+    ECDSA_SIG_free(signature);
+
+    BIO *bio = BIO_new_mem_buf(signingKeyPem().data(), static_cast<int>(signingKeyPem().size()));
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+    BIO_free(bio);
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    bool verified = der_length > 0 && EVP_DigestVerifyInit(context, nullptr, EVP_sha256(), nullptr, key) == 1 &&
+                    EVP_DigestVerify(context, der, static_cast<size_t>(der_length),
+                                     reinterpret_cast<const unsigned char *>(input.data()), input.size()) == 1;
+    EVP_MD_CTX_free(context);
+    EVP_PKEY_free(key);
+    OPENSSL_free(der);
+    return verified;
+}
+
+// Checks the bearer token's ES256 header, issuer and issue time, and its
+// signature against the test key. Returns the token.
+static std::string checkProviderToken(const H2Request &request)
+{
+    std::string authorization = request.header("authorization");
+    BARK_CHECK(authorization.compare(0, 7, "bearer ") == 0);
+    std::string token = authorization.substr(std::min<size_t>(7, authorization.size()));
+    size_t first = token.find('.');
+    size_t second = token.find('.', first == std::string::npos ? token.size() : first + 1);
+    BARK_CHECK(second != std::string::npos);
+    if (second == std::string::npos)
+        return token;
+
+    BARK_CHECK_EQ(base64UrlDecode(token.substr(0, first)), "{\"alg\":\"ES256\",\"kid\":\"" + kKeyId + "\"}");
+    std::string claims = base64UrlDecode(token.substr(first + 1, second - first - 1));
+    std::string prefix = "{\"iss\":\"" + kTeamId + "\",\"iat\":";
+    BARK_CHECK(claims.compare(0, prefix.size(), prefix) == 0 && claims.back() == '}');
+    long long issued_at = std::atoll(claims.c_str() + std::min(prefix.size(), claims.size()));
+    long long now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    BARK_CHECK(issued_at <= now && now - issued_at < 60);
+    BARK_CHECK(verifySignature(token.substr(0, second), base64UrlDecode(token.substr(second + 1))));
+    return token;
+}
+
+static void testProviderTokenAndRequest()
+{
+    H2cServer server([](const H2Request &) { return H2Reply(200, ""); });
+    BarkApnsPush push(kTeamId, kKeyId, signingKeyPem(), kTopic, server.url());
+    std::map<std::string, std::string> params = {{"group", "ops"}, {"id", "deploy-1"}, {"url", "example.com/run"}};
+    BARK_CHECK_EQ(push.send("a1b2c3d4", "Deploy", "finished \"ok\"", params), BarkError::SUCCESS);
+    BARK_CHECK_EQ(push.getLastHttpStatusCode(), 200L);
+
+    std::vector<H2Request> requests = server.requests();
+    BARK_CHECK_EQ(requests.size(), 1u);
+    if (requests.empty())
+        return;
+    const H2Request &request = requests[0];
+    BARK_CHECK_EQ(request.header(":method"), "POST");
+    BARK_CHECK_EQ(request.header(":path"), "/3/device/a1b2c3d4");
+    BARK_CHECK_EQ(request.header("apns-topic"), kTopic);
+    BARK_CHECK_EQ(request.header("apns-push-type"), "alert");
+    BARK_CHECK_EQ(request.header("apns-collapse-id"), "deploy-1");
+    BARK_CHECK_EQ(request.header("content-type"), "application/json");
+    BARK_CHECK_EQ(request.body, BarkApnsPush::buildApnsPayload("Deploy", "finished \"ok\"", params));
+    BARK_CHECK(request.body.find("\"thread-id\":\"ops\"") != std::string::npos);
+    checkProviderToken(request);
+}
+
+static void testExpiredTokenIsResigned()
+{
+    std::atomic<int> answered(0);
+    H2cServer server([&answered](const H2Request &)
+    {
+        return answered++ == 0 ? H2Reply(403, "{\"reason\":\"ExpiredProviderToken\"}") : H2Reply(200, "");
+    });
+    BarkApnsPush push(kTeamId, kKeyId, signingKeyPem(), kTopic, server.url());
+    BARK_CHECK_EQ(push.send("expired", "Alert", "retried"), BarkError::SUCCESS);
+
+    std::vector<H2Request> requests = server.requests();
+    BARK_CHECK_EQ(requests.size(), 2u);
+    if (requests.size() != 2)
+        return;
+    BARK_CHECK_EQ(requests[1].header(":path"), "/3/device/expired");
+    BARK_CHECK_EQ(requests[1].body, requests[0].body);
+    BARK_CHECK(checkProviderToken(requests[0]) != checkProviderToken(requests[1]));
+}
+
+static void testSendManyReportsReasons()
+{
+    H2cServer server([](const H2Request &request)
+    {
+        if (request.header(":path") == "/3/device/bad")
+            return H2Reply(400, "{\"reason\":\"BadDeviceToken\"}");
+        return H2Reply(200, "");
+    });
+    BarkApnsPush push(kTeamId, kKeyId, signingKeyPem(), kTopic, server.url());
+    push.setMaxConcurrentStreams(1);
+    std::vector<BarkApnsResult> results = push.sendMany({"first", "bad", "second"}, "Alert", "fan out");
+    BARK_CHECK_EQ(results.size(), 3u);
+    if (results.size() != 3)
+        return;
+    BARK_CHECK_EQ(results[0].error, BarkError::SUCCESS);
+    BARK_CHECK_EQ(results[1].error, BarkError::HTTP_ERROR);
+    BARK_CHECK_EQ(results[1].http_status, 400L);
+    BARK_CHECK_EQ(results[1].reason, "BadDeviceToken");
+    BARK_CHECK_EQ(results[2].error, BarkError::SUCCESS);
+    BARK_CHECK_EQ(server.requests().size(), 3u);
+    BARK_CHECK_EQ(server.connections(), 3);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"provider token and request", testProviderTokenAndRequest},
+        {"expired provider token is re-signed", testExpiredTokenIsResigned},
+        {"sendMany reports per-token reasons", testSendManyReportsReasons},
+    });
+}
@@ -0,0 +1,144 @@
+// BarkCompactNotification: queue encoding and intern table reference counts.
+//
+//   g++ -std=c++17 -I.. test_compact.cpp -o test_compact -lcurl -pthread
+//   ./test_compact
+
+#include "test_support.hpp"
+
+static BarkNotification sample()
+{
+    BarkNotification n;
+    n.device_keys = {"compactKeyA", "compactKeyB"};
+    n.title = "Backup";
+    n.body = std::string("nightly backup finished\n\0binary", 32);
+    n.params = {{"compactGroup", "ops"}, {"level", "passive"}, {"url", "https://example.com/a?b=c"}};
+    return n;
+}
+
+static bool sameContent(const BarkNotification &a, const BarkNotification &b)
+{
+    return a.device_keys == b.device_keys && a.title == b.title && a.body == b.body && a.params == b.params;
+}
+
+static void testEncodeDecode()
+{
+    BarkNotification original = sample();
+    BarkCompactNotification compact = BarkCompactNotification::encode(original);
+    BarkNotification decoded;
+    decoded.title = "stale";
+    compact.decode(decoded);
+    BARK_CHECK(sameContent(original, decoded));
+    BARK_CHECK(compact.residentBytes() >= compact.size());
+}
+
+static void testInternReleasedWithLastReference()
+{
+    BarkInternTable &keys = BarkInternTable::deviceKeys();
+    BarkInternTable &names = BarkInternTable::paramNames();
+    size_t keys_before = keys.size();
+    size_t names_before = names.size();
+    {
+        BarkCompactNotification first = BarkCompactNotification::encode(sample());
+        BarkCompactNotification second = BarkCompactNotification::encode(sample());
+        BARK_CHECK_EQ(keys.size(), keys_before + 2);
+        BARK_CHECK_EQ(names.size(), names_before + 3);
+
+        BarkCompactNotification moved(std::move(first));
+        second = std::move(moved);
+        BARK_CHECK_EQ(keys.size(), keys_before + 2);
+
+        std::deque<BarkCompactNotification> queue;
+        queue.push_back(std::move(second));
+        queue.pop_front();
+    }
+    BARK_CHECK_EQ(keys.size(), keys_before);
+    BARK_CHECK_EQ(names.size(), names_before);
+}
+
+static void testInternIdsAreReused()
+{
+    BarkInternTable table;
+    uint32_t a = table.intern("a");
+    uint32_t b = table.intern("b");
+    BARK_CHECK_EQ(table.intern("a"), a);
+    table.release(a);
+    BARK_CHECK_EQ(table.size(), 2u);
+    table.release(a);
+    BARK_CHECK_EQ(table.size(), 1u);
+
+    uint32_t c = table.intern("c");
+    BARK_CHECK_EQ(c, a);
+    std::string value;
+    table.lookup(c, value);
+    BARK_CHECK_EQ(value, "c");
+    table.lookup(b, value);
+    BARK_CHECK_EQ(value, "b");
+}
+
+static void testDispatcherReleasesDrainedKeys()
+{
+    size_t keys_before = BarkInternTable::deviceKeys().size();
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    BarkDispatcher dispatcher("http://127.0.0.1:9/", options);
+    for (int i = 0; i < 100; ++i)
+    {
+        BarkNotification n = sample();
+        n.device_keys = {"drainedKey" + std::to_string(i)};
+        dispatcher.enqueue(n);
+    }
+    BARK_CHECK_EQ(BarkInternTable::deviceKeys().size(), keys_before + 100);
+    size_t keys_bytes = BarkInternTable::deviceKeys().residentBytes();
+    BARK_CHECK(dispatcher.residentBytes() >= dispatcher.queuedBytes() + keys_bytes);
+    std::vector<BarkNotification> pending;
+    BARK_CHECK_EQ(dispatcher.takePending(pending), 100u);
+    BARK_CHECK_EQ(BarkInternTable::deviceKeys().size(), keys_before);
+    BARK_CHECK(BarkInternTable::deviceKeys().residentBytes() < keys_bytes);
+    BARK_CHECK_EQ(dispatcher.queuedBytes(), 0u);
+    BARK_CHECK_EQ(dispatcher.residentBytes(), BarkInternTable::deviceKeys().residentBytes() +
+                                              BarkInternTable::paramNames().residentBytes());
+}
+
+static void testConcurrentInternAndLookup()
+{
+    BarkInternTable table;
+    uint32_t pinned = table.intern("pinned");
+    std::atomic<bool> done(false);
+    std::atomic<int> mismatches(0);
+    std::thread reader([&]()
+    {
+        std::string value;
+        while (!done.load())
+        {
+            table.lookup(pinned, value);
+            if (value != "pinned")
+                ++mismatches;
+        }
+    });
+    std::vector<uint32_t> ids(1000);
+    std::vector<std::string> values;
+    for (int round = 0; round < 20; ++round)
+    {
+        values.clear();
+        for (size_t i = 0; i < ids.size(); ++i)
+            values.push_back("value" + std::to_string(round) + "-" + std::to_string(i));
+        table.internMany(values.begin(), values.end(), ids.data(),
+                         [](const std::string &value) -> const std::string & { return value; });
+        table.releaseMany(ids.data(), ids.size());
+    }
+    done = true;
+    reader.join();
+    BARK_CHECK_EQ(mismatches.load(), 0);
+    BARK_CHECK_EQ(table.size(), 1u);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"encode and decode", testEncodeDecode},
+        {"intern entries released with the last reference", testInternReleasedWithLastReference},
+        {"intern ids are reused", testInternIdsAreReused},
+        {"dispatcher releases drained keys", testDispatcherReleasesDrainedKeys},
+        {"concurrent intern and lookup", testConcurrentInternAndLookup},
+    });
+}
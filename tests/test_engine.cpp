@@ -0,0 +1,232 @@
+// BarkEngine: pooled handle leasing for BarkPush facades sharing one engine,
+// and the per-host connection cap. BarkAsyncEngine: blocking sends routed
+// through the shared multi handle.
+//
+//   g++ -std=c++17 -I.. -I../bench test_engine.cpp -o test_engine -lcurl -pthread
+//   ./test_engine
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+#include <sys/resource.h>
+
+static BarkBenchServer &server()
+{
+    static BarkBenchServer instance;
+    return instance;
+}
+
+static void testReleasedHandleIsReused()
+{
+    BarkEngine &engine = BarkEngine::instance();
+    CURL *first = nullptr;
+    {
+        BarkEngine::Lease lease = engine.acquire();
+        first = lease.get();
+        BARK_CHECK(first != nullptr);
+    }
+    size_t idle = engine.idleHandleCount();
+    BARK_CHECK(idle >= 1);
+    BarkEngine::Lease lease = engine.acquire();
+    BARK_CHECK(lease.get() == first);
+    BARK_CHECK_EQ(engine.idleHandleCount(), idle - 1);
+}
+
+static void testSequentialFacadesReuseConnection()
+{
+    BarkPoolStats before = BarkEngine::instance().poolStats();
+    uint64_t connections = server().connections();
+    for (int i = 0; i < 5; ++i)
+    {
+        BarkPush push(BARK_SHARED_ENGINE, {"key"}, server().url());
+        BARK_CHECK_EQ(push.send("Alert", "event " + std::to_string(i)), BarkError::SUCCESS);
+    }
+    BarkPoolStats after = BarkEngine::instance().poolStats();
+    BARK_CHECK_EQ(after.requests - before.requests, 5u);
+    BARK_CHECK(after.reused - before.reused >= 4);
+    BARK_CHECK(server().connections() - connections <= 1);
+}
+
+static void testConcurrentFacades()
+{
+    uint64_t before = server().requests();
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([t, &failures]()
+        {
+            for (int i = 0; i < 25; ++i)
+            {
+                BarkPush push(BARK_SHARED_ENGINE, {"key" + std::to_string(t)}, server().url());
+                if (push.send("Alert", "event " + std::to_string(i)) != BarkError::SUCCESS)
+                    ++failures;
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    BARK_CHECK_EQ(failures.load(), 0);
+    BARK_CHECK_EQ(server().requests() - before, 100u);
+    BARK_CHECK(BarkEngine::instance().idleHandleCount() >= 1);
+}
+
+static void testHostCapTimesOut()
+{
+    BarkEngine &engine = BarkEngine::instance();
+    BarkPoolOptions options;
+    options.max_connections_per_host = 1;
+    engine.configurePool(options);
+    std::string url = "http://capped.invalid/push";
+    uint64_t waits = engine.poolStats().host_waits;
+    {
+        BarkEngine::Lease held = engine.acquire(url);
+        BARK_CHECK(held.get() != nullptr);
+        auto started = std::chrono::steady_clock::now();
+        BarkEngine::Lease blocked = engine.acquire(url, std::string(), std::chrono::milliseconds(50));
+        BARK_CHECK(!blocked.get() && blocked.timedOut());
+        BARK_CHECK(std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(50));
+        BARK_CHECK_EQ(engine.poolStats().host_waits - waits, 1u);
+
+        BarkEngine::Lease other = engine.acquire("http://other.invalid/push", std::string(),
+                                                 std::chrono::milliseconds(50));
+        BARK_CHECK(other.get() != nullptr);
+    }
+    engine.configurePool(BarkPoolOptions());
+}
+
+// Repurposing idle handles for untracked leases gives up their host slots.
+static void releaseHostSlots(BarkEngine &engine)
+{
+    std::vector<BarkEngine::Lease> drained;
+    while (engine.idleHandleCount() > 0)
+        drained.push_back(engine.acquire());
+}
+
+static void testHostCapCountsIdleConnections()
+{
+    BarkEngine &engine = BarkEngine::instance();
+    BarkPoolOptions options;
+    options.max_connections_per_host = 1;
+    engine.configurePool(options);
+    std::string url = "http://idle.invalid/push";
+    releaseHostSlots(engine);
+    BARK_CHECK_EQ(engine.trackedHostCount(), 0u);
+
+    CURL *connected = nullptr;
+    {
+        BarkEngine::Lease lease = engine.acquire(url);
+        connected = lease.get();
+    }
+    BARK_CHECK_EQ(engine.trackedHostCount(), 1u);
+    {
+        BarkEngine::Lease lease = engine.acquire(url);
+        BARK_CHECK(lease.get() == connected);
+        BarkEngine::Lease second = engine.acquire(url, std::string(), std::chrono::milliseconds(20));
+        BARK_CHECK(second.timedOut());
+
+        BarkEngine::Lease woken;
+        std::thread waiter([&]() { woken = engine.acquire(url, std::string(), std::chrono::seconds(5)); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        lease.reset();
+        waiter.join();
+        BARK_CHECK(woken.get() == connected);
+    }
+
+    releaseHostSlots(engine);
+    BARK_CHECK_EQ(engine.trackedHostCount(), 0u);
+    engine.configurePool(BarkPoolOptions());
+}
+
+static void testCappedConcurrentSends()
+{
+    BarkPoolOptions options;
+    options.max_connections_per_host = 1;
+    BarkEngine::instance().configurePool(options);
+    uint64_t connections = server().connections();
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&failures]()
+        {
+            for (int i = 0; i < 10; ++i)
+            {
+                BarkPush push(BARK_SHARED_ENGINE, {"capped"}, server().url());
+                if (push.send("Alert", "event " + std::to_string(i)) != BarkError::SUCCESS)
+                    ++failures;
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    BARK_CHECK_EQ(failures.load(), 0);
+    BARK_CHECK(server().connections() - connections <= 1);
+    BarkEngine::instance().configurePool(BarkPoolOptions());
+}
+
+static double cpuSeconds()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void testRoutedSends()
+{
+    BarkAsyncEngine &engine = BarkAsyncEngine::instance();
+    BarkAsyncEngine::routeBlockingSends(true);
+    uint64_t transfers = engine.transfers();
+    uint64_t before = server().requests();
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([t, &failures]()
+        {
+            for (int i = 0; i < 10; ++i)
+            {
+                BarkPush push(BARK_SHARED_ENGINE, {"routed" + std::to_string(t)}, server().url());
+                if (push.send("Alert", "event " + std::to_string(i)) != BarkError::SUCCESS)
+                    ++failures;
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    BarkAsyncEngine::routeBlockingSends(false);
+    BARK_CHECK_EQ(failures.load(), 0);
+    BARK_CHECK_EQ(engine.transfers() - transfers, 40u);
+    BARK_CHECK_EQ(server().requests() - before, 40u);
+}
+
+static void testIdleAsyncEngineSleeps()
+{
+    BarkAsyncEngine &engine = BarkAsyncEngine::instance();
+    BarkAsyncEngine::routeBlockingSends(true);
+    double cpu = cpuSeconds();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    BARK_CHECK(cpuSeconds() - cpu < 0.05);
+
+    uint64_t transfers = engine.transfers();
+    auto started = std::chrono::steady_clock::now();
+    BarkPush push(BARK_SHARED_ENGINE, {"idle"}, server().url());
+    BARK_CHECK_EQ(push.send("Alert", "after idle"), BarkError::SUCCESS);
+    BARK_CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds(500));
+    BARK_CHECK_EQ(engine.transfers() - transfers, 1u);
+    BarkAsyncEngine::routeBlockingSends(false);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"released handle is reused", testReleasedHandleIsReused},
+        {"sequential facades reuse a connection", testSequentialFacadesReuseConnection},
+        {"concurrent facades", testConcurrentFacades},
+        {"host cap wait times out", testHostCapTimesOut},
+        {"host cap counts idle connections", testHostCapCountsIdleConnections},
+        {"capped concurrent sends", testCappedConcurrentSends},
+        {"routed sends share the async engine", testRoutedSends},
+        {"idle async engine sleeps", testIdleAsyncEngineSleeps},
+    });
+}
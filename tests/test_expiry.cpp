@@ -0,0 +1,200 @@
+// Notification TTLs: expiry in the dispatcher queue, in coalesced groups, before
+// a limiter token is taken, and before sendMany() issues a request.
+//
+//   g++ -std=c++17 -I.. -I../bench test_expiry.cpp -o test_expiry -lcurl -pthread
+//   ./test_expiry
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+static void testExpiredGroupCountsEveryNotification()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 20; ++i)
+        simulation.schedule(milliseconds(0),
+                            barkTestNotification("key" + std::to_string(i), i < 10 ? "first" : "second"));
+
+    BarkDispatcherOptions options;
+    options.requests_per_second = 1.0;
+    options.burst = 1.0;
+    options.default_ttl = milliseconds(500);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.requests, 1u);
+    BARK_CHECK_EQ(report.coalesced, 18u);
+    BARK_CHECK_EQ(report.expired, 10u);
+    BARK_CHECK_EQ(server.requests.size(), 1u);
+    BARK_CHECK(report.simulated_time <= milliseconds(520));
+}
+
+static void testExpiredInQueue()
+{
+    BarkSimulation simulation;
+    BarkNotification stale = barkTestNotification("key", "stale");
+    stale.expires_at = simulation.clock()->now() + milliseconds(1);
+    simulation.schedule(milliseconds(0), stale);
+    simulation.schedule(milliseconds(0), barkTestNotification("key", "fresh"));
+
+    BarkDispatcherOptions options;
+    options.coalesce_window = milliseconds(50);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.expired, 1u);
+    BARK_CHECK_EQ(report.requests, 1u);
+    BARK_CHECK_EQ(server.requests.size(), 1u);
+    if (!server.requests.empty())
+        BARK_CHECK_EQ(server.requests[0].body, "fresh");
+}
+
+static void testTtlLeavesLiveNotificationsAlone()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 5; ++i)
+        simulation.schedule(milliseconds(200 * i), barkTestNotification("key", "event " + std::to_string(i)));
+
+    BarkDispatcherOptions options;
+    options.default_ttl = milliseconds(100);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler(milliseconds(10)));
+
+    BARK_CHECK_EQ(report.expired, 0u);
+    BARK_CHECK_EQ(report.requests, 5u);
+}
+
+static void testLimiterExpiryDoesNotTakeTokens()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 4; ++i)
+        simulation.schedule(milliseconds(0), barkTestNotification("key", "event " + std::to_string(i)));
+
+    BarkLocalLimitOptions limit;
+    limit.requests_per_second = 1.0;
+    limit.burst = 1.0;
+    limit.clock = simulation.clock();
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkDispatcherOptions options;
+    options.limiter = backend;
+    options.default_ttl = milliseconds(300);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.requests, 1u);
+    BARK_CHECK_EQ(report.expired, 3u);
+    simulation.clock()->sleepFor(seconds(1));
+    BARK_CHECK_EQ(backend->leaseTokens(5), 1u);
+}
+
+static void testFullQueueExpiresWholeBuckets()
+{
+    auto clock = std::make_shared<BarkVirtualClock>();
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    options.max_queue_size = 4;
+    options.clock = clock;
+    BarkDispatcher dispatcher("", options);
+
+    auto expiring = [&](const std::string &body, std::chrono::milliseconds ttl)
+    {
+        BarkNotification notification = barkTestNotification("key", body);
+        notification.expires_at = clock->now() + ttl;
+        return notification;
+    };
+    BARK_CHECK(dispatcher.enqueue(barkTestNotification("key", "first")));
+    BARK_CHECK(dispatcher.enqueue(expiring("short", milliseconds(500))));
+    BARK_CHECK(dispatcher.enqueue(expiring("later", seconds(5))));
+    BARK_CHECK(dispatcher.enqueue(expiring("same second", milliseconds(1200))));
+    BARK_CHECK(!dispatcher.enqueue(barkTestNotification("key", "rejected")));
+
+    // Only the bucket that ended before the current second is expired; the
+    // notification expiring later in the same second stays until taken.
+    clock->sleepFor(milliseconds(1500));
+    BARK_CHECK(dispatcher.enqueue(barkTestNotification("key", "fifth")));
+    BARK_CHECK(!dispatcher.enqueue(barkTestNotification("key", "full again")));
+    BARK_CHECK_EQ(dispatcher.getStats().expired, 1u);
+    BARK_CHECK_EQ(dispatcher.pendingCount(), 4u);
+
+    std::vector<BarkNotification> pending;
+    dispatcher.takePending(pending);
+    BARK_CHECK_EQ(dispatcher.getStats().expired, 2u);
+    BARK_CHECK_EQ(pending.size(), 3u);
+    if (pending.size() == 3)
+    {
+        BARK_CHECK_EQ(pending[0].body, "first");
+        BARK_CHECK_EQ(pending[1].body, "later");
+        BARK_CHECK_EQ(pending[2].body, "fifth");
+    }
+    BARK_CHECK_EQ(dispatcher.queuedBytes(), 0u);
+}
+
+static void testTombstonesBehindHeadAreCompacted()
+{
+    auto clock = std::make_shared<BarkVirtualClock>();
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    options.max_queue_size = 4;
+    options.max_batch_size = 1;
+    options.clock = clock;
+    BarkDispatcher dispatcher("", options);
+
+    BARK_CHECK(dispatcher.enqueue(barkTestNotification("key", "head")));
+    for (int round = 0; round < 10; ++round)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            BarkNotification notification = barkTestNotification("key", "round " + std::to_string(round));
+            notification.params["n"] = std::to_string(i);
+            notification.expires_at = clock->now() + milliseconds(500);
+            BARK_CHECK(dispatcher.enqueue(notification));
+        }
+        clock->sleepFor(seconds(1));
+    }
+    BARK_CHECK_EQ(dispatcher.getStats().expired, 27u);
+    BARK_CHECK_EQ(dispatcher.pendingCount(), 4u);
+
+    std::vector<BarkNotification> pending;
+    dispatcher.takePending(pending);
+    BARK_CHECK_EQ(pending.size(), 1u);
+    if (!pending.empty())
+        BARK_CHECK_EQ(pending[0].body, "head");
+    BARK_CHECK_EQ(dispatcher.getStats().expired, 30u);
+    BARK_CHECK_EQ(dispatcher.queuedBytes(), 0u);
+}
+
+static BarkBenchServer &server()
+{
+    static BarkBenchServer instance;
+    return instance;
+}
+
+static void testSendManySkipsExpired()
+{
+    BarkPush push(std::vector<std::string>(), server().url());
+    uint64_t before = server().requests();
+    BarkNotification stale = barkTestNotification("a", "stale");
+    stale.expires_at = std::chrono::steady_clock::now() - std::chrono::milliseconds(1);
+    BarkNotification fresh = barkTestNotification("a", "fresh");
+    fresh.expires_at = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+
+    std::vector<BarkError> results = push.sendMany({stale, fresh});
+    BARK_CHECK_EQ(results[0], BarkError::EXPIRED);
+    BARK_CHECK_EQ(results[1], BarkError::SUCCESS);
+    BARK_CHECK_EQ(server().requests() - before, 1u);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"expired group counts every notification", testExpiredGroupCountsEveryNotification},
+        {"expired notifications are dropped from the queue", testExpiredInQueue},
+        {"ttl leaves live notifications alone", testTtlLeavesLiveNotificationsAlone},
+        {"expired requests take no limiter tokens", testLimiterExpiryDoesNotTakeTokens},
+        {"full queue expires whole buckets", testFullQueueExpiresWholeBuckets},
+        {"tombstones behind the head are compacted", testTombstonesBehindHeadAreCompacted},
+        {"sendMany skips expired notifications", testSendManySkipsExpired},
+    });
+}
@@ -0,0 +1,250 @@
+// Relay handoff: the portable notification form and the transfer of queued
+// notifications and the listening socket between two bark_proxy instances.
+//
+//   g++ -std=c++17 -I.. -I../bench test_handoff.cpp -o test_handoff -lcurl -pthread
+//   ./test_handoff
+
+// The test programs use only part of the tool.
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define BARK_PROXY_NO_MAIN
+#include "tools/bark_proxy.cpp"
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+using std::chrono::milliseconds;
+
+static BarkNotification sample()
+{
+    BarkNotification n;
+    n.device_keys = {"compactKeyA", "compactKeyB"};
+    n.title = "Backup";
+    n.body = std::string("nightly backup finished\n\0binary", 32);
+    n.params = {{"compactGroup", "ops"}, {"level", "passive"}, {"url", "https://example.com/a?b=c"}};
+    return n;
+}
+
+static bool sameContent(const BarkNotification &a, const BarkNotification &b)
+{
+    return a.device_keys == b.device_keys && a.title == b.title && a.body == b.body && a.params == b.params;
+}
+
+static void testPortableRoundTrip()
+{
+    BarkClock::time_point now = BarkSteadyClock::instance()->now();
+    BarkNotification original = sample();
+    original.expires_at = now + std::chrono::seconds(3);
+    BARK_CHECK(BarkSpanContext::fromTraceparent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01",
+                                                original.trace));
+
+    std::string wire = "prefix";
+    BarkCompactNotification::serialize(original, now, wire);
+    BarkCompactNotification::serialize(BarkNotification(), now, wire);
+
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(wire.data()) + 6;
+    const uint8_t *end = reinterpret_cast<const uint8_t *>(wire.data()) + wire.size();
+    BarkClock::time_point later = now + std::chrono::seconds(10);
+    BarkNotification decoded;
+    BARK_CHECK(BarkCompactNotification::deserialize(in, end, later, decoded));
+    BARK_CHECK(sameContent(original, decoded));
+    BARK_CHECK(decoded.expires_at == later + std::chrono::seconds(3));
+    BARK_CHECK_EQ(decoded.trace.traceparent(), original.trace.traceparent());
+
+    BARK_CHECK(BarkCompactNotification::deserialize(in, end, later, decoded));
+    BARK_CHECK(in == end);
+    BARK_CHECK(decoded.device_keys.empty() && decoded.params.empty() && decoded.body.empty());
+    BARK_CHECK(decoded.expires_at == BarkClock::time_point());
+    BARK_CHECK(!decoded.trace.valid());
+}
+
+static void testPortableKeepsPastDeadlineExpired()
+{
+    BarkClock::time_point now = BarkSteadyClock::instance()->now();
+    BarkNotification original = sample();
+    original.expires_at = now - std::chrono::seconds(1);
+    std::string wire;
+    BarkCompactNotification::serialize(original, now, wire);
+
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(wire.data());
+    BarkNotification decoded;
+    BARK_CHECK(BarkCompactNotification::deserialize(in, in + wire.size(), now, decoded));
+    BARK_CHECK(decoded.expires_at != BarkClock::time_point());
+    BARK_CHECK(decoded.expires_at <= now + std::chrono::microseconds(1));
+}
+
+static void testPortableRejectsTruncation()
+{
+    BarkClock::time_point now = BarkSteadyClock::instance()->now();
+    BarkNotification original = sample();
+    BarkSpanContext::fromTraceparent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01", original.trace);
+    std::string wire;
+    BarkCompactNotification::serialize(original, now, wire);
+
+    size_t accepted = 0;
+    for (size_t length = 0; length < wire.size(); ++length)
+    {
+        std::string prefix = wire.substr(0, length);
+        const uint8_t *in = reinterpret_cast<const uint8_t *>(prefix.data());
+        BarkNotification decoded;
+        accepted += BarkCompactNotification::deserialize(in, in + prefix.size(), now, decoded) ? 1 : 0;
+    }
+    BARK_CHECK_EQ(accepted, 0u);
+
+    std::string huge_count(1, '\xff');
+    huge_count += std::string(9, '\x7f');
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(huge_count.data());
+    BarkNotification decoded;
+    BARK_CHECK(!BarkCompactNotification::deserialize(in, in + huge_count.size(), now, decoded));
+}
+
+static BarkDispatcherOptions manualOptions(size_t max_queue_size = 100)
+{
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    options.max_queue_size = max_queue_size;
+    return options;
+}
+
+static std::vector<BarkNotification> drain(BarkDispatcher &dispatcher)
+{
+    std::vector<BarkNotification> pending;
+    dispatcher.takePending(pending);
+    return pending;
+}
+
+static BarkNotification queued(const std::string &key, const std::string &body)
+{
+    BarkNotification n;
+    n.device_keys = {key};
+    n.title = "Handoff";
+    n.body = body;
+    n.params = {{"group", "handoff"}};
+    return n;
+}
+
+static void testPendingTransfer()
+{
+    int channels[2];
+    BARK_CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channels) == 0);
+
+    BarkDispatcher next("", manualOptions(2));
+    bool received = false;
+    std::thread receiver([&]() { received = receivePending(channels[1], next); });
+
+    std::vector<BarkNotification> pending = {queued("a", "first"), queued("b", "second"), queued("c", "third")};
+    pending[0].expires_at = BarkSteadyClock::instance()->now() + std::chrono::seconds(30);
+    BarkSpanContext::fromTraceparent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01", pending[1].trace);
+    char ready = 0;
+    BARK_CHECK(readAll(channels[0], &ready, 1) && ready == 'R');
+    std::vector<BarkNotification> refused;
+    BARK_CHECK(sendPending(channels[0], pending, refused));
+    receiver.join();
+    close(channels[0]);
+    close(channels[1]);
+
+    BARK_CHECK(received);
+    BARK_CHECK_EQ(refused.size(), 1u);
+    if (!refused.empty())
+        BARK_CHECK_EQ(refused[0].body, "third");
+    std::vector<BarkNotification> taken = drain(next);
+    BARK_CHECK_EQ(taken.size(), 2u);
+    if (taken.size() != 2)
+        return;
+    BARK_CHECK_EQ(taken[0].body, "first");
+    BARK_CHECK(taken[0].expires_at > BarkSteadyClock::instance()->now() + std::chrono::seconds(25));
+    BARK_CHECK_EQ(taken[1].params["group"], "handoff");
+    BARK_CHECK_EQ(taken[1].trace.traceparent(), "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+}
+
+static void testMalformedTransferNotAcked()
+{
+    int channels[2];
+    BARK_CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channels) == 0);
+
+    BarkDispatcher next("", manualOptions());
+    bool received = true;
+    std::thread receiver([&]()
+    {
+        received = receivePending(channels[1], next);
+        close(channels[1]);
+    });
+
+    std::string good;
+    BarkCompactNotification::serialize(queued("a", "good"), BarkSteadyClock::instance()->now(), good);
+    char ready = 0;
+    uint32_t count = 2;
+    uint32_t good_size = static_cast<uint32_t>(good.size());
+    uint32_t bad_size = 3;
+    BARK_CHECK(readAll(channels[0], &ready, 1));
+    BARK_CHECK(writeAll(channels[0], &count, sizeof(count)) && writeAll(channels[0], &good_size, sizeof(good_size)) &&
+               writeAll(channels[0], good.data(), good.size()) && writeAll(channels[0], &bad_size, sizeof(bad_size)) &&
+               writeAll(channels[0], "\x05zz", 3));
+    receiver.join();
+    char ack = 0;
+    BARK_CHECK(!readAll(channels[0], &ack, 1));
+    close(channels[0]);
+
+    BARK_CHECK(!received);
+    BARK_CHECK_EQ(next.pendingCount(), 0u);
+}
+
+static void testHandoffBetweenInstances()
+{
+    std::string path = "/tmp/bark_proxy_test." + std::to_string(getpid()) + ".sock";
+    uint16_t port = 0;
+    int listen_fd = barkBenchListen(port);
+
+    BarkDispatcher previous("", manualOptions());
+    for (int i = 0; i < 5; ++i)
+        previous.enqueue(queued("k" + std::to_string(i), "queued " + std::to_string(i)));
+    ConnectionRegistry registry;
+    std::atomic<bool> accepting(true);
+    std::thread handoff(serveHandoff, path, -1, listen_fd, std::ref(previous), std::ref(registry),
+                        std::ref(accepting));
+
+    int channel = -1;
+    for (int attempt = 0; attempt < 200 && channel < 0; ++attempt)
+    {
+        channel = connectUnix(path);
+        if (channel < 0)
+            std::this_thread::sleep_for(milliseconds(5));
+    }
+    BARK_CHECK(channel >= 0);
+    int inherited = channel >= 0 ? receiveListenFd(channel) : -1;
+    BARK_CHECK(inherited >= 0);
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (inherited >= 0 && getsockname(inherited, reinterpret_cast<sockaddr *>(&address), &length) == 0)
+        BARK_CHECK_EQ(ntohs(address.sin_port), port);
+
+    BarkDispatcher next("", manualOptions(3));
+    BARK_CHECK(channel >= 0 && receivePending(channel, next));
+    if (channel >= 0)
+        close(channel);
+    handoff.join();
+
+    BARK_CHECK(!accepting);
+    BARK_CHECK_EQ(next.pendingCount(), 3u);
+    std::vector<BarkNotification> kept = drain(previous);
+    BARK_CHECK_EQ(kept.size(), 2u);
+    if (kept.size() == 2)
+        BARK_CHECK_EQ(kept[1].body, "queued 4");
+
+    if (inherited >= 0)
+        close(inherited);
+    close(listen_fd);
+    unlink(path.c_str());
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    return barkRunTests({
+        {"portable form round trip", testPortableRoundTrip},
+        {"portable form keeps past deadlines expired", testPortableKeepsPastDeadlineExpired},
+        {"portable form rejects truncation", testPortableRejectsTruncation},
+        {"pending transfer with refusals", testPendingTransfer},
+        {"malformed transfer is not acked", testMalformedTransferNotAcked},
+        {"handoff between instances", testHandoffBetweenInstances},
+    });
+}
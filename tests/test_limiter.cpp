@@ -0,0 +1,327 @@
+// Rate-limit and dedup backends: the local stand-in, leased limiters sharing one
+// backend, the shared-memory segment's initialization, and duplicate
+// suppression in the dispatcher and in send().
+//
+//   g++ -std=c++17 -I.. -I../bench test_limiter.cpp -o test_limiter -lcurl -pthread
+//   ./test_limiter
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+#include <sys/wait.h>
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+static void testLimiterSuppressesDuplicates()
+{
+    BarkSimulation simulation;
+    simulation.schedule(milliseconds(0), barkTestNotification("key", "deploy done"));
+    simulation.schedule(seconds(1), barkTestNotification("key", "deploy done"));
+    simulation.schedule(seconds(1), barkTestNotification("other", "deploy done"));
+    simulation.schedule(seconds(90), barkTestNotification("key", "deploy done"));
+
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = seconds(60);
+    limit.clock = simulation.clock();
+    BarkDispatcherOptions options;
+    options.limiter = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.suppressed, 1u);
+    BARK_CHECK_EQ(report.requests, 3u);
+}
+
+static void testLimiterTokensPaceRequests()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 10; ++i)
+        simulation.schedule(milliseconds(0), barkTestNotification("key", "event " + std::to_string(i)));
+
+    BarkLocalLimitOptions limit;
+    limit.requests_per_second = 4.0;
+    limit.burst = 2.0;
+    limit.clock = simulation.clock();
+    BarkDispatcherOptions options;
+    options.limiter = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.requests, 10u);
+    double seconds_taken = std::chrono::duration<double>(report.simulated_time).count();
+    BARK_CHECK(seconds_taken >= 1.9 && seconds_taken < 2.2);
+}
+
+static void testLeasedLimitersShareDedup()
+{
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = seconds(60);
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkLeasedLimiterOptions lease;
+    lease.dedup_window = seconds(60);
+
+    BarkSimulation first;
+    first.schedule(milliseconds(0), barkTestNotification("key", "fleet"));
+    BarkDispatcherOptions options;
+    options.limiter = std::make_shared<BarkLeasedLimiter>(backend, lease);
+    BarkRecordingServer server;
+    BarkSimulationReport report = first.run(options, server.handler());
+    BARK_CHECK_EQ(report.requests, 1u);
+
+    // The first limiter flushed its marks when it was destroyed. The second
+    // answers from its own state and only learns of the duplicate when it
+    // flushes.
+    BarkSimulation second;
+    second.schedule(milliseconds(0), barkTestNotification("key", "fleet"));
+    second.schedule(milliseconds(0), barkTestNotification("key", "other"));
+    second.schedule(milliseconds(0), barkTestNotification("key", "other"));
+    auto leased = std::make_shared<BarkLeasedLimiter>(backend, lease);
+    options.limiter = leased;
+    report = second.run(options, server.handler());
+    BARK_CHECK_EQ(report.suppressed, 1u);
+    BARK_CHECK_EQ(report.requests, 2u);
+    BARK_CHECK_EQ(server.requests.size(), 3u);
+    leased->flush();
+    BARK_CHECK_EQ(leased->remoteDuplicates(), 1u);
+}
+
+static BarkLeasedLimiterOptions quietLease(size_t lease_size)
+{
+    BarkLeasedLimiterOptions lease;
+    lease.lease_size = lease_size;
+    lease.dedup_window = seconds(60);
+    lease.flush_interval = milliseconds(60000);
+    return lease;
+}
+
+static void testLeasedDedupDefersRemoteCalls()
+{
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = seconds(60);
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+    uint64_t hashes[3] = {barkHash("a"), barkHash("b"), barkHash("c")};
+    bool fresh[3] = {false, false, false};
+    {
+        BarkLeasedLimiter leased(backend, quietLease(64));
+        uint64_t trips = backend->roundTrips();
+        leased.checkAndMarkMany(hashes, 3, fresh);
+        BARK_CHECK(fresh[0] && fresh[1] && fresh[2]);
+        leased.checkAndMarkMany(hashes, 3, fresh);
+        BARK_CHECK(!fresh[0] && !fresh[1] && !fresh[2]);
+        leased.forgetMany(hashes, 1);
+        BARK_CHECK_EQ(backend->roundTrips(), trips);
+
+        // The forgotten mark never reaches the backend; the other two are
+        // written in one batch.
+        leased.flush();
+        BARK_CHECK_EQ(backend->roundTrips() - trips, 1u);
+        leased.forgetMany(hashes + 1, 1);
+    }
+    backend->checkAndMarkMany(hashes, 3, fresh);
+    BARK_CHECK(fresh[0] && fresh[1] && !fresh[2]);
+}
+
+static void testLeasedDedupFlushesFullBatch()
+{
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = seconds(60);
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkLeasedLimiter leased(backend, quietLease(4));
+    uint64_t trips = backend->roundTrips();
+    uint64_t hashes[4] = {barkHash("a"), barkHash("b"), barkHash("c"), barkHash("d")};
+    bool fresh[4];
+    leased.checkAndMarkMany(hashes, 4, fresh);
+    for (int i = 0; i < 100 && backend->roundTrips() == trips; ++i)
+        std::this_thread::sleep_for(milliseconds(10));
+    BARK_CHECK(backend->roundTrips() > trips);
+    backend->checkAndMarkMany(hashes, 4, fresh);
+    BARK_CHECK(!fresh[0] && !fresh[3]);
+}
+
+static void testLeasedLimitersShareTokens()
+{
+    BarkLocalLimitOptions limit;
+    limit.requests_per_second = 1e-6;
+    limit.burst = 100.0;
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkLeasedLimiterOptions lease;
+    lease.lease_size = 64;
+
+    size_t granted = 0;
+    {
+        BarkLeasedLimiter a(backend, lease);
+        BarkLeasedLimiter b(backend, lease);
+        BARK_CHECK_EQ(a.localTokens(), 64u);
+        BARK_CHECK_EQ(b.localTokens(), 36u);
+        for (int round = 0; round < 5; ++round)
+        {
+            granted += a.leaseTokens(50);
+            granted += b.leaseTokens(50);
+            std::this_thread::sleep_for(milliseconds(20));
+        }
+        granted += a.localTokens() + b.localTokens();
+    }
+    BARK_CHECK_EQ(granted, 100u);
+    BARK_CHECK_EQ(backend->leaseTokens(1), 0u);
+}
+
+static void testForgetClearsMarks()
+{
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = seconds(60);
+    BarkLocalLimitBackend backend(limit);
+    uint64_t hashes[2] = {barkHash("a"), barkHash("b")};
+    bool fresh[2] = {false, false};
+
+    backend.checkAndMarkMany(hashes, 2, fresh);
+    BARK_CHECK(fresh[0] && fresh[1]);
+    backend.checkAndMarkMany(hashes, 2, fresh);
+    BARK_CHECK(!fresh[0] && !fresh[1]);
+    backend.forgetMany(hashes, 1);
+    backend.checkAndMarkMany(hashes, 2, fresh);
+    BARK_CHECK(fresh[0] && !fresh[1]);
+}
+
+// The segment starts with the state word, the lock flag and the robust
+// init lock. Creates it as a process part way through initialization would
+// have left it, claimed by claimant.
+static std::string claimedSegment(const std::string &suffix, pid_t claimant)
+{
+    std::string name = "/bark_test_" + suffix + "_" + std::to_string(getpid());
+    BarkSharedLimiter::unlink(name);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    BARK_CHECK(fd >= 0 && ftruncate(fd, 4096) == 0);
+    void *mapping = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    static_cast<std::atomic<uint32_t> *>(mapping)->store(static_cast<uint32_t>(claimant));
+    munmap(mapping, 4096);
+    return name;
+}
+
+static BarkSharedLimiterOptions sharedOptions()
+{
+    BarkSharedLimiterOptions options;
+    options.requests_per_second = 100.0;
+    options.dedup_window = seconds(60);
+    options.dedup_slots = 16;
+    return options;
+}
+
+static void testSharedLimiterWaitsForLiveOwner()
+{
+    pid_t owner = fork();
+    if (owner == 0)
+    {
+        pause();
+        _exit(0);
+    }
+    std::string name = claimedSegment("live", owner);
+    std::atomic<bool> opened(false);
+    std::thread opener([&]()
+    {
+        BarkSharedLimiter limiter(name, sharedOptions());
+        opened = limiter.checkAndMark(barkHash("first"));
+    });
+    // Longer than the old two second takeover deadline.
+    std::this_thread::sleep_for(milliseconds(2500));
+    BARK_CHECK(!opened.load());
+    kill(owner, SIGKILL);
+    waitpid(owner, nullptr, 0);
+    opener.join();
+    BARK_CHECK(opened.load());
+    BarkSharedLimiter::unlink(name);
+}
+
+static void testSharedLimiterTakesOverFromDeadLockHolder()
+{
+    // The claim names this live process, as a recycled pid would, but the
+    // process holding the init lock dies.
+    std::string name = claimedSegment("robust", getpid());
+    pid_t holder = fork();
+    if (holder == 0)
+    {
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        char *segment = static_cast<char *>(mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_t *lock = reinterpret_cast<pthread_mutex_t *>(segment + 8);
+        pthread_mutex_init(lock, &attributes);
+        pthread_mutex_lock(lock);
+        reinterpret_cast<std::atomic<uint32_t> *>(segment + 4)->store(1);
+        _exit(0);
+    }
+    waitpid(holder, nullptr, 0);
+    BarkSharedLimiter limiter(name, sharedOptions());
+    BARK_CHECK(limiter.checkAndMark(barkHash("first")));
+    BARK_CHECK(!limiter.checkAndMark(barkHash("first")));
+    BarkSharedLimiter::unlink(name);
+}
+
+static void testSharedLimiterReportsMismatch()
+{
+    std::string name = "/bark_test_mismatch_" + std::to_string(getpid());
+    BarkSharedLimiter::unlink(name);
+    BarkSharedLimiter first(name, sharedOptions());
+    BarkSharedLimiter same(name, sharedOptions());
+
+    BarkSharedLimiterOptions other = sharedOptions();
+    other.requests_per_second = 50.0;
+    other.dedup_slots = 32;
+    std::string error;
+    try
+    {
+        BarkSharedLimiter mismatched(name, other);
+    }
+    catch (const std::runtime_error &e)
+    {
+        error = e.what();
+    }
+    BARK_CHECK(error.find("requests_per_second, dedup_slots") != std::string::npos);
+    BarkSharedLimiter::unlink(name);
+}
+
+static BarkBenchServer &server()
+{
+    static BarkBenchServer instance;
+    return instance;
+}
+
+static std::shared_ptr<BarkLocalLimitBackend> limiter(double burst)
+{
+    BarkLocalLimitOptions options;
+    options.requests_per_second = 1e-6;
+    options.burst = burst;
+    options.dedup_window = std::chrono::seconds(60);
+    return std::make_shared<BarkLocalLimitBackend>(options);
+}
+
+static void testSendSuppressesDuplicates()
+{
+    BarkPush push("solo", server().url());
+    push.setLimiter(limiter(10.0));
+    uint64_t before = server().requests();
+    BARK_CHECK_EQ(push.send("Alert", "once"), BarkError::SUCCESS);
+    BARK_CHECK_EQ(push.send("Alert", "once"), BarkError::DUPLICATE_SUPPRESSED);
+    BARK_CHECK_EQ(push.send("Alert", "twice"), BarkError::SUCCESS);
+    BARK_CHECK_EQ(server().requests() - before, 2u);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"limiter suppresses duplicates", testLimiterSuppressesDuplicates},
+        {"limiter tokens pace requests", testLimiterTokensPaceRequests},
+        {"leased limiters share dedup", testLeasedLimitersShareDedup},
+        {"leased limiters share tokens", testLeasedLimitersShareTokens},
+        {"leased dedup defers remote calls", testLeasedDedupDefersRemoteCalls},
+        {"leased dedup flushes a full batch", testLeasedDedupFlushesFullBatch},
+        {"forgetMany clears marks", testForgetClearsMarks},
+        {"shared limiter waits for a live owner", testSharedLimiterWaitsForLiveOwner},
+        {"shared limiter takes over from a dead lock holder", testSharedLimiterTakesOverFromDeadLockHolder},
+        {"shared limiter reports mismatched options", testSharedLimiterReportsMismatch},
+        {"send suppresses duplicates", testSendSuppressesDuplicates},
+    });
+}
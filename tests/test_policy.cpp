@@ -0,0 +1,110 @@
+// BasicBarkPush policy configurations: the dedup hash, metrics and trace
+// spans they share with BarkPush.
+//
+//   g++ -std=c++17 -I.. -I../bench test_policy.cpp -o test_policy -lcurl -pthread
+//   ./test_policy
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+static BarkBenchServer &server()
+{
+    static BarkBenchServer instance;
+    return instance;
+}
+
+// Accepts every request and keeps the traceparent header it was given.
+struct TracedTransport
+{
+    std::vector<std::string> trace_headers;
+
+    BarkError post(const std::string &, const std::string &, long &http_status, std::string &response,
+                   std::string &, const std::string *trace_header)
+    {
+        trace_headers.push_back(trace_header ? *trace_header : std::string());
+        http_status = 200;
+        response = "{\"code\":200}";
+        return BarkError::SUCCESS;
+    }
+};
+
+struct CollectingExporter : BarkSpanExporter
+{
+    std::vector<BarkSpan> spans;
+
+    void exportSpans(const std::vector<BarkSpan> &batch) override
+    {
+        spans.insert(spans.end(), batch.begin(), batch.end());
+    }
+};
+
+static void testDedupHashMatchesBarkPush()
+{
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = std::chrono::seconds(60);
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+
+    BarkPush push(std::vector<std::string>{"k1", "k2"}, server().url());
+    push.setLimiter(backend);
+    BARK_CHECK_EQ(push.send("Alert", "shared", {{"group", "ops"}}), BarkError::SUCCESS);
+
+    BasicBarkPush<BarkCurlTransport, BarkNoRetry, BarkBackendLimit> policy({"k1", "k2"}, server().url(),
+                                                                           BarkCurlTransport(),
+                                                                           BarkBackendLimit(backend));
+    BARK_CHECK_EQ(policy.send("Alert", "shared", {{"group", "ops"}}), BarkError::DUPLICATE_SUPPRESSED);
+    BARK_CHECK_EQ(policy.send("Alert", "other", {{"group", "ops"}}), BarkError::SUCCESS);
+}
+
+static void testSendsRecordMetrics()
+{
+    BarkMetrics &metrics = BarkMetrics::instance();
+    metrics.enable();
+    BarkMetrics::Snapshot before = metrics.collect();
+    BasicBarkPush<> push({"metered"}, server().url());
+    BARK_CHECK_EQ(push.send("Alert", "counted"), BarkError::SUCCESS);
+    BarkMetrics::Snapshot after = metrics.collect();
+    metrics.enable(false);
+
+    BARK_CHECK_EQ(after.counters[BarkMetrics::SENDS] - before.counters[BarkMetrics::SENDS], 1u);
+    BARK_CHECK_EQ(after.counters[BarkMetrics::FAILURES] - before.counters[BarkMetrics::FAILURES], 0u);
+    BARK_CHECK_EQ(after.histograms[BarkMetrics::SEND_LATENCY_US].count -
+                  before.histograms[BarkMetrics::SEND_LATENCY_US].count, 1u);
+}
+
+static void testSendsEmitSpansAndPropagate()
+{
+    auto exporter = std::make_shared<CollectingExporter>();
+    BarkTracerOptions options;
+    options.batch_size = 1;
+    BasicBarkPush<TracedTransport> push({"a", "b"}, server().url());
+    push.setTracer(std::make_shared<BarkTracer>(exporter, options));
+    BARK_CHECK_EQ(push.send("Alert", "traced"), BarkError::SUCCESS);
+
+    BARK_CHECK_EQ(exporter->spans.size(), 1u);
+    BARK_CHECK_EQ(push.transport().trace_headers.size(), 1u);
+    if (exporter->spans.empty() || push.transport().trace_headers.empty())
+        return;
+    const BarkSpan &span = exporter->spans[0];
+    BARK_CHECK_EQ(span.device_count, 2u);
+    BARK_CHECK_EQ(span.http_status, 200);
+    BARK_CHECK(span.endpoint.find("/push") != std::string::npos);
+    BARK_CHECK_EQ(push.transport().trace_headers[0], "traceparent: " + span.context.traceparent());
+
+    // Without a tracer the parent is still propagated.
+    BasicBarkPush<TracedTransport> untraced({"a"}, server().url());
+    const std::string traceparent = "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01";
+    BarkSpanContext parent;
+    BARK_CHECK(BarkSpanContext::fromTraceparent(traceparent, parent));
+    untraced.setTraceParent(parent);
+    untraced.send("Alert", "propagated");
+    BARK_CHECK(untraced.transport().trace_headers == std::vector<std::string>{"traceparent: " + traceparent});
+}
+
+int main()
+{
+    return barkRunTests({
+        {"dedup hash matches BarkPush", testDedupHashMatchesBarkPush},
+        {"sends record metrics", testSendsRecordMetrics},
+        {"sends emit spans and propagate the trace", testSendsEmitSpansAndPropagate},
+    });
+}
@@ -0,0 +1,133 @@
+// Prepared notifications: the cached payload tail streamed behind the keys
+// fragment, including the rewind when libcurl retries a request whose reused
+// connection was closed by the server.
+//
+//   g++ -std=c++17 -I.. -I../bench test_prepared.cpp -o test_prepared -lcurl -pthread
+//   ./test_prepared
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+// Answers the first request on each connection and closes the connection
+// after reading the second one, like a server dropping an idle keep-alive
+// connection just as the client reuses it.
+class DroppingServer
+{
+private:
+    int listen_fd_;
+    uint16_t port_;
+    std::atomic<bool> stopping_;
+    std::atomic<int> answered_;
+    std::vector<std::string> bodies_;
+    std::mutex mutex_;
+    std::thread acceptor_;
+
+    static bool readRequest(int fd, std::string &buffer, std::string &body)
+    {
+        char chunk[4096];
+        size_t header_end;
+        while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos ||
+               buffer.size() < header_end + 4 + contentLength(buffer, header_end))
+        {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+        size_t length = contentLength(buffer, header_end);
+        body = buffer.substr(header_end + 4, length);
+        buffer.erase(0, header_end + 4 + length);
+        return true;
+    }
+
+    static size_t contentLength(const std::string &buffer, size_t header_end)
+    {
+        size_t at = buffer.find("Content-Length: ");
+        return at == std::string::npos || at > header_end ? 0 : std::strtoul(buffer.c_str() + at + 16, nullptr, 10);
+    }
+
+    void acceptLoop()
+    {
+        static const std::string body = "{\"code\":200,\"message\":\"success\",\"timestamp\":1}";
+        const std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                                     std::to_string(body.size()) + "\r\n\r\n" + body;
+        while (!stopping_.load())
+        {
+            pollfd entry{listen_fd_, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            std::string buffer;
+            std::string request;
+            if (readRequest(fd, buffer, request))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    bodies_.push_back(request);
+                }
+                ++answered_;
+                barkBenchWriteAll(fd, response.data(), response.size());
+                readRequest(fd, buffer, request);
+            }
+            close(fd);
+        }
+    }
+
+public:
+    DroppingServer() : listen_fd_(barkBenchListen(port_)), stopping_(false), answered_(0)
+    {
+        acceptor_ = std::thread(&DroppingServer::acceptLoop, this);
+    }
+
+    ~DroppingServer()
+    {
+        stopping_ = true;
+        acceptor_.join();
+        close(listen_fd_);
+    }
+
+    std::string url() const
+    {
+        return "http://127.0.0.1:" + std::to_string(port_) + "/";
+    }
+
+    int answered() const
+    {
+        return answered_.load();
+    }
+
+    std::vector<std::string> bodies()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bodies_;
+    }
+};
+
+static void testPreparedSendRewindsOnRetry()
+{
+    DroppingServer server;
+    BarkPush push("rewind", server.url());
+    BarkPreparedNotification prepared = BarkPush::prepare("Alert", "streamed body");
+
+    BARK_CHECK_EQ(push.send(prepared), BarkError::SUCCESS);
+    BARK_CHECK_EQ(push.send(prepared), BarkError::SUCCESS);
+    BARK_CHECK_EQ(server.answered(), 2);
+
+    std::vector<std::string> bodies = server.bodies();
+    BARK_CHECK_EQ(bodies.size(), 2u);
+    if (bodies.size() == 2)
+    {
+        BARK_CHECK_EQ(bodies[1], bodies[0]);
+        BARK_CHECK(bodies[0].find("\"device_keys\":[\"rewind\"]") != std::string::npos);
+        BARK_CHECK(bodies[0].find("streamed body") != std::string::npos);
+    }
+}
+
+int main()
+{
+    return barkRunTests({
+        {"prepared send rewinds on retry", testPreparedSendRewindsOnRetry},
+    });
+}
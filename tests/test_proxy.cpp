@@ -0,0 +1,352 @@
+// bark_proxy over loopback: request parsing through serveConnection for the
+// path, JSON and form request styles, and the queue limit. Also the batches
+// the dispatcher behind it sends: leased tokens, dedup marks and traces of
+// merged notifications, and the coalescing window.
+//
+//   g++ -std=c++17 -I.. -I../bench test_proxy.cpp -o test_proxy -lcurl -pthread
+//   ./test_proxy
+
+// The test programs use only part of the tool.
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define BARK_PROXY_NO_MAIN
+#include "tools/bark_proxy.cpp"
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+using std::chrono::milliseconds;
+
+class ProxyConnection
+{
+private:
+    int client_fd_;
+    std::thread server_;
+
+public:
+    ProxyConnection(BarkDispatcher &dispatcher, ConnectionRegistry &registry) : client_fd_(-1)
+    {
+        uint16_t port = 0;
+        int listen_fd = barkBenchListen(port);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        client_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        connect(client_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        int server_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        close(listen_fd);
+        server_ = std::thread(serveConnection, server_fd, std::ref(dispatcher), std::ref(registry));
+    }
+
+    ~ProxyConnection()
+    {
+        shutdown(client_fd_, SHUT_RDWR);
+        server_.join();
+        close(client_fd_);
+    }
+
+    // Returns the response status, or 0 when the proxy closed the connection.
+    int exchange(const std::string &request, std::string *body = nullptr)
+    {
+        if (!writeAll(client_fd_, request.data(), request.size()))
+            return 0;
+        std::string response;
+        size_t header_end;
+        char chunk[4096];
+        while ((header_end = response.find("\r\n\r\n")) == std::string::npos)
+        {
+            ssize_t n = recv(client_fd_, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return 0;
+            response.append(chunk, static_cast<size_t>(n));
+        }
+        size_t length_at = response.find("Content-Length: ");
+        size_t length = length_at == std::string::npos ? 0 : std::strtoul(response.c_str() + length_at + 16, nullptr, 10);
+        while (response.size() < header_end + 4 + length)
+        {
+            ssize_t n = recv(client_fd_, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return 0;
+            response.append(chunk, static_cast<size_t>(n));
+        }
+        if (body)
+            *body = response.substr(header_end + 4, length);
+        return std::atoi(response.c_str() + response.find(' ') + 1);
+    }
+
+    bool closedByPeer()
+    {
+        char byte = 0;
+        return recv(client_fd_, &byte, 1, 0) == 0;
+    }
+};
+
+static std::string post(const std::string &target, const std::string &body,
+                        const std::string &content_type = "application/json", const std::string &extra = "")
+{
+    return "POST " + target + " HTTP/1.1\r\nHost: proxy\r\nContent-Type: " + content_type +
+           "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + extra + "\r\n" + body;
+}
+
+static BarkDispatcherOptions manualOptions(size_t max_queue_size = 100)
+{
+    BarkDispatcherOptions options;
+    options.manual_pump = true;
+    options.max_queue_size = max_queue_size;
+    return options;
+}
+
+static std::vector<BarkNotification> drain(BarkDispatcher &dispatcher)
+{
+    std::vector<BarkNotification> pending;
+    dispatcher.takePending(pending);
+    return pending;
+}
+
+static void testPathRequest()
+{
+    BarkDispatcher dispatcher("", manualOptions());
+    ConnectionRegistry registry;
+    ProxyConnection connection(dispatcher, registry);
+
+    std::string body;
+    BARK_CHECK_EQ(connection.exchange("GET /push/key1/Build/done%20in+4m?group=ci&sound=bell HTTP/1.1\r\n"
+                                      "Host: proxy\r\n\r\n", &body), 200);
+    BARK_CHECK(body.find("\"success\"") != std::string::npos);
+    BARK_CHECK_EQ(connection.exchange("GET /key2/only%2Fbody HTTP/1.1\r\nHost: proxy\r\n\r\n"), 200);
+
+    std::vector<BarkNotification> pending = drain(dispatcher);
+    BARK_CHECK_EQ(pending.size(), 2u);
+    if (pending.size() != 2)
+        return;
+    BARK_CHECK(pending[0].device_keys == std::vector<std::string>{"key1"});
+    BARK_CHECK_EQ(pending[0].title, "Build");
+    BARK_CHECK_EQ(pending[0].body, "done in 4m");
+    BARK_CHECK((pending[0].params == std::map<std::string, std::string>{{"group", "ci"}, {"sound", "bell"}}));
+    BARK_CHECK_EQ(pending[1].title, "");
+    BARK_CHECK_EQ(pending[1].body, "only/body");
+}
+
+static void testJsonRequest()
+{
+    BarkDispatcher dispatcher("", manualOptions());
+    ConnectionRegistry registry;
+    ProxyConnection connection(dispatcher, registry);
+
+    std::string json = "{\"device_keys\": [\"k3\", \"k4\"], \"device_key\": \"k2\", \"title\": \"caf\\u00e9\","
+                       " \"body\": \"line\\nsmile \\ud83d\\ude00 \\\"q\\\"\", \"badge\": 3, \"icon\": null}";
+    BARK_CHECK_EQ(connection.exchange(post("/push", json, "application/json",
+                                           "traceparent: 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01\r\n")),
+                  200);
+
+    std::vector<BarkNotification> pending = drain(dispatcher);
+    BARK_CHECK_EQ(pending.size(), 1u);
+    if (pending.empty())
+        return;
+    BARK_CHECK((pending[0].device_keys == std::vector<std::string>{"k3", "k4", "k2"}));
+    BARK_CHECK_EQ(pending[0].title, "caf\xc3\xa9");
+    BARK_CHECK_EQ(pending[0].body, "line\nsmile \xf0\x9f\x98\x80 \"q\"");
+    BARK_CHECK((pending[0].params == std::map<std::string, std::string>{{"badge", "3"}}));
+    BARK_CHECK_EQ(pending[0].trace.traceparent(), "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+}
+
+static void testFormRequest()
+{
+    BarkDispatcher dispatcher("", manualOptions());
+    ConnectionRegistry registry;
+    ProxyConnection connection(dispatcher, registry);
+
+    BARK_CHECK_EQ(connection.exchange(post("/push", "device_key=k5&body=a+b%26c&level=passive",
+                                           "application/x-www-form-urlencoded")), 200);
+    std::vector<BarkNotification> pending = drain(dispatcher);
+    BARK_CHECK_EQ(pending.size(), 1u);
+    if (pending.empty())
+        return;
+    BARK_CHECK_EQ(pending[0].body, "a b&c");
+    BARK_CHECK_EQ(pending[0].params["level"], "passive");
+}
+
+static void testMalformedRequestsRejected()
+{
+    BarkDispatcher dispatcher("", manualOptions());
+    ConnectionRegistry registry;
+    ProxyConnection connection(dispatcher, registry);
+
+    const char *bodies[] = {
+        "{\"device_key\": \"k\", \"body\": \"\\uZZZZ\"}",
+        "{\"device_key\": \"k\", \"body\": \"\\u12\"}",
+        "{\"device_key\": \"k\", \"body\": \"\\udc00\"}",
+        "{\"device_key\": \"k\", \"body\": \"\\ud83d tail\"}",
+        "{\"device_key\": \"k\", \"body\": \"\\ud83d\\u0041\"}",
+        "{\"device_key\": \"k\", \"body\": \"unterminated}",
+        "{\"title\": \"no key\"}",
+    };
+    for (const char *body : bodies)
+        BARK_CHECK_EQ(connection.exchange(post("/push", body)), 400);
+    BARK_CHECK_EQ(connection.exchange("GET /ping HTTP/1.1\r\nHost: proxy\r\n\r\n"), 200);
+    BARK_CHECK(drain(dispatcher).empty());
+}
+
+static void testQueueFullAndClose()
+{
+    BarkDispatcher dispatcher("", manualOptions(1));
+    ConnectionRegistry registry;
+    ProxyConnection connection(dispatcher, registry);
+
+    BARK_CHECK_EQ(connection.exchange("GET /k/one HTTP/1.1\r\nHost: proxy\r\n\r\n"), 200);
+    BARK_CHECK_EQ(connection.exchange("GET /k/two HTTP/1.1\r\nHost: proxy\r\nConnection: close\r\n\r\n"), 503);
+    BARK_CHECK(connection.closedByPeer());
+    BARK_CHECK_EQ(dispatcher.getStats().rejected, 1u);
+}
+
+struct CollectingExporter : BarkSpanExporter
+{
+    std::vector<BarkSpan> spans;
+
+    void exportSpans(const std::vector<BarkSpan> &batch) override
+    {
+        spans.insert(spans.end(), batch.begin(), batch.end());
+    }
+};
+
+static BarkSpanContext trace(const char *span_id)
+{
+    BarkSpanContext context;
+    BarkSpanContext::fromTraceparent(std::string("00-4bf92f3577b34da6a3ce929d0e0e4736-") + span_id + "-01", context);
+    return context;
+}
+
+static void testBatchReturnsUnusedTokens()
+{
+    auto clock = std::make_shared<BarkVirtualClock>();
+    BarkLocalLimitOptions limit;
+    limit.requests_per_second = 1e-6;
+    limit.burst = 10.0;
+    limit.clock = clock;
+    auto backend = std::make_shared<BarkLocalLimitBackend>(limit);
+
+    BarkDispatcherOptions options = manualOptions();
+    options.clock = clock;
+    options.limiter = backend;
+    BarkRecordingServer server;
+    options.transport = std::make_shared<BarkScriptedTransport>(clock, server.handler(milliseconds(2000)));
+    BarkDispatcher dispatcher("", options);
+
+    // Both requests lease a token up front; the second expires while the
+    // first is in flight and gives its token back.
+    dispatcher.enqueue(barkTestNotification("key", "slow"));
+    BarkNotification expiring = barkTestNotification("key", "expiring");
+    expiring.expires_at = clock->now() + milliseconds(1000);
+    dispatcher.enqueue(expiring);
+    dispatcher.flush();
+
+    BarkDispatcherStats stats = dispatcher.getStats();
+    BARK_CHECK_EQ(stats.requests, 1u);
+    BARK_CHECK_EQ(stats.expired, 1u);
+    BARK_CHECK_EQ(backend->leaseTokens(100), 9u);
+}
+
+static void testFailedBatchForgetsMergedMarks()
+{
+    BarkLocalLimitOptions limit;
+    limit.dedup_window = std::chrono::seconds(60);
+    BarkDispatcherOptions options = manualOptions();
+    options.limiter = std::make_shared<BarkLocalLimitBackend>(limit);
+    BarkRecordingServer failing;
+    BarkRecordingServer working;
+    bool fail = true;
+    BarkSimulatedServer failing_handler = failing.handler(milliseconds(0), BarkError::NETWORK_ERROR);
+    BarkSimulatedServer working_handler = working.handler();
+    options.transport = std::make_shared<BarkScriptedTransport>(
+        std::make_shared<BarkVirtualClock>(),
+        [&](const BarkNotification &n, std::chrono::nanoseconds at)
+        {
+            return fail ? failing_handler(n, at) : working_handler(n, at);
+        });
+    BarkDispatcher dispatcher("", options);
+
+    dispatcher.enqueue(barkTestNotification("k1", "outage"));
+    dispatcher.enqueue(barkTestNotification("k2", "outage"));
+    dispatcher.flush();
+    BARK_CHECK_EQ(failing.requests.size(), 1u);
+    BARK_CHECK_EQ(dispatcher.getStats().failures, 1u);
+
+    fail = false;
+    dispatcher.enqueue(barkTestNotification("k1", "outage"));
+    dispatcher.enqueue(barkTestNotification("k2", "outage"));
+    dispatcher.flush();
+    BARK_CHECK_EQ(dispatcher.getStats().suppressed, 0u);
+    BARK_CHECK_EQ(working.requests.size(), 1u);
+
+    dispatcher.enqueue(barkTestNotification("k1", "outage"));
+    dispatcher.flush();
+    BARK_CHECK_EQ(dispatcher.getStats().suppressed, 1u);
+}
+
+static void testMergedTracesBecomeLinks()
+{
+    BarkBenchServer server;
+    auto exporter = std::make_shared<CollectingExporter>();
+    BarkTracerOptions tracing;
+    tracing.batch_size = 1;
+    BarkDispatcherOptions options = manualOptions();
+    options.tracer = std::make_shared<BarkTracer>(exporter, tracing);
+    BarkDispatcher dispatcher(server.url(), options);
+
+    BarkNotification first = barkTestNotification("k1", "merged");
+    first.trace = trace("00f067aa0ba902b7");
+    BarkNotification untraced = barkTestNotification("k2", "merged");
+    BarkNotification second = barkTestNotification("k3", "merged");
+    second.trace = trace("00f067aa0ba902b8");
+    dispatcher.enqueue(first);
+    dispatcher.enqueue(untraced);
+    dispatcher.enqueue(second);
+    dispatcher.flush();
+
+    BARK_CHECK_EQ(dispatcher.getStats().requests, 1u);
+    BARK_CHECK_EQ(exporter->spans.size(), 1u);
+    if (exporter->spans.empty())
+        return;
+    const BarkSpan &span = exporter->spans[0];
+    BARK_CHECK_EQ(span.parent.traceparent(), first.trace.traceparent());
+    BARK_CHECK_EQ(span.device_count, 3u);
+    BARK_CHECK_EQ(span.links.size(), 1u);
+    if (!span.links.empty())
+        BARK_CHECK_EQ(span.links[0].traceparent(), second.trace.traceparent());
+}
+
+static void testCoalescingWindowUsesDispatcherClock()
+{
+    auto clock = std::make_shared<BarkVirtualClock>();
+    BarkDispatcherOptions options;
+    options.clock = clock;
+    options.coalesce_window = milliseconds(50);
+    BarkRecordingServer server;
+    options.transport = std::make_shared<BarkScriptedTransport>(clock, server.handler());
+    BarkDispatcher dispatcher("", options);
+
+    dispatcher.enqueue(barkTestNotification("key", "windowed"));
+    std::this_thread::sleep_for(milliseconds(150));
+    BARK_CHECK_EQ(dispatcher.getStats().requests, 0u);
+
+    clock->sleepFor(milliseconds(60));
+    for (int i = 0; i < 200 && dispatcher.getStats().requests == 0; ++i)
+        std::this_thread::sleep_for(milliseconds(10));
+    BARK_CHECK_EQ(dispatcher.getStats().requests, 1u);
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    return barkRunTests({
+        {"path request", testPathRequest},
+        {"json request with escapes and trace", testJsonRequest},
+        {"form request", testFormRequest},
+        {"malformed requests are rejected", testMalformedRequestsRejected},
+        {"full queue and connection close", testQueueFullAndClose},
+        {"batch returns unused tokens", testBatchReturnsUnusedTokens},
+        {"failed batch forgets merged marks", testFailedBatchForgetsMergedMarks},
+        {"merged traces become span links", testMergedTracesBecomeLinks},
+        {"coalescing window uses the dispatcher clock", testCoalescingWindowUsesDispatcherClock},
+    });
+}
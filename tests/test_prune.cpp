@@ -0,0 +1,158 @@
+// Key pruning: per-key results parsed from the Bark response, and which
+// failures count against a key.
+//
+//   g++ -std=c++17 -I.. -I../bench test_prune.cpp -o test_prune -lcurl -pthread
+//   ./test_prune
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+// Answers each request with the next scripted status and body, repeating the
+// last one. Connections are served one at a time.
+class ScriptedServer
+{
+private:
+    int listen_fd_;
+    uint16_t port_;
+    std::atomic<bool> stopping_;
+    std::vector<std::pair<int, std::string>> script_;
+    size_t next_;
+    std::mutex mutex_;
+    std::thread acceptor_;
+
+    static size_t contentLength(const std::string &buffer, size_t header_end)
+    {
+        size_t at = buffer.find("Content-Length: ");
+        return at == std::string::npos || at > header_end ? 0 : std::strtoul(buffer.c_str() + at + 16, nullptr, 10);
+    }
+
+    std::string nextResponse()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::pair<int, std::string> &entry = script_[std::min(next_++, script_.size() - 1)];
+        return "HTTP/1.1 " + std::to_string(entry.first) + " Scripted\r\nContent-Type: application/json\r\n"
+               "Content-Length: " + std::to_string(entry.second.size()) + "\r\n\r\n" + entry.second;
+    }
+
+    void serve(int fd)
+    {
+        std::string buffer;
+        char chunk[4096];
+        while (!stopping_.load())
+        {
+            size_t header_end = buffer.find("\r\n\r\n");
+            if (header_end != std::string::npos && buffer.size() >= header_end + 4 + contentLength(buffer, header_end))
+            {
+                buffer.erase(0, header_end + 4 + contentLength(buffer, header_end));
+                std::string response = nextResponse();
+                if (!barkBenchWriteAll(fd, response.data(), response.size()))
+                    return;
+                continue;
+            }
+            pollfd entry{fd, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return;
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+    }
+
+    void acceptLoop()
+    {
+        while (!stopping_.load())
+        {
+            pollfd entry{listen_fd_, POLLIN, 0};
+            if (poll(&entry, 1, 50) <= 0)
+                continue;
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            serve(fd);
+            close(fd);
+        }
+    }
+
+public:
+    explicit ScriptedServer(std::vector<std::pair<int, std::string>> script)
+        : listen_fd_(barkBenchListen(port_)), stopping_(false), script_(std::move(script)), next_(0)
+    {
+        acceptor_ = std::thread(&ScriptedServer::acceptLoop, this);
+    }
+
+    ~ScriptedServer()
+    {
+        stopping_ = true;
+        acceptor_.join();
+        close(listen_fd_);
+    }
+
+    std::string url() const
+    {
+        return "http://127.0.0.1:" + std::to_string(port_) + "/";
+    }
+};
+
+static void testPerKeyResultsPruneOnlyRejectedKeys()
+{
+    // Escaped names, nested members and a non-device 429 must not confuse
+    // the parser.
+    ScriptedServer server({{200, "{\"code\":200,\"message\":\"partial\",\"extra\":{\"data\":[\"x\"]},\"data\":["
+                                 "{\"device_key\":\"good\",\"code\":200,\"message\":\"ok\"},"
+                                 "{\"device_key\":\"bad\",\"code\":400,\"message\":\"invalid device token\"},"
+                                 "{\"device_key\":\"we\\u0069rd\",\"code\":404,\"message\":\"not found\"},"
+                                 "{\"message\":\"busy\",\"code\":429,\"device_key\":\"busy\"}]}"}});
+    BarkPush push(std::vector<std::string>{"good", "bad", "weird", "busy"}, server.url());
+    std::vector<std::string> pruned;
+    push.setKeyPruning(2, [&pruned](const std::string &key, unsigned) { pruned.push_back(key); });
+
+    push.send("Alert", "first");
+    BARK_CHECK(pruned.empty());
+    push.send("Alert", "second");
+    BARK_CHECK((pruned == std::vector<std::string>{"bad", "weird"}));
+    BARK_CHECK((push.getDeviceKeys() == std::vector<std::string>{"good", "busy"}));
+}
+
+static void testPayloadRejectionKeepsKey()
+{
+    ScriptedServer server({{400, "{\"code\":400,\"message\":\"request body too large\"}"}});
+    BarkPush push("solo", server.url());
+    push.setKeyPruning(1);
+    BARK_CHECK_EQ(push.send("Alert", "oversized"), BarkError::HTTP_ERROR);
+    BARK_CHECK((push.getDeviceKeys() == std::vector<std::string>{"solo"}));
+}
+
+static void testDeviceRejectionPrunesSingleKey()
+{
+    ScriptedServer server({{400, "{\"code\":400,\"message\":\"failed to get device token\"}"}});
+    BarkPush push("gone", server.url());
+    push.setKeyPruning(1);
+    BARK_CHECK_EQ(push.send("Alert", "hello"), BarkError::HTTP_ERROR);
+    BARK_CHECK(push.getDeviceKeys().empty());
+}
+
+static void testSuccessResetsFailures()
+{
+    const std::string rejected = "{\"code\":400,\"message\":\"invalid device key\"}";
+    const std::string ok = "{\"code\":200,\"message\":\"success\",\"timestamp\":1}";
+    ScriptedServer server({{400, rejected}, {200, ok}, {400, rejected}, {400, rejected}});
+    BarkPush push("flaky", server.url());
+    push.setKeyPruning(2);
+    push.send("Alert", "1");
+    push.send("Alert", "2");
+    push.send("Alert", "3");
+    BARK_CHECK((push.getDeviceKeys() == std::vector<std::string>{"flaky"}));
+    push.send("Alert", "4");
+    BARK_CHECK(push.getDeviceKeys().empty());
+}
+
+int main()
+{
+    return barkRunTests({
+        {"per-key results prune only rejected keys", testPerKeyResultsPruneOnlyRejectedKeys},
+        {"payload rejection keeps the key", testPayloadRejectionKeepsKey},
+        {"device rejection prunes a single key", testDeviceRejectionPrunesSingleKey},
+        {"success resets failures", testSuccessResetsFailures},
+    });
+}
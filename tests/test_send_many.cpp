@@ -0,0 +1,118 @@
+// BarkPush::sendMany() against the loopback server from bench/: delivery,
+// duplicate suppression, rate limiting, forgetting failed notifications and
+// returning the limiter tokens of notifications that were never sent.
+//
+//   g++ -std=c++17 -I.. -I../bench test_send_many.cpp -o test_send_many -lcurl -pthread
+//   ./test_send_many
+
+#include "test_support.hpp"
+#include "bench_server.hpp"
+
+static BarkBenchServer &server()
+{
+    static BarkBenchServer instance;
+    return instance;
+}
+
+static std::shared_ptr<BarkLocalLimitBackend> limiter(double burst)
+{
+    BarkLocalLimitOptions options;
+    options.requests_per_second = 1e-6;
+    options.burst = burst;
+    options.dedup_window = std::chrono::seconds(60);
+    return std::make_shared<BarkLocalLimitBackend>(options);
+}
+
+static void testSendMany()
+{
+    BarkPush push(std::vector<std::string>(), server().url());
+    uint64_t before = server().requests();
+    std::vector<BarkNotification> batch;
+    for (int i = 0; i < 20; ++i)
+        batch.push_back(barkTestNotification("key" + std::to_string(i), "event " + std::to_string(i)));
+    batch.push_back(BarkNotification());
+
+    std::vector<BarkError> results = push.sendMany(batch, 4);
+    BARK_CHECK_EQ(results.size(), batch.size());
+    for (size_t i = 0; i < 20 && i < results.size(); ++i)
+        BARK_CHECK_EQ(results[i], BarkError::SUCCESS);
+    BARK_CHECK_EQ(results.back(), BarkError::NO_DEVICES_SPECIFIED);
+    BARK_CHECK_EQ(server().requests() - before, 20u);
+}
+
+static void testSendManySuppressesAndLimits()
+{
+    BarkPush push(std::vector<std::string>(), server().url());
+    push.setLimiter(limiter(3.0));
+    uint64_t before = server().requests();
+    std::vector<BarkNotification> batch;
+    for (const char *key : {"a", "a", "b", "c", "d"})
+        batch.push_back(barkTestNotification(key, "x"));
+
+    std::vector<BarkError> results = push.sendMany(batch);
+    BARK_CHECK_EQ(results[0], BarkError::SUCCESS);
+    BARK_CHECK_EQ(results[1], BarkError::DUPLICATE_SUPPRESSED);
+    BARK_CHECK_EQ(results[2], BarkError::SUCCESS);
+    BARK_CHECK_EQ(results[3], BarkError::SUCCESS);
+    BARK_CHECK_EQ(results[4], BarkError::RATE_LIMITED);
+    BARK_CHECK_EQ(server().requests() - before, 3u);
+
+    results = push.sendMany({barkTestNotification("d", "x"), barkTestNotification("a", "x")});
+    BARK_CHECK_EQ(results[0], BarkError::RATE_LIMITED);
+    BARK_CHECK_EQ(results[1], BarkError::DUPLICATE_SUPPRESSED);
+    BARK_CHECK_EQ(server().requests() - before, 3u);
+}
+
+static void testSendManyForgetsFailures()
+{
+    BarkPush push(std::vector<std::string>(), "http://127.0.0.1:9/");
+    auto backend = limiter(10.0);
+    push.setLimiter(backend);
+    std::vector<BarkError> results = push.sendMany({barkTestNotification("a", "unreachable")});
+    BARK_CHECK(results[0] != BarkError::SUCCESS && results[0] != BarkError::DUPLICATE_SUPPRESSED);
+
+    BarkPush retry(std::vector<std::string>(), server().url());
+    retry.setLimiter(backend);
+    results = retry.sendMany({barkTestNotification("a", "unreachable")});
+    BARK_CHECK_EQ(results[0], BarkError::SUCCESS);
+}
+
+static void testSendManyReusesConnections()
+{
+    BarkPush push(std::vector<std::string>(), server().url());
+    std::vector<BarkNotification> batch;
+    for (int i = 0; i < 8; ++i)
+        batch.push_back(barkTestNotification("reuse" + std::to_string(i), "x"));
+    push.sendMany(batch, 4);
+    uint64_t connections = server().connections();
+    std::vector<BarkError> results = push.sendMany(batch, 4);
+    for (BarkError result : results)
+        BARK_CHECK_EQ(result, BarkError::SUCCESS);
+    BARK_CHECK_EQ(server().connections(), connections);
+}
+
+static void testSendManyReturnsUnsentTokens()
+{
+    BarkBenchServer slow(std::chrono::milliseconds(50));
+    BarkPush push(std::vector<std::string>(), slow.url());
+    auto backend = limiter(2.0);
+    push.setLimiter(backend);
+    BarkNotification late = barkTestNotification("b", "late");
+    late.expires_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+
+    std::vector<BarkError> results = push.sendMany({barkTestNotification("a", "first"), late}, 1);
+    BARK_CHECK_EQ(results[0], BarkError::SUCCESS);
+    BARK_CHECK_EQ(results[1], BarkError::EXPIRED);
+    BARK_CHECK_EQ(backend->leaseTokens(5), 1u);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"sendMany delivers every notification", testSendMany},
+        {"sendMany suppresses duplicates and rate limits", testSendManySuppressesAndLimits},
+        {"sendMany forgets failed notifications", testSendManyForgetsFailures},
+        {"sendMany reuses connections between calls", testSendManyReusesConnections},
+        {"sendMany returns tokens of unsent notifications", testSendManyReturnsUnsentTokens},
+    });
+}
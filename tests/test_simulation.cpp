@@ -0,0 +1,108 @@
+// BarkDispatcher scheduling under BarkSimulation: coalescing windows, request
+// pacing, the queue limit and failure accounting.
+//
+//   g++ -std=c++17 -I.. test_simulation.cpp -o test_simulation -lcurl -pthread
+//   ./test_simulation
+
+#include "test_support.hpp"
+
+using std::chrono::milliseconds;
+
+static void testCoalescesIdenticalNotifications()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 10; ++i)
+        simulation.schedule(milliseconds(i), barkTestNotification("key" + std::to_string(i % 4), "disk full"));
+    simulation.schedule(milliseconds(5), barkTestNotification("key0", "disk ok"));
+
+    BarkDispatcherOptions options;
+    options.coalesce_window = milliseconds(20);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.offered, 11u);
+    BARK_CHECK_EQ(report.requests, 2u);
+    BARK_CHECK_EQ(report.coalesced, 9u);
+    BARK_CHECK_EQ(report.expired, 0u);
+    BARK_CHECK_EQ(server.requests.size(), 2u);
+    if (server.requests.size() == 2)
+    {
+        BARK_CHECK_EQ(server.requests[0].body, "disk full");
+        BARK_CHECK_EQ(server.requests[0].device_keys.size(), 4u);
+        BARK_CHECK_EQ(server.requests[1].device_keys.size(), 1u);
+    }
+}
+
+static void testSeparatesWindows()
+{
+    BarkSimulation simulation;
+    simulation.schedule(milliseconds(0), barkTestNotification("key", "same"));
+    simulation.schedule(milliseconds(500), barkTestNotification("key", "same"));
+
+    BarkDispatcherOptions options;
+    options.coalesce_window = milliseconds(20);
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.requests, 2u);
+    BARK_CHECK_EQ(report.coalesced, 0u);
+}
+
+static void testRateLimitSpacesRequests()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 20; ++i)
+        simulation.schedule(milliseconds(0), barkTestNotification("key", "event " + std::to_string(i)));
+
+    BarkDispatcherOptions options;
+    options.requests_per_second = 10.0;
+    options.burst = 1.0;
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.requests, 20u);
+    BARK_CHECK_EQ(server.requests.size(), 20u);
+    double seconds_taken = std::chrono::duration<double>(report.simulated_time).count();
+    BARK_CHECK(seconds_taken >= 1.9 && seconds_taken < 2.1);
+    BARK_CHECK(report.throughput > 9.0 && report.throughput <= 11.0);
+}
+
+static void testQueueLimitRejects()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 10; ++i)
+        simulation.schedule(milliseconds(0), barkTestNotification("key", "event " + std::to_string(i)));
+
+    BarkDispatcherOptions options;
+    options.max_queue_size = 4;
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(options, server.handler());
+
+    BARK_CHECK_EQ(report.rejected, 6u);
+    BARK_CHECK_EQ(report.requests, 4u);
+}
+
+static void testFailuresAreCounted()
+{
+    BarkSimulation simulation;
+    for (int i = 0; i < 3; ++i)
+        simulation.schedule(milliseconds(100 * i), barkTestNotification("key", "event " + std::to_string(i)));
+
+    BarkRecordingServer server;
+    BarkSimulationReport report = simulation.run(BarkDispatcherOptions(),
+                                                 server.handler(milliseconds(5), BarkError::HTTP_ERROR));
+
+    BARK_CHECK_EQ(report.requests, 3u);
+    BARK_CHECK_EQ(report.failures, 3u);
+}
+
+int main()
+{
+    return barkRunTests({
+        {"coalesces identical notifications", testCoalescesIdenticalNotifications},
+        {"separate windows are not coalesced", testSeparatesWindows},
+        {"rate limit spaces requests", testRateLimitSpacesRequests},
+        {"full queue rejects", testQueueLimitRejects},
+        {"transport failures are counted", testFailuresAreCounted},
+    });
+}
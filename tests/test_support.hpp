@@ -0,0 +1,120 @@
+// Minimal checks shared by the test programs in this directory. Each program
+// runs its cases in order and exits non-zero if any check failed; see
+// run_tests.sh for the build lines.
+
+#ifndef BARK_TEST_SUPPORT_HPP
+#define BARK_TEST_SUPPORT_HPP
+
+#include "bark_push.hpp"
+
+#include <cstdio>
+
+inline int &barkTestFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+inline std::string barkTestValue(BarkError error)
+{
+    return barkErrorToString(error);
+}
+
+inline std::string barkTestValue(const std::string &value)
+{
+    return "\"" + value + "\"";
+}
+
+inline std::string barkTestValue(const char *value)
+{
+    return barkTestValue(std::string(value));
+}
+
+inline std::string barkTestValue(bool value)
+{
+    return value ? "true" : "false";
+}
+
+template <typename T>
+inline std::string barkTestValue(const T &value)
+{
+    std::ostringstream out;
+    out << value;
+    return out.str();
+}
+
+#define BARK_CHECK(condition)                                                                  \
+    do                                                                                         \
+    {                                                                                          \
+        if (!(condition))                                                                      \
+        {                                                                                      \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++barkTestFailures();                                                              \
+        }                                                                                      \
+    } while (0)
+
+#define BARK_CHECK_EQ(actual, expected)                                                        \
+    do                                                                                         \
+    {                                                                                          \
+        const auto &bark_actual_ = (actual);                                                   \
+        const auto &bark_expected_ = (expected);                                               \
+        if (!(bark_actual_ == bark_expected_))                                                 \
+        {                                                                                      \
+            std::fprintf(stderr, "%s:%d: %s is %s, expected %s\n", __FILE__, __LINE__, #actual, \
+                         barkTestValue(bark_actual_).c_str(), barkTestValue(bark_expected_).c_str()); \
+            ++barkTestFailures();                                                              \
+        }                                                                                      \
+    } while (0)
+
+inline BarkNotification barkTestNotification(const std::string &key, const std::string &body,
+                                             const std::map<std::string, std::string> &params = {})
+{
+    BarkNotification n;
+    n.device_keys = {key};
+    n.title = "Alert";
+    n.body = body;
+    n.params = params;
+    return n;
+}
+
+// Simulated server that records every request it receives.
+struct BarkRecordingServer
+{
+    std::vector<BarkNotification> requests;
+
+    BarkSimulatedServer handler(std::chrono::nanoseconds latency = std::chrono::milliseconds(0),
+                                BarkError error = BarkError::SUCCESS)
+    {
+        return [this, latency, error](const BarkNotification &n, std::chrono::nanoseconds)
+        {
+            requests.push_back(n);
+            BarkSimulatedResponse response;
+            response.latency = latency;
+            response.error = error;
+            return response;
+        };
+    }
+};
+
+struct BarkTestCase
+{
+    const char *name;
+    void (*run)();
+};
+
+inline int barkRunTests(std::initializer_list<BarkTestCase> cases)
+{
+    int failed_cases = 0;
+    for (const BarkTestCase &test : cases)
+    {
+        int before = barkTestFailures();
+        test.run();
+        bool passed = barkTestFailures() == before;
+        failed_cases += passed ? 0 : 1;
+        std::printf("%-6s %s\n", passed ? "ok" : "FAILED", test.name);
+    }
+    std::printf("%zu cases, %d failed\n", cases.size(), failed_cases);
+    return failed_cases == 0 ? 0 : 1;
+}
+
+#endif
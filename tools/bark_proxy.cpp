@@ -0,0 +1,922 @@
+// Bark-compatible batching proxy.
+//
+//   g++ -std=c++17 -O2 -I.. bark_proxy.cpp -o bark_proxy -lcurl -pthread
+//   ./bark_proxy --listen 127.0.0.1:8080 --upstream https://api.day.app/ --rate 20
+//
+// With --handoff PATH, a second instance started with the same PATH takes over
+// the listening socket and the queued notifications of the running one, which
+// then finishes its in-flight requests and exits.
+
+#include "bark_push.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+struct ProxyRequest
+{
+    std::string method;
+    std::string target;
+    std::map<std::string, std::string> headers;
+    std::string body;
+};
+
+static std::string urlDecode(const std::string &input)
+{
+    std::string output;
+    output.reserve(input.size());
+    for (size_t i = 0; i < input.size(); ++i)
+    {
+        if (input[i] == '+')
+        {
+            output += ' ';
+        }
+        else if (input[i] == '%' && i + 2 < input.size() &&
+                 std::isxdigit(static_cast<unsigned char>(input[i + 1])) &&
+                 std::isxdigit(static_cast<unsigned char>(input[i + 2])))
+        {
+            output += static_cast<char>(std::stoi(input.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        }
+        else
+        {
+            output += input[i];
+        }
+    }
+    return output;
+}
+
+static void parseQuery(const std::string &query, std::map<std::string, std::string> &params)
+{
+    size_t start = 0;
+    while (start < query.size())
+    {
+        size_t end = query.find('&', start);
+        if (end == std::string::npos)
+            end = query.size();
+        std::string pair = query.substr(start, end - start);
+        size_t eq = pair.find('=');
+        if (eq != std::string::npos)
+            params[urlDecode(pair.substr(0, eq))] = urlDecode(pair.substr(eq + 1));
+        start = end + 1;
+    }
+}
+
+class FlatJsonParser
+{
+private:
+    const std::string &text_;
+    size_t pos_;
+
+    void skipSpace()
+    {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_])))
+            ++pos_;
+    }
+
+    bool consume(char c)
+    {
+        skipSpace();
+        if (pos_ < text_.size() && text_[pos_] == c)
+        {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    static void appendUtf8(std::string &out, unsigned int code)
+    {
+        if (code < 0x80)
+        {
+            out += static_cast<char>(code);
+        }
+        else if (code < 0x800)
+        {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool parseHex4(unsigned int &code)
+    {
+        if (pos_ + 4 > text_.size())
+            return false;
+        code = 0;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            char c = text_[pos_ + i];
+            if (!std::isxdigit(static_cast<unsigned char>(c)))
+                return false;
+            code = code * 16 + static_cast<unsigned int>(std::isdigit(static_cast<unsigned char>(c))
+                                                          ? c - '0' : (std::tolower(c) - 'a' + 10));
+        }
+        pos_ += 4;
+        return true;
+    }
+
+    bool parseEscapedCodePoint(std::string &out)
+    {
+        unsigned int code = 0;
+        if (!parseHex4(code) || (code >= 0xDC00 && code <= 0xDFFF))
+            return false;
+        if (code >= 0xD800 && code <= 0xDBFF)
+        {
+            unsigned int low = 0;
+            if (pos_ + 2 > text_.size() || text_[pos_] != '\\' || text_[pos_ + 1] != 'u')
+                return false;
+            pos_ += 2;
+            if (!parseHex4(low) || low < 0xDC00 || low > 0xDFFF)
+                return false;
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+        appendUtf8(out, code);
+        return true;
+    }
+
+    bool parseString(std::string &out)
+    {
+        if (!consume('"'))
+            return false;
+        while (pos_ < text_.size())
+        {
+            char c = text_[pos_++];
+            if (c == '"')
+                return true;
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos_ >= text_.size())
+                return false;
+            char escaped = text_[pos_++];
+            switch (escaped)
+            {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u':
+                if (!parseEscapedCodePoint(out))
+                    return false;
+                break;
+            default: out += escaped; break;
+            }
+        }
+        return false;
+    }
+
+    bool parseScalar(std::string &out)
+    {
+        skipSpace();
+        if (pos_ < text_.size() && text_[pos_] == '"')
+            return parseString(out);
+        size_t start = pos_;
+        while (pos_ < text_.size() && text_[pos_] != ',' && text_[pos_] != '}' && text_[pos_] != ']' &&
+               !std::isspace(static_cast<unsigned char>(text_[pos_])))
+            ++pos_;
+        out = text_.substr(start, pos_ - start);
+        return !out.empty();
+    }
+
+public:
+    explicit FlatJsonParser(const std::string &text) : text_(text), pos_(0) {}
+
+    bool parse(std::map<std::string, std::string> &fields, std::vector<std::string> &keys)
+    {
+        if (!consume('{'))
+            return false;
+        if (consume('}'))
+            return true;
+        do
+        {
+            std::string name;
+            if (!parseString(name) || !consume(':'))
+                return false;
+            skipSpace();
+            if (pos_ < text_.size() && text_[pos_] == '[')
+            {
+                ++pos_;
+                if (consume(']'))
+                    continue;
+                do
+                {
+                    std::string value;
+                    if (!parseScalar(value))
+                        return false;
+                    if (name == "device_keys")
+                        keys.push_back(value);
+                } while (consume(','));
+                if (!consume(']'))
+                    return false;
+            }
+            else
+            {
+                std::string value;
+                if (!parseScalar(value))
+                    return false;
+                if (value != "null")
+                    fields[name] = value;
+            }
+        } while (consume(','));
+        return consume('}');
+    }
+};
+
+static bool buildNotification(const ProxyRequest &request, BarkNotification &notification)
+{
+    std::string path = request.target;
+    std::string query;
+    size_t question = path.find('?');
+    if (question != std::string::npos)
+    {
+        query = path.substr(question + 1);
+        path = path.substr(0, question);
+    }
+
+    std::map<std::string, std::string> fields;
+    parseQuery(query, fields);
+
+    std::string content_type;
+    auto type_it = request.headers.find("content-type");
+    if (type_it != request.headers.end())
+        content_type = type_it->second;
+
+    if (!request.body.empty())
+    {
+        if (content_type.find("json") != std::string::npos || request.body.front() == '{')
+        {
+            FlatJsonParser parser(request.body);
+            if (!parser.parse(fields, notification.device_keys))
+                return false;
+        }
+        else
+        {
+            parseQuery(request.body, fields);
+        }
+    }
+
+    std::vector<std::string> segments;
+    size_t start = 1;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        if (end > start)
+            segments.push_back(urlDecode(path.substr(start, end - start)));
+        start = end + 1;
+    }
+
+    if (!segments.empty() && segments[0] == "push")
+        segments.erase(segments.begin());
+
+    if (!segments.empty())
+    {
+        notification.device_keys.push_back(segments[0]);
+        if (segments.size() == 2)
+        {
+            fields["body"] = segments[1];
+        }
+        else if (segments.size() == 3)
+        {
+            fields["title"] = segments[1];
+            fields["body"] = segments[2];
+        }
+        else if (segments.size() >= 4)
+        {
+            fields["title"] = segments[1];
+            fields["subtitle"] = segments[2];
+            fields["body"] = segments[3];
+        }
+    }
+
+    auto key_it = fields.find("device_key");
+    if (key_it != fields.end())
+    {
+        notification.device_keys.push_back(key_it->second);
+        fields.erase(key_it);
+    }
+
+    auto title_it = fields.find("title");
+    if (title_it != fields.end())
+    {
+        notification.title = title_it->second;
+        fields.erase(title_it);
+    }
+
+    auto body_it = fields.find("body");
+    if (body_it != fields.end())
+    {
+        notification.body = body_it->second;
+        fields.erase(body_it);
+    }
+
+    notification.params = std::move(fields);
+
+    auto trace_it = request.headers.find("traceparent");
+    if (trace_it != request.headers.end())
+        BarkSpanContext::fromTraceparent(trace_it->second, notification.trace);
+    return !notification.device_keys.empty();
+}
+
+static bool readRequest(int fd, std::string &buffer, ProxyRequest &request)
+{
+    size_t header_end;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+    {
+        char chunk[8192];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0 || buffer.size() > 65536)
+            return false;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+
+    std::istringstream head(buffer.substr(0, header_end));
+    std::string line;
+    std::getline(head, line);
+    std::istringstream request_line(line);
+    request_line >> request.method >> request.target;
+
+    request.headers.clear();
+    while (std::getline(head, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = line.substr(0, colon);
+        for (char &c : name)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        size_t value_start = line.find_first_not_of(' ', colon + 1);
+        request.headers[name] = value_start == std::string::npos ? "" : line.substr(value_start);
+    }
+
+    size_t content_length = 0;
+    auto length_it = request.headers.find("content-length");
+    if (length_it != request.headers.end())
+        content_length = std::strtoul(length_it->second.c_str(), nullptr, 10);
+    if (content_length > 1024 * 1024)
+        return false;
+
+    size_t body_start = header_end + 4;
+    while (buffer.size() < body_start + content_length)
+    {
+        char chunk[8192];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+
+    request.body = buffer.substr(body_start, content_length);
+    buffer.erase(0, body_start + content_length);
+    return true;
+}
+
+static void writeResponse(int fd, int code, const std::string &message, bool keep_alive)
+{
+    std::string body = "{\"code\":" + std::to_string(code) + ",\"message\":\"" + message +
+                       "\",\"timestamp\":" + std::to_string(std::time(nullptr)) + "}";
+    std::string response = "HTTP/1.1 " + std::to_string(code) + (code == 200 ? " OK" : " Error") +
+                           "\r\nContent-Type: application/json; charset=utf-8\r\nContent-Length: " +
+                           std::to_string(body.size()) +
+                           (keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n") +
+                           body;
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        ssize_t n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        sent += static_cast<size_t>(n);
+    }
+}
+
+class ConnectionRegistry
+{
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<int, bool> busy_;
+    bool draining_ = false;
+
+public:
+    void add(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_[fd] = false;
+    }
+
+    bool setBusy(int fd, bool busy)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_[fd] = busy;
+        return !draining_;
+    }
+
+    void remove(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_.erase(fd);
+        cv_.notify_all();
+    }
+
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        draining_ = true;
+        for (const auto &[fd, busy] : busy_)
+        {
+            if (!busy)
+                shutdown(fd, SHUT_RD);
+        }
+        cv_.wait(lock, [this]() { return busy_.empty(); });
+    }
+};
+
+static void serveConnection(int fd, BarkDispatcher &dispatcher, ConnectionRegistry &registry)
+{
+    registry.add(fd);
+    std::string buffer;
+    ProxyRequest request;
+    while (readRequest(fd, buffer, request))
+    {
+        auto connection_it = request.headers.find("connection");
+        bool keep_alive = connection_it == request.headers.end() || connection_it->second != "close";
+        keep_alive = registry.setBusy(fd, true) && keep_alive;
+
+        if (request.target == "/ping" || request.target == "/healthz")
+        {
+            writeResponse(fd, 200, "pong", keep_alive);
+        }
+        else
+        {
+            BarkNotification notification;
+            if (!buildNotification(request, notification))
+                writeResponse(fd, 400, "failed to get device key", keep_alive);
+            else if (!dispatcher.enqueue(std::move(notification)))
+                writeResponse(fd, 503, "queue full", keep_alive);
+            else
+                writeResponse(fd, 200, "success", keep_alive);
+        }
+
+        if (!registry.setBusy(fd, false) || !keep_alive)
+            break;
+    }
+    registry.remove(fd);
+    close(fd);
+}
+
+static bool writeAll(int fd, const void *data, size_t size)
+{
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool readAll(int fd, void *data, size_t size)
+{
+    char *bytes = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, bytes, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool sendListenFd(int channel, int listen_fd)
+{
+    char tag = 'L';
+    iovec iov{&tag, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &listen_fd, sizeof(int));
+    return sendmsg(channel, &message, MSG_NOSIGNAL) == 1;
+}
+
+static int receiveListenFd(int channel)
+{
+    char tag = 0;
+    iovec iov{&tag, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(channel, &message, MSG_CMSG_CLOEXEC) != 1 || tag != 'L')
+        return -1;
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        return -1;
+    int fd = -1;
+    std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    return fd;
+}
+
+static bool unixAddress(const std::string &path, sockaddr_un &address)
+{
+    if (path.size() >= sizeof(address.sun_path))
+        return false;
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static int connectUnix(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listenUnix(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+        return -1;
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+                    listen(fd, 4) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Notifications travel in BarkCompactNotification's portable form, which
+// keeps expiry and trace context. The receiver acks only after every item
+// decoded, and names the ones its queue refused so the sender keeps them.
+static bool sendPending(int channel, std::vector<BarkNotification> &pending,
+                        std::vector<BarkNotification> &refused)
+{
+    uint32_t count = static_cast<uint32_t>(pending.size());
+    if (!writeAll(channel, &count, sizeof(count)))
+        return false;
+    std::string encoded;
+    BarkClock::time_point now = BarkSteadyClock::instance()->now();
+    for (const BarkNotification &notification : pending)
+    {
+        encoded.clear();
+        BarkCompactNotification::serialize(notification, now, encoded);
+        uint32_t size = static_cast<uint32_t>(encoded.size());
+        if (!writeAll(channel, &size, sizeof(size)) || !writeAll(channel, encoded.data(), encoded.size()))
+            return false;
+    }
+
+    char ack = 0;
+    uint32_t refused_count = 0;
+    if (!readAll(channel, &ack, 1) || ack != 'A' || !readAll(channel, &refused_count, sizeof(refused_count)) ||
+        refused_count > count)
+        return false;
+    std::vector<uint32_t> indices(refused_count);
+    if (refused_count > 0 && !readAll(channel, indices.data(), indices.size() * sizeof(uint32_t)))
+        return false;
+    for (uint32_t index : indices)
+    {
+        if (index < pending.size())
+            refused.push_back(std::move(pending[index]));
+    }
+    return true;
+}
+
+static bool receivePending(int channel, BarkDispatcher &dispatcher)
+{
+    char ready = 'R';
+    uint32_t count = 0;
+    if (!writeAll(channel, &ready, 1) || !readAll(channel, &count, sizeof(count)))
+        return false;
+
+    std::vector<BarkNotification> pending(count);
+    std::string encoded;
+    BarkClock::time_point now = BarkSteadyClock::instance()->now();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t size = 0;
+        if (!readAll(channel, &size, sizeof(size)) || size > 1024 * 1024)
+            return false;
+        encoded.resize(size);
+        if (size > 0 && !readAll(channel, &encoded[0], size))
+            return false;
+        const uint8_t *in = reinterpret_cast<const uint8_t *>(encoded.data());
+        const uint8_t *end = in + encoded.size();
+        if (!BarkCompactNotification::deserialize(in, end, now, pending[i]) || in != end)
+        {
+            std::cerr << "Rejected queue handoff, notification " << i << " is malformed" << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<uint32_t> refused;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!dispatcher.enqueue(pending[i]))
+            refused.push_back(i);
+    }
+    char ack = 'A';
+    uint32_t refused_count = static_cast<uint32_t>(refused.size());
+    if (!writeAll(channel, &ack, 1) || !writeAll(channel, &refused_count, sizeof(refused_count)) ||
+        (refused_count > 0 && !writeAll(channel, refused.data(), refused.size() * sizeof(uint32_t))))
+        return false;
+    std::cerr << "bark_proxy took over " << count - refused_count << " queued notifications";
+    if (refused_count > 0)
+        std::cerr << ", refused " << refused_count;
+    std::cerr << std::endl;
+    return true;
+}
+
+static void serveHandoff(const std::string &path, int channel, int listen_fd,
+                         BarkDispatcher &dispatcher, ConnectionRegistry &registry,
+                         std::atomic<bool> &accepting)
+{
+    if (channel >= 0)
+    {
+        if (!receivePending(channel, dispatcher))
+            std::cerr << "Queue handoff from the previous instance failed" << std::endl;
+        close(channel);
+    }
+
+    int control_fd = listenUnix(path);
+    if (control_fd < 0)
+    {
+        std::cerr << "Failed to listen on handoff socket " << path << std::endl;
+        return;
+    }
+
+    while (true)
+    {
+        channel = accept4(control_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (channel < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        char ready = 0;
+        if (!sendListenFd(channel, listen_fd) || !readAll(channel, &ready, 1) || ready != 'R')
+        {
+            close(channel);
+            continue;
+        }
+
+        accepting = false;
+        registry.drain();
+        std::vector<BarkNotification> pending;
+        dispatcher.takePending(pending);
+        size_t count = pending.size();
+        std::vector<BarkNotification> refused;
+        if (!sendPending(channel, pending, refused))
+        {
+            std::cerr << "Queue handoff failed, sending " << count << " notifications locally" << std::endl;
+            dispatcher.enqueueBatch(std::move(pending));
+            count = 0;
+        }
+        else if (!refused.empty())
+        {
+            std::cerr << "Next instance refused " << refused.size() << " notifications, sending them locally"
+                      << std::endl;
+            count -= refused.size();
+            dispatcher.enqueueBatch(std::move(refused));
+        }
+        close(channel);
+        std::cerr << "bark_proxy handed off " << count << " queued notifications" << std::endl;
+        break;
+    }
+    close(control_fd);
+}
+
+// tests/test_proxy.cpp includes this file with BARK_PROXY_NO_MAIN defined.
+#ifndef BARK_PROXY_NO_MAIN
+
+int main(int argc, char **argv)
+{
+    std::string listen_address = "127.0.0.1:8080";
+    std::string upstream = DEFAULT_BARK_SERVER;
+    std::string handoff_path;
+    std::string statsd_address;
+    std::string otlp_url;
+    std::string record_path;
+    BarkDispatcherOptions options;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--listen")
+            listen_address = value;
+        else if (flag == "--upstream")
+            upstream = value;
+        else if (flag == "--rate")
+            options.requests_per_second = std::atof(value.c_str());
+        else if (flag == "--burst")
+            options.burst = std::atof(value.c_str());
+        else if (flag == "--window-ms")
+            options.coalesce_window = std::chrono::milliseconds(std::atol(value.c_str()));
+        else if (flag == "--workers")
+            options.worker_count = std::strtoul(value.c_str(), nullptr, 10);
+        else if (flag == "--queue")
+            options.max_queue_size = std::strtoul(value.c_str(), nullptr, 10);
+        else if (flag == "--ttl-ms")
+            options.default_ttl = std::chrono::milliseconds(std::atol(value.c_str()));
+        else if (flag == "--handoff")
+            handoff_path = value;
+        else if (flag == "--proxy")
+            options.proxy.url = value;
+        else if (flag == "--proxy-user")
+        {
+            size_t separator = value.find(':');
+            options.proxy.username = value.substr(0, separator);
+            if (separator != std::string::npos)
+                options.proxy.password = value.substr(separator + 1);
+        }
+        else if (flag == "--no-proxy")
+            options.proxy.no_proxy = value;
+        else if (flag == "--http")
+        {
+            if (value == "1.1")
+                options.http_version = BarkHttpVersion::HTTP1_1;
+            else if (value == "2")
+                options.http_version = BarkHttpVersion::HTTP2;
+            else if (value == "3")
+                options.http_version = BarkHttpVersion::HTTP3;
+            if (options.http_version == BarkHttpVersion::HTTP3 && !BarkPush::http3Available())
+                std::cerr << "libcurl lacks HTTP/3 support, falling back to HTTP/2" << std::endl;
+        }
+        else if (flag == "--early-data")
+            options.early_data = value == "1" || value == "on";
+        else if (flag == "--record")
+            record_path = value;
+        else if (flag == "--statsd")
+            statsd_address = value;
+        else if (flag == "--otlp")
+            otlp_url = value;
+        else
+        {
+            std::cerr << "Unknown option " << flag << std::endl;
+            return 2;
+        }
+    }
+
+    size_t colon = listen_address.rfind(':');
+    if (colon == std::string::npos)
+    {
+        std::cerr << "Expected --listen host:port" << std::endl;
+        return 2;
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(std::atoi(listen_address.c_str() + colon + 1)));
+    if (inet_pton(AF_INET, listen_address.substr(0, colon).c_str(), &address.sin_addr) != 1)
+    {
+        std::cerr << "Invalid listen address " << listen_address << std::endl;
+        return 2;
+    }
+
+    int channel = handoff_path.empty() ? -1 : connectUnix(handoff_path);
+    int listen_fd = -1;
+    if (channel >= 0)
+    {
+        listen_fd = receiveListenFd(channel);
+        if (listen_fd < 0)
+        {
+            std::cerr << "Failed to receive the listening socket over " << handoff_path << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listen_fd, 128) != 0)
+        {
+            std::cerr << "Failed to listen on " << listen_address << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    std::unique_ptr<BarkMetricsExporter> metrics_exporter;
+    try
+    {
+        if (!record_path.empty())
+            options.recorder = std::make_shared<BarkTrafficRecorder>(record_path);
+        size_t statsd_colon = statsd_address.rfind(':');
+        if (statsd_colon != std::string::npos)
+        {
+            metrics_exporter.reset(new BarkMetricsExporter(std::make_shared<BarkStatsdSink>(
+                statsd_address.substr(0, statsd_colon),
+                static_cast<uint16_t>(std::atoi(statsd_address.c_str() + statsd_colon + 1)))));
+        }
+        else if (!otlp_url.empty())
+        {
+            metrics_exporter.reset(new BarkMetricsExporter(std::make_shared<BarkOtlpSink>(otlp_url)));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    BarkDispatcher dispatcher(upstream, options);
+    ConnectionRegistry registry;
+    std::atomic<bool> accepting(true);
+    std::thread handoff_thread;
+    if (!handoff_path.empty())
+    {
+        handoff_thread = std::thread(serveHandoff, handoff_path, channel, listen_fd, std::ref(dispatcher),
+                                     std::ref(registry), std::ref(accepting));
+    }
+    std::cerr << "bark_proxy " << (channel >= 0 ? "took over " : "listening on ") << listen_address
+              << ", upstream " << upstream << std::endl;
+
+    while (accepting)
+    {
+        pollfd poll_fd{listen_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, 200) <= 0)
+            continue;
+        int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        std::thread(serveConnection, client_fd, std::ref(dispatcher), std::ref(registry)).detach();
+    }
+
+    if (handoff_thread.joinable())
+        handoff_thread.join();
+    dispatcher.flush();
+    dispatcher.stop();
+    close(listen_fd);
+    return 0;
+}
+
+#endif
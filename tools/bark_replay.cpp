@@ -0,0 +1,133 @@
+// Replays traffic recorded with BarkTrafficRecorder (bark_proxy --record FILE).
+//
+//   g++ -std=c++17 -O2 -I.. bark_replay.cpp -o bark_replay -lcurl -pthread
+//   ./bark_replay --trace traffic.bin --server http://127.0.0.1:8080/ --speed 2
+//   ./bark_replay --trace traffic.bin --simulate-ms 40
+//
+// Each record is turned into a synthetic notification with the recorded key
+// count, title and body sizes, parameter count and level. --speed scales the
+// recorded timing (0 sends as fast as possible). --simulate-ms replays on a
+// virtual clock against a server with that fixed latency instead of the network.
+
+#include "bark_push.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+static double toMilliseconds(std::chrono::nanoseconds duration)
+{
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+int main(int argc, char **argv)
+{
+    std::string trace_path;
+    std::string server = "http://127.0.0.1:8080/";
+    double speed = 1.0;
+    long simulate_ms = -1;
+    BarkDispatcherOptions options;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--trace")
+            trace_path = value;
+        else if (flag == "--server")
+            server = value;
+        else if (flag == "--speed")
+            speed = std::atof(value.c_str());
+        else if (flag == "--simulate-ms")
+            simulate_ms = std::atol(value.c_str());
+        else if (flag == "--rate")
+            options.requests_per_second = std::atof(value.c_str());
+        else if (flag == "--burst")
+            options.burst = std::atof(value.c_str());
+        else if (flag == "--window-ms")
+            options.coalesce_window = std::chrono::milliseconds(std::atol(value.c_str()));
+        else if (flag == "--workers")
+            options.worker_count = std::strtoul(value.c_str(), nullptr, 10);
+        else if (flag == "--batch")
+            options.max_batch_size = std::strtoul(value.c_str(), nullptr, 10);
+        else
+        {
+            std::cerr << "Unknown option " << flag << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<BarkTrafficRecord> records;
+    if (trace_path.empty() || !BarkTrafficRecorder::load(trace_path, records))
+    {
+        std::cerr << "Expected a readable --trace recording" << std::endl;
+        return 2;
+    }
+
+    auto scaled = [speed](std::chrono::microseconds offset)
+    {
+        if (speed <= 0.0)
+            return std::chrono::nanoseconds(0);
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::micro>(offset.count() / speed));
+    };
+
+    if (simulate_ms >= 0)
+    {
+        BarkSimulation simulation;
+        for (size_t i = 0; i < records.size(); ++i)
+            simulation.schedule(scaled(records[i].offset), records[i].synthesize(i));
+        std::chrono::milliseconds latency(simulate_ms);
+        BarkSimulationReport report = simulation.run(options, [latency](const BarkNotification &, std::chrono::nanoseconds)
+        {
+            return BarkSimulatedResponse{BarkError::SUCCESS, latency};
+        });
+
+        std::printf("records %zu, requests %llu, coalesced %llu, suppressed %llu, rejected %llu\n",
+                    records.size(), static_cast<unsigned long long>(report.requests),
+                    static_cast<unsigned long long>(report.coalesced),
+                    static_cast<unsigned long long>(report.suppressed),
+                    static_cast<unsigned long long>(report.rejected));
+        std::printf("simulated %.1f ms, %.1f notifications/s, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                    toMilliseconds(report.simulated_time), report.throughput,
+                    toMilliseconds(report.latency_p50), toMilliseconds(report.latency_p99),
+                    toMilliseconds(report.latency_max));
+        return 0;
+    }
+
+    BarkMetrics::instance().enable();
+    BarkMetrics::Snapshot before = BarkMetrics::instance().collect();
+    BarkDispatcher dispatcher(server, options);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        std::this_thread::sleep_until(start + scaled(records[i].offset));
+        dispatcher.enqueue(records[i].synthesize(i));
+    }
+    dispatcher.flush();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    dispatcher.stop();
+
+    BarkDispatcherStats stats = dispatcher.getStats();
+    BarkMetrics::Snapshot after = BarkMetrics::instance().collect();
+    BarkMetrics::HistogramSnapshot latency;
+    const BarkMetrics::HistogramSnapshot &from = before.histograms[BarkMetrics::SEND_LATENCY_US];
+    const BarkMetrics::HistogramSnapshot &to = after.histograms[BarkMetrics::SEND_LATENCY_US];
+    for (size_t b = 0; b <= BarkMetrics::kBuckets; ++b)
+        latency.buckets[b] = to.buckets[b] - from.buckets[b];
+    latency.sum = to.sum - from.sum;
+    latency.count = to.count - from.count;
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::printf("records %zu, requests %llu, failures %llu, coalesced %llu, rejected %llu\n",
+                records.size(), static_cast<unsigned long long>(stats.requests),
+                static_cast<unsigned long long>(stats.failures),
+                static_cast<unsigned long long>(stats.coalesced),
+                static_cast<unsigned long long>(stats.rejected));
+    std::printf("wall %.1f ms, %.1f notifications/s, request latency p50 <= %.2f ms, p99 <= %.2f ms, mean %.2f ms\n",
+                seconds * 1000.0, seconds > 0.0 ? stats.enqueued / seconds : 0.0,
+                barkHistogramQuantile(latency, 0.50) / 1000.0, barkHistogramQuantile(latency, 0.99) / 1000.0,
+                latency.count > 0 ? latency.sum / 1000.0 / latency.count : 0.0);
+    if (!dispatcher.getLastError().empty())
+        std::cerr << "last error: " << dispatcher.getLastError() << std::endl;
+    return stats.failures > 0 ? 1 : 0;
+}